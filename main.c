@@ -22,19 +22,32 @@
  *
  */
 
+
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "stuff.h"
-
-static inline void write_u16_LE(u8 *dest, u16 val) {
-	*dest++ = val & 0xFF;
-	*dest = val >> 8;
-	return;
-}
+#include "ovlazy.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>	//FICLONE
+#endif
 
 void print_header(const struct header *hdr) {
 
@@ -68,724 +81,1443 @@ void print_header(const struct header *hdr) {
 	return;
 }
 
-/* TODO: take care of endianness */
-static void read_header(struct header *dest_header, const u8 *buf) {
-	memcpy(dest_header, buf, sizeof(struct header));
-	return;
-}
 
+/******** sinks for the library : plain FILEs */
 
-// hax, get file length but restore position
-u32 flen(FILE *hf) {
-	long siz;
-	long orig;
+static void msg_file(void *ctx, const char *line) {
+	fputs(line, (FILE *) ctx);
+	return;
+}
 
-	if (!hf) return 0;
-	orig = ftell(hf);
-	if (orig < 0) return 0;
+static bool write_file(void *ctx, const void *data, size_t len) {
+	return (fwrite(data, 1, len, (FILE *) ctx) == len);
+}
 
-	if (fseek(hf, 0, SEEK_END)) return 0;
+/** output file that is only created on first write, so failed unfolds don't leave one behind.
+ * An existing file is removed rather than truncated : with --cache-link=hard it can be
+ * the same inode as a cache entry.
+ */
+struct lazy_file {
+	const char *fname;
+	FILE *f;
+	FILE *msgf;	//to report fopen errors
+};
+
+static bool write_lazy(void *ctx, const void *data, size_t len) {
+	struct lazy_file *lf = ctx;
+
+	if (!lf->f) {
+		remove(lf->fname);
+		lf->f = fopen(lf->fname, "wb");
+		if (!lf->f) {
+			fprintf(lf->msgf, "can't create outf\n");
+			return 0;
+		}
+	}
+	return (fwrite(data, 1, len, lf->f) == len);
+}
 
-	siz = ftell(hf);
-	if (siz < 0) siz=0;
-		//the rest of the code just won't work if siz = UINT32_MAX
-	#if (LONG_MAX >= UINT32_MAX)
-		if ((long long) siz == (long long) UINT32_MAX) siz = 0;
-	#endif
+/** seeking past the end leaves a hole, on filesystems that have them */
+static bool pwrite_lazy(void *ctx, const void *data, size_t len, u64 ofs) {
+	struct lazy_file *lf = ctx;
 
-	if (fseek(hf, orig, SEEK_SET)) return 0;
-	return (u32) siz;
+	if (!lf->f && !write_lazy(ctx, data, 0)) return 0;
+	if (fseek(lf->f, (long) ofs, SEEK_SET)) return 0;
+	return (fwrite(data, 1, len, lf->f) == len);
 }
 
+/** --flat : the image layout goes next to the image */
+static void layout_name(char *dest, size_t len, const char *unfold_fname) {
+	snprintf(dest, len, "%s.layout", unfold_fname);
+	return;
+}
 
-void close_exe(struct exefile *exf) {
-	if (exf->buf) {
-		free(exf->buf);
-		exf->buf = NULL;
-	}
+/** --map : the analysis script goes next to the unfolded file */
+static void map_name(char *dest, size_t len, const char *unfold_fname, enum map_fmt mapfmt) {
+	static const char *const ext[] = {[MAP_NONE] = "map", [MAP_IDC] = "idc", [MAP_GHIDRA] = "py", [MAP_R2] = "r2"};
+	snprintf(dest, len, "%s.%s", unfold_fname, ext[mapfmt]);
 	return;
 }
 
-bool parse_header(struct exefile *exf) {
-	struct header *hdr = &exf->hdr;
+/** for every overlay, create a "prefix_XXXX.ovl" file
+ */
+
+static void dump_ovls(const struct exefile *exf, const char *prefix, FILE *msgf) {
+	char fname[4096];
+	FILE *fbin;
+	u32 i;
 
-	bool validsig = (hdr->sigLo == 0x4D && hdr->sigHi == 0x5A);
-	if (!validsig) {
-		printf("bad MZ\n");
-		return 0;
+	if ((strlen(prefix) + sizeof("_0000")) > sizeof(fname)) {
+		fprintf(msgf, "filename too long\n");
+		return;
 	}
+	for (i = 0; i <= exf->num_ovls; i++) {
+		const struct ovl_desc *oda = &exf->ovls[i];
 
-	/* This is a typical DOS kludge! */
-	if (hdr->relocTabOffset == 0x40) {
-		printf("new exe\n");
-		return 0;
-	}
+		snprintf(fname, sizeof(fname), "%s_%04X", prefix, i);
+		fbin = fopen(fname, "wb");
+		if (!fbin) {
+			fprintf(msgf, "fopen\n");
+			return;
+		}
 
-	return 1;
+		if (fwrite(&exf->buf[oda->chunk_ofs], 1, oda->chunk_siz, fbin) != oda->chunk_siz) {
+			fprintf(msgf, "fwrite\n");
+			fclose(fbin);
+			return;
+		}
+		fclose(fbin);
+	}
+	if (exf->chain_end < exf->siz) {
+		fprintf(msgf, "bad MZ @ %d\n", i);
+	}
 }
 
 
-/** init exefile struct with complete .exe read into it.
- * exefile->buf must be free'd by caller
+/** create directory if needed */
+static void make_dir(const char *path) {
+#ifdef _WIN32
+	_mkdir(path);
+#else
+	mkdir(path, 0777);
+#endif
+	return;
+}
+
+/** dedup dump counters */
+struct dedup_stats {
+	u32 new_chunks;	//written to the store
+	u32 dup_chunks;	//already there
+	u64 new_bytes;
+	u64 dup_bytes;
+};
+
+/** add one chunk to the store as "<dir>/<hash>", unless a file of that size is already there.
+ * Written under a temporary name then renamed, so concurrent dumps can share the store.
+ * @return 0 if write failed
  */
-bool load_exe(struct exefile *exf, const char *filename) {
-	FILE   *fbin;
-	u32 file_len;
-	u8 *buf;
-
-	/* Open the input file */
-	if ((fbin = fopen(filename, "rb")) == NULL) {
-		printf("CANNOT_OPEN\n");
-		return 0;
+static bool store_chunk(const char *dir, u64 hash, const u8 *data, u32 len, struct dedup_stats *ds) {
+	char path[4096];
+	char tmp[4096 + 32];
+	FILE *f;
+	long siz = -1;
+	bool ok;
+
+	snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long) hash);
+	f = fopen(path, "rb");
+	if (f) {
+		if (!fseek(f, 0, SEEK_END)) siz = ftell(f);
+		fclose(f);
+		if (siz == (long) len) {
+			ds->dup_chunks++;
+			ds->dup_bytes += len;
+			return 1;
+		}
 	}
 
-	file_len = flen(fbin);
-	if ((!file_len) || (file_len > 2048*1024UL)) {
-		printf("huge file (length %lu)\n", (unsigned long) file_len);
-		fclose(fbin);
-		return 0;
+	snprintf(tmp, sizeof(tmp), "%s.%lu.%lx", path, (unsigned long) getpid(), (unsigned long) (uintptr_t) ds);
+	f = fopen(tmp, "wb");
+	if (!f) return 0;
+	ok = (fwrite(data, 1, len, f) == len);
+	if (fclose(f)) ok = 0;
+	if (ok) {
+		remove(path);	//rename() won't replace on win32
+		ok = !rename(tmp, path);
 	}
-	exf->siz = file_len;
-
-	buf = malloc(file_len);
-	if (!buf) {
-		printf("malloc choke\n");
-		fclose(fbin);
+	if (!ok) {
+		remove(tmp);
 		return 0;
 	}
+	ds->new_chunks++;
+	ds->new_bytes += len;
+	return 1;
+}
 
-	/* load whole ROM */
-	if (fread(buf,1,file_len,fbin) != file_len) {
-		printf("trouble reading\n");
-		free(buf);
-		fclose(fbin);
+/** like dump_ovls(), but every chunk goes once into a content-addressed store, named by its XXH64.
+ * "prefix.manifest" lists which chunk each overlay # is.
+ * @return 0 if anything failed
+ */
+static bool dump_ovls_dedup(const struct exefile *exf, const char *prefix, const char *store, FILE *msgf,
+					struct dedup_stats *ds) {
+	char fname[4096];
+	FILE *mf;
+	u32 i;
+
+	snprintf(fname, sizeof(fname), "%s.manifest", prefix);
+	mf = fopen(fname, "w");
+	if (!mf) {
+		fprintf(msgf, "fopen\n");
 		return 0;
 	}
-
-	fclose(fbin);
-
-	read_header(&exf->hdr, buf);
-	if (!parse_header(exf)) {
-		free(buf);
+	fprintf(mf, "ovl\tchunk_ofs\tchunk_siz\txxh64\n");
+	for (i = 0; i <= exf->num_ovls; i++) {
+		const struct ovl_desc *oda = &exf->ovls[i];
+		u64 hash = ovl_hash64(&exf->buf[oda->chunk_ofs], oda->chunk_siz, 0);
+
+		if (!store_chunk(store, hash, &exf->buf[oda->chunk_ofs], oda->chunk_siz, ds)) {
+			fprintf(msgf, "can't write chunk %04X to store\n", i);
+			fclose(mf);
+			return 0;
+		}
+		fprintf(mf, "%04X\t%08lX\t%08lX\t%016llx\n", i, (unsigned long) oda->chunk_ofs,
+				(unsigned long) oda->chunk_siz, (unsigned long long) hash);
+	}
+	if (fclose(mf)) {
+		fprintf(msgf, "fwrite\n");
 		return 0;
 	}
-
-	exf->buf = buf;
+	if (exf->chain_end < exf->siz) {
+		fprintf(msgf, "bad MZ @ %d\n", i);
+	}
 	return 1;
 }
 
-/** for every overlay, create a "prefix_XXXX.ovl" file
- */
-
-void dump_ovls(const struct exefile *exf, const char *prefix) {
-	char *fname;
-	FILE *fbin;
+void print_usage(const char *argv0) {
+	printf(	"**** %s\n"
+		"**** overlayed DOS exe tool\n"
+		"**** (c) 2017 fenugrec\n"
+		"Usage:\t%s <exefile> <command> [command options]]\n"
+		"\t%s --batch <command> [command options] [exefiles...]\n"
+		"Commands and options:\n"
+		"\tc : list all int 0x3F calls.\n"
+		"\tl : list overlays\n"
+		"\td : dump overlays to separate files\n"
+		"\tu <SEGLUT_POS> <OVLLUT_POS> <OVL_BASE>: unfold overlays\n"
+		"\t\tSEGLUT_POS : file offset of overlay segment LUT\n"
+		"\t\tOVLLUT_POS : file offset of overlay number LUT\n"
+		"\t\tLUT_ENTRIES : number of entries in LUT (at most 100)\n"
+		"\t\tOVL_BASE : loaded overlay's segment (relative to image base)\n"
+		"\ta : auto-unfold : find LUTs and OVL_BASE, then unfold like 'u'\n"
+		"\ts <SEGLUT_POS> <OVLLUT_POS> <LUT_ENTRIES> <OVL_BASE> : same args as 'u'; simulate the\n"
+		"\t\toverlay manager : cross-overlay call graph, overlay loads and bytes read with one\n"
+		"\t\toverlay area or a few LRU slots, overlays that swap the most\n"
+		"\tr <SEGLUT_POS> <OVLLUT_POS> <LUT_ENTRIES> <OVL_BASE> : refold : merge overlays that\n"
+		"\t\tswap each other out (per 's' profile) and write a new overlayed exe\n"
+		"\tb : benchmark int 0x3F scan, with and without --sweep\n"
+		"Options (anywhere after <exefile>):\n"
+		"\t--seg=first|closest : for new call relocs, reuse the first usable reloc segment\n"
+		"\t\tfound (default), or the one closest to the call site\n"
+		"\t--threads=N : split unfolding of one file over N threads\n"
+		"\t--sweep : only accept int 0x3F calls on instruction boundaries in code ('c', 'u', 'a', 's')\n"
+		"\t--relocfilter[=OVL_BASE] : 'c' drops calls that overlap root reloc items, and overlay\n"
+		"\t\treloc items too if given the overlay load segment (hex, as for 'u').\n"
+		"\t\t('u', 'a' always do, and skip calls on the LUTs too)\n"
+		"\t--elf : 'u', 'a' : write an ELF file instead of an .exe, with a section per overlay,\n"
+		"\t\tsymbols for int 0x3F call targets and reloc sections\n"
+		"\t--stream : 'u', 'a' : build and write the unfolded exe one chunk at a time instead of\n"
+		"\t\tall in memory; the stack / BSS gap becomes a hole in the file\n"
+		"\t--shard : 'u', 'a' : if the overlays don't fit in one unfolded exe, split them over\n"
+		"\t\t<outfile>.1, .2 ... each with the root, listed in <outfile>.shards\n"
+		"\t--packrelocs : 'u', 'a' : sort relocs of the unfolded exe, drop duplicates and\n"
+		"\t\tput them on a few canonical segments\n"
+		"\t--flat=SEG : 'u', 'a' : write a raw image relocated at segment SEG (hex) instead\n"
+		"\t\tof an .exe, and its layout (entry point, stack, segments) to <outfile>.layout\n"
+		"\t--map=idc|ghidra|r2 : 'u', 'a' : also write a script for IDA, Ghidra or radare2 that\n"
+		"\t\tcreates overlay segments, call xrefs and call targets, to <outfile>.idc|.py|.r2\n"
+		"\t--map-seg=SEG : segment (hex) where the disassembler loaded the unfolded file. Default\n"
+		"\t\t1000 for an .exe (0 for r2), SEG of --flat, 0 for --elf\n"
+		"\t--trace=FILE : 's' also replays a recorded run, 'r' uses it instead of the call graph\n"
+		"\t--pattern=NAME:HEX[:OPERANDS] : 'c' only : also looks for another overlay call encoding, all in\n"
+		"\t\tone pass, and tells which one matched. OPERANDS : i = ovl ID byte, n = overlay # word,\n"
+		"\t\to = offset word, b / w = other byte / word. Can be repeated; e.g. --pattern=int3e:CD3E:io\n"
+		"\t--format=text|jsonl|bin : output format for 'l' and 'c' (bin : see README)\n"
+		"\t--out=FILE : unfolded exe for 'u' and 'a', refolded for 'r' (default test.ex_)\n"
+		"\t--min-confidence=N : auto-unfold only if the LUTs explain N%% of calls (default 50)\n"
+		"\t--store=DIR : 'd' writes each distinct chunk once to DIR, named by its hash, and\n"
+		"\t\tlists them in <exefile>.manifest\n"
+		"\t--cache=DIR : keep results of 'c', 'u' and 'a' in DIR, and reuse them for identical\n"
+		"\t\tinput file, command and options\n"
+		"\t--cache-link=copy|hard|reflink : how a cached unfolded exe is put in place (default copy)\n"
+		"\t--stats : print time spent in each phase (load, and unfold phases for 'u', 'a') and\n"
+		"\t\tcounters : bytes scanned, calls, relocs, segment search steps, bytes written\n"
+		"\t--stats=json : same, as one JSON object per file\n"
+		"Batch mode: run command on every file, output for each goes to <exefile>.<command>.txt\n"
+		"(and <exefile>.ex_ for 'u', 'a', 'r'). A summary is printed at the end.\n"
+		"\t--list=FILE : also read exe filenames from FILE, one per line ('-' = stdin).\n"
+		"\t\tIf no files are given at all, they are read from stdin.\n"
+		"\t--jobs=N : # of worker threads (default: # of CPUs)\n",
+		argv0, argv0, argv0);
+	return;
 
-	u32 chunksiz;
-	struct header hdr;
-	u32 ofs = 0;	//in main exe file
-	u16 i=0;
+}
 
-	while (ofs < exf->siz) {
-		char suffix[10];
-		//1) get chunk header
-		read_header(&hdr, &exf->buf[ofs]);
+/** how a cached unfolded exe is put in place of the output file */
+enum cache_link {
+	CLINK_COPY,
+	CLINK_HARD,	//output and cache entry are the same file : don't modify either !
+	CLINK_REFLINK,	//copy-on-write clone where the filesystem can (btrfs, XFS ...), else copy
+};
+
+struct cache_opts {
+	const char *dir;	//NULL : no cache
+	enum cache_link link;
+};
+
+/** --stats : per-phase times and counters, after each file's output */
+enum stats_fmt {STATS_NONE = 0, STATS_TEXT, STATS_JSON};
+
+/** command-line options */
+struct cli_opts {
+	struct cache_opts cache;
+	const char *store;	//'d' : dedup store directory
+	enum stats_fmt stats;
+	struct unfold_opts uo;
+	long map_seg;	//-1 : default for uo.ufmt and uo.mapfmt
+	const char *tracefile;	//'s'
+	struct call_pattern pats[OVL_MAXPATS];	//'c' : [0] is ovl_pat_msc, then --pattern ones
+	unsigned npats;
+	bool relocfilter;	//'c'
+	u16 relocbase;	//'c' : OVL_BASE for overlay relocs, 0 = root only
+	bool shard;	//'u', 'a'
+	unsigned min_confidence;	//auto-unfold : % of calls explained by LUT guess
+	enum outfmt fmt;	//'l', 'c' listings
+	const char *outname;	//unfolded exe, single file mode
+	bool batch;
+	const char *listfile;	//batch : file with list of exe filenames
+	unsigned jobs;	//batch : # of worker threads, 0 = auto
+};
+
+/** --pattern=NAME:HEX[:OPERANDS], e.g. "msc:CD3F:io" */
+static bool parse_pattern(struct call_pattern *pat, const char *spec) {
+	const char *c = strchr(spec, ':');
+	size_t len;
+
+	memset(pat, 0, sizeof(*pat));
+	if (!c || (c == spec) || ((size_t) (c - spec) >= sizeof(pat->name))) return 0;
+	memcpy(pat->name, spec, c - spec);
+	for (c++; isxdigit((unsigned char) c[0]) && isxdigit((unsigned char) c[1]); c += 2) {
+		unsigned byte;
+		if (pat->len == OVL_PAT_MAXLEN) return 0;
+		if (sscanf(c, "%2x", &byte) != 1) return 0;
+		pat->bytes[pat->len++] = byte;
+	}
+	if (!pat->len) return 0;
+	if (!*c) return 1;
+	if (*c != ':') return 0;
+	len = strlen(++c);
+	if (len >= sizeof(pat->operands)) return 0;
+	memcpy(pat->operands, c, len);
+	pat->fixup = PATFIX_NONE;
+	return 1;
+}
 
-		//2) check MZ
-		bool validsig = (hdr.sigLo == 0x4D && hdr.sigHi == 0x5A);
-		if (!validsig) {
-			printf("bad MZ @ %d\n", i);
-			return;
-		}
+/** parse one "--name=value" option
+ * @return 0 if unknown / bad value
+ */
+static bool parse_option(struct cli_opts *co, const char *opt) {
+	if (!strcmp(opt, "--seg=first")) {
+		co->uo.segpick = SEGPICK_FIRST;
+		return 1;
+	}
+	if (!strcmp(opt, "--seg=closest")) {
+		co->uo.segpick = SEGPICK_CLOSEST;
+		return 1;
+	}
+	if (!strncmp(opt, "--threads=", 10)) {
+		if (sscanf(&opt[10], "%u", &co->uo.threads) != 1) return 0;
+		return (co->uo.threads > 0);
+	}
+	if (!strcmp(opt, "--sweep")) {
+		co->uo.sweep = 1;
+		return 1;
+	}
+	if (!strcmp(opt, "--relocfilter")) {
+		co->relocfilter = 1;
+		return 1;
+	}
+	if (!strncmp(opt, "--relocfilter=", 14)) {
+		unsigned seg;
+		if (sscanf(&opt[14], "%x", &seg) != 1) return 0;
+		if (!seg || (seg > 0xFFFF)) return 0;
+		co->relocfilter = 1;
+		co->relocbase = seg;
+		return 1;
+	}
+	if (!strcmp(opt, "--shard")) {
+		co->shard = 1;
+		return 1;
+	}
+	if (!strncmp(opt, "--flat=", 7)) {
+		unsigned seg;
+		if (sscanf(&opt[7], "%x", &seg) != 1) return 0;
+		if (seg > 0xFFFF) return 0;
+		co->uo.ufmt = UNFOLD_FLAT;
+		co->uo.load_seg = seg;
+		return 1;
+	}
+	if (!strcmp(opt, "--elf")) {
+		co->uo.ufmt = UNFOLD_ELF;
+		return 1;
+	}
+	if (!strcmp(opt, "--map=idc")) {
+		co->uo.mapfmt = MAP_IDC;
+		return 1;
+	}
+	if (!strcmp(opt, "--map=ghidra")) {
+		co->uo.mapfmt = MAP_GHIDRA;
+		return 1;
+	}
+	if (!strcmp(opt, "--map=r2")) {
+		co->uo.mapfmt = MAP_R2;
+		return 1;
+	}
+	if (!strncmp(opt, "--map-seg=", 10)) {
+		if (sscanf(&opt[10], "%lx", &co->map_seg) != 1) return 0;
+		return (co->map_seg >= 0) && (co->map_seg <= 0xFFFF);
+	}
+	if (!strcmp(opt, "--stats")) {
+		co->stats = STATS_TEXT;
+		return 1;
+	}
+	if (!strcmp(opt, "--stats=json")) {
+		co->stats = STATS_JSON;
+		return 1;
+	}
+	if (!strcmp(opt, "--stream")) {
+		co->uo.stream = 1;
+		return 1;
+	}
+	if (!strncmp(opt, "--pattern=", 10)) {
+		if (co->npats == (OVL_MAXPATS - 1)) return 0;
+		return parse_pattern(&co->pats[1 + co->npats++], &opt[10]);
+	}
+	if (!strncmp(opt, "--trace=", 8) && opt[8]) {
+		co->tracefile = &opt[8];
+		return 1;
+	}
+	if (!strcmp(opt, "--packrelocs")) {
+		co->uo.packrelocs = 1;
+		return 1;
+	}
+	if (!strncmp(opt, "--min-confidence=", 17)) {
+		if (sscanf(&opt[17], "%u", &co->min_confidence) != 1) return 0;
+		return (co->min_confidence <= 100);
+	}
+	if (!strcmp(opt, "--format=text")) {
+		co->fmt = FMT_TEXT;
+		return 1;
+	}
+	if (!strcmp(opt, "--format=jsonl")) {
+		co->fmt = FMT_JSONL;
+		return 1;
+	}
+	if (!strcmp(opt, "--format=bin")) {
+		co->fmt = FMT_BIN;
+		return 1;
+	}
+	if (!strncmp(opt, "--out=", 6) && opt[6]) {
+		co->outname = &opt[6];
+		return 1;
+	}
+	if (!strcmp(opt, "--batch")) {
+		co->batch = 1;
+		return 1;
+	}
+	if (!strncmp(opt, "--list=", 7) && opt[7]) {
+		co->listfile = &opt[7];
+		return 1;
+	}
+	if (!strncmp(opt, "--store=", 8) && opt[8]) {
+		co->store = &opt[8];
+		return 1;
+	}
+	if (!strncmp(opt, "--cache=", 8) && opt[8]) {
+		co->cache.dir = &opt[8];
+		return 1;
+	}
+	if (!strcmp(opt, "--cache-link=copy")) {
+		co->cache.link = CLINK_COPY;
+		return 1;
+	}
+	if (!strcmp(opt, "--cache-link=hard")) {
+		co->cache.link = CLINK_HARD;
+		return 1;
+	}
+	if (!strcmp(opt, "--cache-link=reflink")) {
+		co->cache.link = CLINK_REFLINK;
+		return 1;
+	}
+	if (!strncmp(opt, "--jobs=", 7)) {
+		if (sscanf(&opt[7], "%u", &co->jobs) != 1) return 0;
+		return (co->jobs > 0);
+	}
+	return 0;
+}
 
-		chunksiz = 512 * hdr.numPages;
+/** where the disassembler put the unfolded file, unless --map-seg says otherwise :
+ * IDA and Ghidra load an .exe at 1000:0000, r2 at 0000:0000; raw and ELF images go where they say.
+ */
+static u16 default_map_seg(const struct cli_opts *co) {
+	if (co->map_seg >= 0) return (u16) co->map_seg;
+	switch (co->uo.ufmt) {
+	case UNFOLD_FLAT:
+		return co->uo.load_seg;
+	case UNFOLD_ELF:
+		return 0;
+	case UNFOLD_MZ:
+	default:
+		return (co->uo.mapfmt == MAP_R2) ? 0 : 0x1000;
+	}
+}
 
-		snprintf(suffix, sizeof(suffix), "_%04X", i);
-		fname = malloc(strlen(prefix) + strlen(suffix) + 1);
-		if (!fname) {
-			printf("malloc\n");
-			return;
+/** a command and its arguments, applied to one or more files */
+struct cmd {
+	char op;	//'l', 'c', 'd', 'u', 'a', 'b', 's', 'r'
+	struct lut_params lp;	//'u', 's', 'r'
+	struct sim_opts so;	//'s', 'r'
+	const struct ovl_patset *ps;	//'c' : NULL = MSC int 0x3F only
+	bool relocfilter;	//'c' : drop calls on reloc items
+	u16 relocbase;	//OVL_BASE to place overlay reloc items; 0 : root relocs only
+	bool shard;	//'u', 'a' : split in several exes if the overlays don't fit in one
+	struct unfold_opts uo;
+	unsigned min_confidence;
+	enum outfmt fmt;
+	struct cache_opts cache;
+	const char *store;	//'d' : dedup store directory
+	enum stats_fmt stats;
+};
+
+enum cache_state {CACHE_OFF = 0, CACHE_HIT, CACHE_MISS};
+
+/** per-file results, for the batch summary */
+struct job_result {
+	bool ok;
+	u32 num_ovls;
+	u32 ncalls;	//'c' : # of int 0x3F hits; 'u', 'a' : # of fixups; 's' : calls in graph
+	enum cache_state cache;
+	struct dedup_stats dedup;	//'d' with a store
+	struct ovl_stats stats;	//'u', 'a' with --stats
+	double load_t;	//--stats : seconds
+	double total_t;
+};
+
+/** parse command and its args.
+ * @return # of args consumed, including the command itself; 0 if bad
+ */
+static int parse_cmd(struct cmd *cmd, int argc, char *argv[]) {
+	if (argc < 1) return 0;
+	if (strlen(argv[0]) != 1) return 0;
+
+	cmd->op = argv[0][0];
+	switch (cmd->op) {
+	case 'l':
+	case 'd':
+	case 'c':
+	case 'a':
+	case 'b':
+		return 1;
+	case 'u':
+	case 's':
+	case 'r': {
+		unsigned long seglut, olut;
+		unsigned lut_entries, ovlbase;
+		if (argc < 5) return 0;
+		if (sscanf(argv[1], "%lx", &seglut) != 1) return 0;
+		if (sscanf(argv[2], "%lx", &olut) != 1) return 0;
+		if (sscanf(argv[3], "%x", &lut_entries) != 1) return 0;
+		if (sscanf(argv[4], "%x", &ovlbase) != 1) return 0;
+		if (ovlbase >= 0xFFFF) return 0;
+		if (!lut_entries || (lut_entries > OVL_LUT_MAXENTRIES)) return 0;
+		cmd->lp.seglut_pos = seglut;
+		cmd->lp.olut_pos = olut;
+		cmd->lp.lut_entries = lut_entries;
+		cmd->lp.ovl_base = ovlbase;
+		return 5;
 		}
+	default:
+		break;
+	}
+	return 0;
+}
 
-		strcpy(fname, prefix);
-		strcat(fname, suffix);
-
-		fbin = fopen(fname, "wb");
-		if (!fbin) {
-			printf("fopen\n");
-			free(fname);
-			return;
-		}
-		free(fname);
+/** --shard : unfold as usual if the overlays fit, else one exe per shard (see ovl_shard_plan()),
+ * named <unfold_fname>.1, .2 ... and listed in <unfold_fname>.shards
+ *
+ * @param out : unfolded exe, if not sharded
+ * @param fixups : (output) # of int 0x3F calls patched in all shards
+ */
+static enum ovl_err unfold_shards(const struct cmd *cmd, struct exefile *exf, struct unfold_opts *uo,
+					const struct ovl_sink *out, const char *unfold_fname, FILE *outf, u32 *fixups) {
+	struct lut_params lp = cmd->lp;
+	char fname[4096];
+	u32 *first;
+	u32 nshards, s;
+	FILE *mf;
+	enum ovl_err rv = OVL_OK;
+
+	*fixups = 0;
+	first = malloc((exf->num_ovls + 1) * sizeof(u32));
+	nshards = first ? ovl_shard_plan(exf, first) : 0;
+	if (nshards < 2) {
+		//fits, or can't be split : a plain unfold does or tells why
+		free(first);
+		if (cmd->op == 'a') return ovl_auto_unfold(exf, uo, cmd->min_confidence, out, NULL, fixups);
+		return ovl_unfold(exf, &lp, uo, out, fixups);
+	}
 
-		if (fwrite(&exf->buf[ofs], 512, hdr.numPages, fbin) != hdr.numPages) {
-			printf("fwrite\n");
-			fclose(fbin);
-			return;
+	snprintf(fname, sizeof(fname), "%s.shards", unfold_fname);
+	mf = fopen(fname, "w");
+	if (!mf) {
+		fprintf(outf, "fopen\n");
+		free(first);
+		return OVL_EWRITE;
+	}
+	fprintf(outf, "%lu overlays in %lu shards\n", (unsigned long) exf->num_ovls, (unsigned long) nshards);
+	fprintf(mf, "shard\tfile\tfirst_ovl\tlast_ovl\tfixups\n");
+	for (s = 0; s < nshards; s++) {
+		struct lazy_file lf = {fname, NULL, outf};
+		struct ovl_sink shard_out = {write_lazy, &lf, pwrite_lazy};
+		u32 n = 0;
+
+		snprintf(fname, sizeof(fname), "%s.%lu", unfold_fname, (unsigned long) (s + 1));
+		uo->ovl_first = first[s];
+		uo->ovl_last = first[s + 1] - 1;
+		if ((cmd->op == 'a') && !s) {
+			//guess LUTs once
+			rv = ovl_auto_unfold(exf, uo, cmd->min_confidence, &shard_out, &lp, &n);
+		} else {
+			rv = ovl_unfold(exf, &lp, uo, &shard_out, &n);
 		}
-		fclose(fbin);
-
-		i++;
-		ofs += chunksiz;
+		if (lf.f && fclose(lf.f) && (rv == OVL_OK)) rv = OVL_EWRITE;
+		if (rv != OVL_OK) break;
+		fprintf(mf, "%lu\t%s\t%04lX\t%04lX\t%lX\n", (unsigned long) (s + 1), fname,
+				(unsigned long) uo->ovl_first, (unsigned long) uo->ovl_last, (unsigned long) n);
+		*fixups += n;
 	}
+	if (fclose(mf) && (rv == OVL_OK)) rv = OVL_EWRITE;
+	free(first);
+	return rv;
 }
 
-
-/** raw search for all "int 0x3F" calls
- *
- * @param enable_print : quiet mode if 0
+/** run command on one file.
  *
- * @return # of OVL calls found
+ * @param outf : listings and diagnostics go here
+ * @param unfold_fname : output filename for 'u'
+ * @param res : results for summary
+ * @param arena : for unfolding, can be NULL
  *
- * expect lots of spurious hits due to no filtering.
+ * @return 0 if anything failed
  */
-u32 dump_ovlcalls(const u8 *imgbuf, u32 bufiz, bool enable_print) {
-#define PATLEN 5
-#define MATCHLEN 2
-	const u8 pat[MATCHLEN]={0xCD, 0x3F};	//pattern
-
-	u32 ncalls = 0;
-	u32 ofs = 0;	//within exe file
-
-	if (enable_print) {
-		printf(	"file_ofs\t"
-				"ovl_idx\t"
-				"offs\n"
-				);
-	}
-
-	while ((ofs + PATLEN) < bufiz) {
-		int i;
-		bool match = 1;
-		for (i=0; i < MATCHLEN; i++) {
-			if (imgbuf[ofs + i] != pat[i]) {
-				match = 0;
-				break;
-			}
+static bool run_cmd(const struct cmd *cmd, const char *fname, const char *unfold_fname, FILE *outf, struct job_result *res,
+				struct ovl_arena *arena) {
+	struct exefile exf;
+	struct ovl_env env = {0};
+	struct unfold_opts uo = cmd->uo;
+	struct ovl_sink out = {write_file, outf, NULL};
+	struct lazy_file lf = {unfold_fname, NULL, outf};
+	struct ovl_sink unfold_out = {write_lazy, &lf, pwrite_lazy};
+	char layout_fname[4096];
+	struct lazy_file llf = {layout_fname, NULL, outf};
+	struct ovl_sink layout_out = {write_lazy, &llf, NULL};
+	char map_fname[4096];
+	struct lazy_file mlf = {map_fname, NULL, outf};
+	struct ovl_sink map_out = {write_lazy, &mlf, NULL};
+	double t0 = ovl_clock();
+	enum ovl_err rv;
+
+	memset(res, 0, sizeof(*res));
+	env.msg = msg_file;
+	env.msg_ctx = outf;
+	uo.arena = arena;
+	if (uo.ufmt == UNFOLD_FLAT) {
+		layout_name(layout_fname, sizeof(layout_fname), unfold_fname);
+		uo.layout = &layout_out;
+	}
+	if (uo.mapfmt != MAP_NONE) {
+		map_name(map_fname, sizeof(map_fname), unfold_fname, uo.mapfmt);
+		uo.map = &map_out;
+	}
+	if (cmd->stats) uo.stats = &res->stats;
+
+	// only unfolding needs a writable buffer
+	rv = ovl_load_file(&exf, &env, fname, (cmd->op == 'u') || (cmd->op == 'a'));
+	res->load_t = ovl_clock() - t0;
+	if (rv != OVL_OK) {
+		fprintf(outf, "Trouble in loadexe\n");
+		ovl_close(&exf);
+		return 0;
+	}
+	res->num_ovls = exf.num_ovls;
+
+	switch (cmd->op) {
+	case 'l':
+		rv = ovl_list(&exf, cmd->fmt, &out);
+		break;
+	case 'd':
+		if (!cmd->store) {
+			dump_ovls(&exf, fname, outf);
+			break;
 		}
-		if (match) {
-			u16 ovl_offs = read_u16_LE(&imgbuf[ofs+3]);
-			ncalls++;
-			if (enable_print) {
-					printf("%04X\t%02X\t%04X\n",
-						ofs, (unsigned) imgbuf[ofs+2], (unsigned) ovl_offs );
-			}
+		if (!dump_ovls_dedup(&exf, fname, cmd->store, outf, &res->dedup)) rv = OVL_EWRITE;
+		break;
+	case 'c':
+		if (cmd->ps) {
+			rv = ovl_list_patcalls(&exf, cmd->ps, cmd->uo.sweep, cmd->relocfilter, cmd->relocbase, cmd->fmt, &out, &res->ncalls);
+			break;
 		}
-		ofs++;
+		rv = ovl_list_calls(&exf, cmd->uo.sweep, cmd->relocfilter, cmd->relocbase, cmd->fmt, &out, &res->ncalls);
+		break;
+	case 'b': {
+		struct scan_bench sb;
+		rv = ovl_bench_scan(&exf, &sb);
+		if (rv != OVL_OK) break;
+		fprintf(outf, "code bytes : %lu\n", (unsigned long) sb.codebytes);
+		fprintf(outf, "scan  : %lu calls, %.3f ms, %.1f MB/s\n",
+				(unsigned long) sb.raw_calls, sb.raw_t * 1e3, sb.codebytes / sb.raw_t / 1e6);
+		fprintf(outf, "sweep : %lu calls, %.3f ms, %.1f MB/s (%.2fx scan time)\n",
+				(unsigned long) sb.sweep_calls, sb.sweep_t * 1e3, sb.codebytes / sb.sweep_t / 1e6, sb.sweep_t / sb.raw_t);
+		break;
+		}
+	case 'u':
+		if (cmd->shard) {
+			rv = unfold_shards(cmd, &exf, &uo, &unfold_out, unfold_fname, outf, &res->ncalls);
+			break;
+		}
+		rv = ovl_unfold(&exf, &cmd->lp, &uo, &unfold_out, &res->ncalls);
+		break;
+	case 'a':
+		if (cmd->shard) {
+			rv = unfold_shards(cmd, &exf, &uo, &unfold_out, unfold_fname, outf, &res->ncalls);
+			break;
+		}
+		rv = ovl_auto_unfold(&exf, &uo, cmd->min_confidence, &unfold_out, NULL, &res->ncalls);
+		break;
+	case 's': {
+		struct sim_opts so = cmd->so;
+		so.sweep = cmd->uo.sweep;
+		rv = ovl_simulate(&exf, &cmd->lp, &so, &out, &res->ncalls);
+		break;
+		}
+	case 'r': {
+		struct sim_opts so = cmd->so;
+		so.sweep = cmd->uo.sweep;
+		rv = ovl_refold(&exf, &cmd->lp, &so, &unfold_out, NULL);
+		break;
+		}
+	default:
+		rv = OVL_EARGS;
+		break;
 	}
-	return ncalls;
+	ovl_close(&exf);
+	if (lf.f && fclose(lf.f) && (rv == OVL_OK)) rv = OVL_EWRITE;
+	if (llf.f && fclose(llf.f) && (rv == OVL_OK)) rv = OVL_EWRITE;
+	if (mlf.f && fclose(mlf.f) && (rv == OVL_OK)) rv = OVL_EWRITE;
+	res->total_t = ovl_clock() - t0;
+
+	res->ok = (rv == OVL_OK);
+	return res->ok;
 }
 
-/** print list of overlay chunks and their headers
-*/
-void list_ovls(const struct exefile *exf) {
-	u32 chunksiz;
-	struct header hdr;
-	u32 ofs = 0;	//in main exe file
-	u16 i=0;
+/******** result cache
+ *
+ * Results of 'c', 'u' and 'a' are kept in a directory, keyed by a hash of the input file and
+ * of everything that changes the output : command, LUT params, options. An entry is
+ *	<key>.log : everything the command printed
+ *	<key>.ex_ : unfolded exe ('u', 'a')
+ *	<key>.lay : image layout (--flat)
+ *	<key>.map : analysis script (--map)
+ *	<key>.res : numbers for the batch summary. Written last : entries without it are incomplete.
+ * Files are written under temporary names then renamed, so concurrent runs sharing a
+ * directory only see complete files. Only successful runs are cached.
+ */
 
-	printf(	"OVL #\t"
-			"start(file ofs)\t"
-			"img siz\t"
+#define CACHE_VERSION	3	//bump when output for a given input changes
 
-			"# relocs\t"
-			"Offset to load image (parags)\t"
-			"Minimum alloc (parags)\t"
-			"Maximum alloc (parags)\t"
+static bool cacheable(char op) {
+	return (op == 'c') || (op == 'u') || (op == 'a');
+}
 
-			"Initial SS:SP\t"
-			"Initial CS:IP\t"
-			"\n");
-	while (ofs < exf->siz) {
-		u32 img_siz;
-		//1) get chunk header
-		read_header(&hdr, &exf->buf[ofs]);
-
-		//2) check MZ
-		bool validsig = (hdr.sigLo == 0x4D && hdr.sigHi == 0x5A);
-		if (!validsig) {
-			printf("bad MZ @ %d\n", i);
-			return;
+/** hash of the command and what affects its output. --threads doesn't. */
+static u64 cmd_hash(const struct cmd *cmd, u64 filehash) {
+	u8 key[48];
+	u32 k = 0;
+
+	key[k++] = CACHE_VERSION;
+	key[k++] = (u8) cmd->op;
+	key[k++] = (u8) cmd->fmt;
+	key[k++] = cmd->uo.sweep;
+	key[k++] = cmd->relocfilter;
+	memcpy(&key[k], &cmd->relocbase, 2);
+	k += 2;
+	key[k++] = (u8) cmd->uo.segpick;
+	key[k++] = cmd->uo.packrelocs;
+	key[k++] = (u8) cmd->uo.ufmt;
+	memcpy(&key[k], &cmd->uo.load_seg, 2);
+	k += 2;
+	key[k++] = (u8) cmd->uo.mapfmt;
+	memcpy(&key[k], &cmd->uo.map_seg, 2);
+	k += 2;
+	if (cmd->op == 'u') {
+		memcpy(&key[k], &cmd->lp.seglut_pos, 4);
+		k += 4;
+		memcpy(&key[k], &cmd->lp.olut_pos, 4);
+		k += 4;
+		memcpy(&key[k], &cmd->lp.lut_entries, 2);
+		k += 2;
+		memcpy(&key[k], &cmd->lp.ovl_base, 2);
+		k += 2;
+	}
+	if (cmd->op == 'a') {
+		key[k++] = (u8) cmd->min_confidence;
+	}
+	if (cmd->ps) {
+		u64 pathash = 0;
+		unsigned p;
+		for (p = 0; p < cmd->ps->npats; p++) {
+			const struct call_pattern *pat = &cmd->ps->pats[p];
+			pathash = ovl_hash64(pat->name, strlen(pat->name) + 1, pathash);
+			pathash = ovl_hash64(pat->bytes, pat->len, pathash);
+			pathash = ovl_hash64(pat->operands, strlen(pat->operands) + 1, pathash);
 		}
+		memcpy(&key[k], &pathash, 8);
+		k += 8;
+	}
+	return ovl_hash64(key, k, filehash);
+}
 
-		chunksiz = 512 * hdr.numPages;
-		img_siz = (chunksiz + hdr.lastPageSize - 512) - (hdr.numParaHeader * 16);
-		printf(	"%04X\t%08X\t%08X\t"
-				"%04X\t%04X\t%04X\t%04X\t"
-				"%04X:%04X\t%04X:%04X"
-				"\n",
-				i, ofs, img_siz,
-
-				hdr.numReloc,
-				hdr.numParaHeader,
-				hdr.minAlloc,
-				hdr.maxAlloc,
+static bool copy_stream(FILE *src, FILE *dst) {
+	char buf[64 * 1024];
+	size_t len;
 
-				hdr.initSS,
-				hdr.initSP,
-				hdr.initCS,
-				hdr.initIP
-				);
-		i++;
-		ofs += chunksiz;
+	while ((len = fread(buf, 1, sizeof(buf), src))) {
+		if (fwrite(buf, 1, len, dst) != len) return 0;
 	}
+	return !ferror(src);
 }
 
-/** count # of overlays in a given buf
- * excludes the root overlay (# 0)
- *
- * In case of malformed input, this just stops counting and so could return 0.
- */
-u16 count_ovls(const u8 *buf, u32 siz) {
-	u32 ofs = 0;
-	struct header hdr;
-	u16 i = 0;
-
-	while (ofs < siz) {
-		u32 chunksiz;
-		//1) get chunk header
-		read_header(&hdr, &buf[ofs]);
-
-		i++;
-		//2) check MZ
-		bool validsig = (hdr.sigLo == 0x4D && hdr.sigHi == 0x5A);
-		if (!validsig) {
-			break;
-		}
+static bool copy_file(const char *src, const char *dst) {
+	FILE *fs, *fd;
+	bool ok;
 
-		chunksiz = 512 * hdr.numPages;
+	fs = fopen(src, "rb");
+	if (!fs) return 0;
+	fd = fopen(dst, "wb");
+	if (!fd) {
+		fclose(fs);
+		return 0;
+	}
+	ok = copy_stream(fs, fd);
+	fclose(fs);
+	if (fclose(fd)) ok = 0;
+	if (!ok) remove(dst);
+	return ok;
+}
 
-		ofs += chunksiz;
+/** make dst a copy of src, by the cheapest way allowed. dst is replaced. */
+static bool place_file(const char *src, const char *dst, enum cache_link how) {
+	remove(dst);
+#ifndef _WIN32
+	if ((how == CLINK_HARD) && !link(src, dst)) return 1;
+#endif
+#ifdef FICLONE
+	if (how == CLINK_REFLINK) {
+		int sfd, dfd;
+		bool cloned = 0;
+
+		sfd = open(src, O_RDONLY);
+		if (sfd >= 0) {
+			dfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+			if (dfd >= 0) {
+				cloned = !ioctl(dfd, FICLONE, sfd);
+				close(dfd);
+				if (!cloned) remove(dst);
+			}
+			close(sfd);
+		}
+		if (cloned) return 1;
 	}
-	i--;
-	return i;
+#endif
+	return copy_file(src, dst);
 }
 
-/** parse all overlays, including root OVL_000
- * returns an array of "struct ovl_desc" that must be free'd by caller
- * Assumes no bad data.
- *
- * @param num_ovls number of overlays *excluding the root*.
- *
- * so the array index can be the overlay #, as intended.
- */
-struct ovl_desc *parse_ovls(const u8 *buf, u32 siz, u16 num_ovls) {
-	struct ovl_desc *od_arr;
-	u16 i = 0;
-	u32 ofs = 0;
+struct cache_entry {
+	char base[4096];	//"<dir>/<key>"
+	char path[4096 + 8];	//scratch for base + extension
+	char tmp[4096 + 32];	//scratch for temporary names
+};
 
-	od_arr = malloc((num_ovls + 1) * sizeof(struct ovl_desc));
-	if (!od_arr) return NULL;
+static const char *centry_path(struct cache_entry *ce, const char *ext) {
+	snprintf(ce->path, sizeof(ce->path), "%s.%s", ce->base, ext);
+	return ce->path;
+}
 
-	while (i <= num_ovls) {
-		u32 chunksiz;
-		struct ovl_desc *oda;
-		struct header *hdr;	//shortcuts
+/** temporary name, unique among concurrent jobs and processes */
+static const char *centry_tmp(struct cache_entry *ce, const char *ext, const void *job) {
+	snprintf(ce->tmp, sizeof(ce->tmp), "%s.%s.%lu.%lx", ce->base, ext,
+			(unsigned long) getpid(), (unsigned long) (uintptr_t) job);
+	return ce->tmp;
+}
 
-		oda = &od_arr[i];
-		hdr = &oda->hdr;
+/** move a finished temporary file into the entry */
+static bool centry_commit(struct cache_entry *ce, const char *ext) {
+	if (!rename(ce->tmp, centry_path(ce, ext))) return 1;
+	remove(ce->tmp);
+	return 0;
+}
 
-		//get chunk header
-		read_header(hdr, &buf[ofs]);
+/** try to satisfy the command from the cache entry.
+ * @return 0 if no usable entry
+ */
+static bool cache_lookup(const struct cmd *cmd, struct cache_entry *ce, const char *unfold_fname,
+				FILE *outf, struct job_result *res) {
+	FILE *f;
+	unsigned num_ovls;
+	unsigned long ncalls;
+	int got;
+
+	f = fopen(centry_path(ce, "res"), "r");
+	if (!f) return 0;
+	got = fscanf(f, "%u %lu", &num_ovls, &ncalls);
+	fclose(f);
+	if (got != 2) return 0;
+
+	if ((cmd->op == 'u') || (cmd->op == 'a')) {
+		if (!place_file(centry_path(ce, "ex_"), unfold_fname, cmd->cache.link)) return 0;
+	}
+	if (((cmd->op == 'u') || (cmd->op == 'a')) && (cmd->uo.ufmt == UNFOLD_FLAT)) {
+		char layout_fname[4096];
+		layout_name(layout_fname, sizeof(layout_fname), unfold_fname);
+		if (!place_file(centry_path(ce, "lay"), layout_fname, CLINK_COPY)) return 0;
+	}
+	if (((cmd->op == 'u') || (cmd->op == 'a')) && (cmd->uo.mapfmt != MAP_NONE)) {
+		char map_fname[4096];
+		map_name(map_fname, sizeof(map_fname), unfold_fname, cmd->uo.mapfmt);
+		if (!place_file(centry_path(ce, "map"), map_fname, CLINK_COPY)) return 0;
+	}
+	f = fopen(centry_path(ce, "log"), "rb");
+	if (!f) return 0;
+	copy_stream(f, outf);
+	fclose(f);
+
+	res->ok = 1;
+	res->num_ovls = num_ovls;
+	res->ncalls = ncalls;
+	return 1;
+}
 
-		chunksiz = 512 * hdr->numPages;
-		// fill in descriptor
-		oda->img_ofs = ofs + (hdr->numParaHeader * 16);
-		oda->img_siz = (chunksiz + hdr->lastPageSize - 512) - (hdr->numParaHeader * 16);
-		oda->relocs_ofs = ofs + hdr->relocTabOffset;
+/** run_cmd(), going through the result cache if one is set up. */
+static bool run_cmd_cached(const struct cmd *cmd, const char *fname, const char *unfold_fname, FILE *outf,
+					struct job_result *res, struct ovl_arena *arena) {
+	struct cache_entry ce;
+	u64 filehash;
+	FILE *logf;
+	bool ok;
+
+	memset(res, 0, sizeof(*res));
+	if (!cmd->cache.dir || !cacheable(cmd->op) || cmd->shard ||
+		(ovl_hash_file(NULL, fname, 0, &filehash) != OVL_OK)) {
+		return run_cmd(cmd, fname, unfold_fname, outf, res, arena);
+	}
+	snprintf(ce.base, sizeof(ce.base), "%s/%016llx%016llx", cmd->cache.dir,
+			(unsigned long long) filehash, (unsigned long long) cmd_hash(cmd, filehash));
 
-		i++;
-		ofs += chunksiz;
+	if (cache_lookup(cmd, &ce, unfold_fname, outf, res)) {
+		res->cache = CACHE_HIT;
+		return 1;
 	}
-	return od_arr;
-}
 
-/** fixup a set of relocs for a displaced chunk.
- * (removed) param imgbuf must start at IMG_BASE and contain the appended newchunk
- * @param relocbuf : destination for the new reloc table
- * (removed) param dest_ofs : offset into imgbuf where to write the new reloc entries
- * @param dispbase : offset into new load_image where the displaced chunk starts, in parags
- * @param origbase : offset into original image where the chunk was meant to be mapped
- * @param relocs : original reloc table, valid when newchunk was mapped at OVL_BASE
- *
- * All this does is change the reloc entries to point to the right items. The items themselves
- * need not be changed since they are absolute pointers already.
- */
-void fixup_relocs(u8 *relocbuf, u16 dispbase, u16 origbase, const u8 *relocs, u16 num_relocs) {
-	u16 i;
-	u32 dest_ofs = 0;
+	// miss : capture output to a new entry, then pass it on
+	logf = fopen(centry_tmp(&ce, "log", res), "w+b");
+	if (!logf) {
+		ok = run_cmd(cmd, fname, unfold_fname, outf, res, arena);
+		res->cache = CACHE_MISS;
+		return ok;
+	}
+	ok = run_cmd(cmd, fname, unfold_fname, logf, res, arena);
+	res->cache = CACHE_MISS;
+	rewind(logf);
+	copy_stream(logf, outf);
+	if (fclose(logf) || !ok) {
+		remove(ce.tmp);
+		return ok;
+	}
+	if (!centry_commit(&ce, "log")) return ok;
 
-	for (i = 0; i < num_relocs; i++) {
-		u16 roffs = read_u16_LE(&relocs[(4 * i) + 0]);
-		u16 rseg = read_u16_LE(&relocs[(4 * i) + 2]);	//segment, relative to chunk base, where the item is located
-		//u32 r_lin = (rseg << 4) + roffs;	//"address" into displaced chunk of relocation item
+	if ((cmd->op == 'u') || (cmd->op == 'a')) {
+		if (!place_file(unfold_fname, centry_tmp(&ce, "ex_", res), cmd->cache.link)) return ok;
+		if (!centry_commit(&ce, "ex_")) return ok;
+	}
+	if (((cmd->op == 'u') || (cmd->op == 'a')) && (cmd->uo.ufmt == UNFOLD_FLAT)) {
+		char layout_fname[4096];
+		layout_name(layout_fname, sizeof(layout_fname), unfold_fname);
+		if (!copy_file(layout_fname, centry_tmp(&ce, "lay", res))) return ok;
+		if (!centry_commit(&ce, "lay")) return ok;
+	}
+	if (((cmd->op == 'u') || (cmd->op == 'a')) && (cmd->uo.mapfmt != MAP_NONE)) {
+		char map_fname[4096];
+		map_name(map_fname, sizeof(map_fname), unfold_fname, cmd->uo.mapfmt);
+		if (!copy_file(map_fname, centry_tmp(&ce, "map", res))) return ok;
+		if (!centry_commit(&ce, "map")) return ok;
+	}
 
-		u16 r_newseg = rseg - origbase + dispbase;
+	logf = fopen(centry_tmp(&ce, "res", res), "w");
+	if (!logf) return ok;
+	fprintf(logf, "%u %lu\n", (unsigned) res->num_ovls, (unsigned long) res->ncalls);
+	if (fclose(logf)) {
+		remove(ce.tmp);
+		return ok;
+	}
+	centry_commit(&ce, "res");
+	return ok;
+}
 
-		write_u16_LE(&relocbuf[dest_ofs], roffs);
-		dest_ofs += 2;
-		write_u16_LE(&relocbuf[dest_ofs], r_newseg);
-		dest_ofs += 2;
+/** create cache directory if needed. Failure just means every lookup misses. */
+static void cache_init(const struct cache_opts *cc) {
+	if (cc->dir) make_dir(cc->dir);
+	return;
+}
 
+/******** --stats */
+
+static void fput_json_str(FILE *f, const char *str) {
+	fputc('"', f);
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if ((c == '"') || (c == '\\')) {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
 	}
+	fputc('"', f);
 	return;
 }
 
-/** correct all overlay segment LUT entries that point to the given overlay #.
- *
- * @param seglutpos : offset in imgbuf of seg LUT
- * @param olutpos : offs in imgbuf of ovl # LUT
- * @param lut_entries : # of entries
- * @param seg_delta : value to add to LUT entry to point to new segment.
- */
-void fixup_seglut(u8 *imgbuf, u32 seglutpos, u32 olutpos, u16 lut_entries, u16 ovlno, u16 seg_delta) {
-	u16 i;
+/** whether print_stats() shows phase ph : only 'u' / 'a' have phases, 'a' alone guesses LUTs */
+static bool stats_phase(const struct cmd *cmd, unsigned ph) {
+	if ((cmd->op != 'u') && (cmd->op != 'a')) return 0;
+	if ((ph == PHASE_GUESS) && (cmd->op != 'a')) return 0;
+	if ((ph == PHASE_PACK) && !cmd->uo.packrelocs) return 0;
+	return 1;
+}
 
-	for (i = 0; i < lut_entries; i++) {
-		u8 test_no = imgbuf[olutpos + i];
-		if (test_no != ovlno) continue;
+/** print times and counters of one run. Cache hits replay output, so there is nothing to measure;
+ * phases that didn't run and counters of other commands are left out
+ */
+static void print_stats(FILE *outf, const struct cmd *cmd, const char *fname, const struct job_result *res) {
+	static const char *const cache_str[] = {[CACHE_OFF] = "off", [CACHE_HIT] = "hit", [CACHE_MISS] = "miss"};
+	const struct ovl_stats *st = &res->stats;
+	bool counters = (res->cache != CACHE_HIT) && ((cmd->op == 'u') || (cmd->op == 'a'));
+	unsigned ph;
+
+	if (cmd->stats == STATS_JSON) {
+		fprintf(outf, "{\"file\":");
+		fput_json_str(outf, fname);
+		fprintf(outf, ",\"cmd\":\"%c\",\"ok\":%s,\"cache\":\"%s\"",
+				cmd->op, res->ok ? "true" : "false", cache_str[res->cache]);
+		if (res->cache != CACHE_HIT) {
+			fprintf(outf, ",\"t\":{\"load\":%.6f", res->load_t);
+			for (ph = 0; ph < NUM_PHASES; ph++) {
+				if (!stats_phase(cmd, ph)) continue;
+				fprintf(outf, ",\"%s\":%.6f", ovl_phase_name(ph), st->t[ph]);
+			}
+			fprintf(outf, ",\"total\":%.6f}", res->total_t);
+		}
+		if (counters) {
+			fprintf(outf, ",\"scanned\":%llu,\"hits\":%lu,\"fixups\":%lu,"
+					"\"covered\":%lu,\"foreign\":%lu,\"relocs_in\":%lu,\"relocs_out\":%lu,\"seg_reused\":%lu,\"seg_steps\":%llu,\"written\":%llu",
+					(unsigned long long) st->scanned, (unsigned long) st->hits, (unsigned long) st->fixups,
+					(unsigned long) st->covered, (unsigned long) st->foreign, (unsigned long) st->relocs_in, (unsigned long) st->relocs_out, (unsigned long) st->seg_reused,
+					(unsigned long long) st->seg_steps, (unsigned long long) st->written);
+		}
+		fprintf(outf, "}\n");
+		return;
+	}
 
-		u16 seg = read_u16_LE(&imgbuf[seglutpos + (2*i) ]);
-		write_u16_LE(&imgbuf[seglutpos + (2*i) ], seg + seg_delta);
+	if (res->cache == CACHE_HIT) {
+		fprintf(outf, "stats : cache hit\n");
+		return;
 	}
+	fprintf(outf, "phase\tms\n");
+	fprintf(outf, "load\t%.3f\n", res->load_t * 1e3);
+	for (ph = 0; ph < NUM_PHASES; ph++) {
+		if (!stats_phase(cmd, ph)) continue;
+		fprintf(outf, "%s\t%.3f\n", ovl_phase_name(ph), st->t[ph] * 1e3);
+	}
+	fprintf(outf, "total\t%.3f\n", res->total_t * 1e3);
+	if (!counters) return;
+	fprintf(outf, "scanned\t%llu bytes\n", (unsigned long long) st->scanned);
+	fprintf(outf, "int3f\t%lu hits, %lu fixed, %lu on reloc items or LUTs, %lu into other shards\n", (unsigned long) st->hits,
+			(unsigned long) st->fixups, (unsigned long) st->covered, (unsigned long) st->foreign);
+	fprintf(outf, "relocs\t%lu in chunks, %lu written\n", (unsigned long) st->relocs_in, (unsigned long) st->relocs_out);
+	fprintf(outf, "segs\t%lu of %lu new relocs on an existing segment, %llu search steps\n",
+			(unsigned long) st->seg_reused, (unsigned long) st->fixups, (unsigned long long) st->seg_steps);
+	fprintf(outf, "written\t%llu bytes\n", (unsigned long long) st->written);
+	return;
 }
 
-/** fixup INT 0x3F calls
- *
- * @param seglut : segment LUT
- * @param olut : ovl # LUT
- * @param lut_entries : # of entries
- * @param img : image buffer to modify
- * @param relocs : complete reloc table,
- * @param rcur: offs within relocs[] for new reloc items
- *
- * @return # of fixups carried out.
- *
- * replaces "CD 3F" opcodes and following 3 bytes with a "call far ptr" to the correct destination
- * this must be done after the LUT has been corrected with the new mapping.
+/******** --trace : recorded run for 's' */
+
+/** read trace file : one overlay need per line, hex numbers,
+ *	c <ID> : int 0x3F call with this ovl ID (the byte after CD 3F)
+ *	o <N> : overlay N needed, e.g. return into an overlay
+ * Blank lines and lines starting with '#' are skipped.
+ * @param events : (output) array to free()
+ * @return 0 if unreadable or bad line
  */
-u16 fixup_int3f(const u8 *seglut, const u8 *olut, u8 lut_entries, u8 *img, u32 imgsiz, u8 *relocs, u32 rcur) {
-	u16 nrelocs = 0;
-	u32 cur;
-
-	for (cur = 0; (cur + 5) < imgsiz; cur++) {
-		u8 ovl_id;	//not the same as overlay # !
-		u8 ovl_no;
-		u16 seg, offs;
-		u16 r_seg, r_offs;	//seg:ofs or relocation item within img[]
-		u32 rcur_test;
-
-		if (img[cur] != 0xCD) continue;
-		if (img[cur + 1] != 0x3F) continue;
-
-		//match !
-		ovl_id = img[cur + 2];
-		if (ovl_id >= lut_entries) {
-			printf("ovl ID > lut_entries @ %X !?\n", cur);
-			return nrelocs;
-		}
-		//obtain actual call destination
-		offs = read_u16_LE(&img[cur + 3]);
-		seg = read_u16_LE(&seglut[(2 * ovl_id)]);
-		ovl_no = olut[ovl_id];
-
-		//write new opcode
-		img[cur] = 0x9A;	//opcode for "call (far ptr) seg:offs"
-		write_u16_LE(&img[cur+1], offs);
-		write_u16_LE(&img[cur+3], seg);
-
-		//add entry to reloc table. Try to reuse an existing segment
-		for (rcur_test = 0; rcur_test < rcur; rcur_test += 4) {
-			r_seg = read_u16_LE(&relocs[rcur_test + 2]);
-			//if we can reach the reloc item with an offset < 64k, we can use that seg.
-			if (((cur + 3) - (r_seg * 16)) < 0xFFFF) break;
+static bool read_trace(const char *fname, struct sim_event **events, u32 *num) {
+	char line[256];
+	struct sim_event *ev = NULL;
+	u32 n = 0, alloc = 0;
+	unsigned long lineno = 0;
+	FILE *tf;
+
+	tf = fopen(fname, "r");
+	if (!tf) {
+		printf("can't open %s\n", fname);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), tf)) {
+		char kind;
+		unsigned val;
+
+		lineno++;
+		if ((line[0] == '#') || (sscanf(line, " %c", &kind) != 1)) continue;
+		if ((sscanf(line, " %c %x", &kind, &val) != 2) || ((kind != 'c') && (kind != 'o')) ||
+			(val > ((kind == 'c') ? 0xFFU : 0xFFFFU))) {
+			printf("%s:%lu : bad trace line\n", fname, lineno);
+			goto bad;
 		}
-		if (rcur_test >= rcur) {
-			//we couldn't find an appropriate seg : too bad.
-			r_seg = (cur + 3) >> 4;
+		if (n == alloc) {
+			struct sim_event *tmp;
+			u32 newalloc = alloc ? (alloc * 2) : 1024;
+			tmp = realloc(ev, newalloc * sizeof(struct sim_event));
+			if (!tmp) {
+				printf("malloc choke\n");
+				goto bad;
+			}
+			ev = tmp;
+			alloc = newalloc;
 		}
-		r_offs = (cur + 3) - (r_seg * 16);	//offset within segment of remapped OVL
-		write_u16_LE(&relocs[rcur + (nrelocs * 4) + 0], r_offs);
-		write_u16_LE(&relocs[rcur + (nrelocs * 4) + 2], r_seg);
-
-		nrelocs += 1;
-		cur += 4;	//not +5 since there's a "++" at the loop top
+		ev[n].val = val;
+		ev[n].is_id = (kind == 'c');
+		n++;
 	}
+	fclose(tf);
+	*events = ev;
+	*num = n;
+	return 1;
 
-	return nrelocs;
+bad:
+	fclose(tf);
+	free(ev);
+	return 0;
 }
 
-/** tweak header fields for mostly correct info, and write out.
- *
- * @param rcur size (bytes) of all relocs in in nex.relocs[]
- * @param imgcur_parags size (parags) of load image
+/******** batch mode
  *
- * checksum ignored
- * new header must be already filled except
- *	lastPageSize;
- *	numPages;
- *	numReloc;
- *	numParaHeader;
- *	inital SS:SP
+ * Files are handed out to worker threads by run_parallel_w(); each job has its own
+ * exefile and output file. Each worker keeps an unfold arena for all its files.
  */
-void dump_newheader(FILE *outf, struct new_exe *nex, u32 rcur, u16 imgcur_parags) {
-	u32 wcur = 0;
-	u32 wlen;
-	u32 padlen;
-	const u8 pagebuf[512] = {0};	//just used to write padding 0 bytes
-
-	nex->hdr.relocTabOffset = sizeof(struct header);	//1C != 1E !!
-	nex->hdr.numReloc = rcur / 4;
-	nex->hdr.numParaHeader = (sizeof(struct header) + rcur + 15) >> 4;	//round to next parag
-	nex->hdr.lastPageSize = ((nex->hdr.numParaHeader + imgcur_parags) * 16) & 511;
-    nex->hdr.numPages = (((nex->hdr.numParaHeader + imgcur_parags) * 16) + 511) / 512;
-    nex->hdr.initSS = imgcur_parags;
-    nex->hdr.initSP = 8;	//dummy 8-byte stack
-
-    //write hdr
-    wlen = fwrite(&nex->hdr, 1, sizeof(struct header), outf);
-    if (wlen != sizeof(struct header)) goto write_err;
-    wcur += wlen;
-
-    //write relocs
-    wlen = fwrite(nex->relocs, 1, rcur, outf);
-    if (wlen != rcur) goto write_err;
-    wcur += wlen;
-
-	//0-pad relocs if necessary
-	padlen = (nex->hdr.numParaHeader * 16) - wcur;
-	wlen = fwrite(pagebuf, 1, padlen, outf);
-	if (wlen != padlen) goto write_err;
-	wcur += wlen;
-
-	//write image
-	wlen = fwrite(nex->img, 1, imgcur_parags * 16, outf);
-	if  (wlen != imgcur_parags * 16) goto write_err;
-	wcur += wlen;
-
-	//0-pad to 512-byte page if necessary
-#if PADPAGE
-	padlen = (nex->hdr.numPages * 512) - wcur;
-	wlen = fwrite(pagebuf, 1, padlen, outf);
-	if (wlen != padlen) goto write_err;
-#endif
 
-	return;
+struct batch {
+	const struct cmd *cmd;
+	char **files;
+	struct job_result *res;	//one per file
+	struct ovl_arena *arenas;	//one per worker
+};
+
+/** list of strings that grows as needed */
+struct strlist {
+	char **s;
+	u32 num;
+	u32 alloc;
+};
+
+static bool strlist_add(struct strlist *sl, const char *str) {
+	char *copy;
+
+	if (sl->num == sl->alloc) {
+		char **tmp;
+		u32 newalloc = sl->alloc ? (sl->alloc * 2) : 64;
+		tmp = realloc(sl->s, newalloc * sizeof(char *));
+		if (!tmp) return 0;
+		sl->s = tmp;
+		sl->alloc = newalloc;
+	}
+	copy = malloc(strlen(str) + 1);
+	if (!copy) return 0;
+	strcpy(copy, str);
+	sl->s[sl->num++] = copy;
+	return 1;
+}
 
-write_err:
-	printf("fwrite err\n");
+static void strlist_free(struct strlist *sl) {
+	u32 i;
+	for (i = 0; i < sl->num; i++) {
+		free(sl->s[i]);
+	}
+	free(sl->s);
+	sl->s = NULL;
+	sl->num = sl->alloc = 0;
 	return;
 }
 
-/** convert overlayed .exe to monolithic .exe with flattened overlays
- *
- * @param seglut_pos file offset of overlay segment LUT
- * @param olut_pos file offset of overlay number LUT
- * @param lut_entries
- * @param ovl_base : segment where overlays are loaded (relative to image base)
- * @param out_fname : filename for output
- *
- * The resulting .exe will probably not run properly anymore.
-*/
-void unfold_overlay(struct exefile *exf, u32 seglut_pos, u32 olut_pos, u8 lut_entries, u16 ovl_base, const char *out_fname) {
-	u16 num_ovls;	//excluding root
-	u16 num_relocs = 0;
-	u32 num_ovlcalls = 0;
-	u32 num_fixups;
-	u32 imgsiz = 0;
-	u16 i;
-	struct ovl_desc *oda;	//array of descriptors
-	struct new_exe nex;
-	u32 imgcur_parags;
-	u32 rcur;	//cursors into new img and reloc tables
+/** add one filename per line. Blank lines and lines starting with '#' are skipped */
+static bool read_filelist(struct strlist *sl, FILE *lf) {
+	char line[4096];
+
+	while (fgets(line, sizeof(line), lf)) {
+		size_t len = strlen(line);
+		while (len && ((line[len - 1] == '\n') || (line[len - 1] == '\r'))) {
+			line[--len] = 0;
+		}
+		if (!len || (line[0] == '#')) continue;
+		if (!strlist_add(sl, line)) return 0;
+	}
+	return 1;
+}
+
+/** process one file of the batch */
+static void batch_one(void *ctx, u32 idx, unsigned worker) {
+	struct batch *b = ctx;
+	const char *fname = b->files[idx];
+	static const char *const fmt_ext[] = {
+		[FMT_TEXT] = "txt",
+		[FMT_JSONL] = "jsonl",
+		[FMT_BIN] = "bin",
+	};
+	char *outname;
 	FILE *outf;
+	size_t len = strlen(fname) + sizeof(".x.jsonl");
+	bool binary = (b->cmd->fmt == FMT_BIN) && ((b->cmd->op == 'l') || (b->cmd->op == 'c'));
 
-	printf("seglut @ %lX, ovllut @ %lX, entries=%X ovlbase %X:0000\n",
-			(unsigned long) seglut_pos, (unsigned long) olut_pos,
-			(unsigned) lut_entries, (unsigned) ovl_base);
+	outname = malloc(len);
+	if (!outname) return;
 
-	num_ovls = count_ovls(exf->buf, exf->siz);
-	if (!num_ovls) {
-		printf("no ovl\n");
+	snprintf(outname, len, "%s.%c.%s", fname, b->cmd->op, fmt_ext[b->cmd->fmt]);
+	outf = fopen(outname, binary ? "wb" : "w");
+	if (!outf) {
+		free(outname);
 		return;
 	}
 
-	//open output file
-	outf = fopen(out_fname, "wb");
-	if (!outf) {
-		printf("can't create outf\n");
-		return;
+	snprintf(outname, len, "%s.ex_", fname);
+	run_cmd_cached(b->cmd, fname, outname, outf, &b->res[idx], &b->arenas[worker]);
+	if (b->cmd->stats) print_stats(outf, b->cmd, fname, &b->res[idx]);
+
+	fclose(outf);
+	free(outname);
+	return;
+}
+
+/** run cmd on all files, then print summary
+ * @return # of failed files
+ */
+static u32 run_batch(const struct cmd *cmd, char **files, u32 nfiles, unsigned jobs) {
+	struct batch b = {0};
+	unsigned long nok = 0, novls = 0, ncalls = 0;
+	unsigned long nhit = 0, nmiss = 0;
+	struct dedup_stats ds = {0};
+	double phase_t[NUM_PHASES] = {0};
+	double load_t = 0, total_t = 0;
+	unsigned ph;
+	u32 i;
+
+	if (!jobs) jobs = num_cpus();
+	b.cmd = cmd;
+	b.files = files;
+	b.res = calloc(nfiles ? nfiles : 1, sizeof(struct job_result));
+	b.arenas = calloc(jobs, sizeof(struct ovl_arena));
+	if (!b.res || !b.arenas) {
+		printf("malloc choke\n");
+		free(b.res);
+		free(b.arenas);
+		return nfiles;
 	}
 
-	// fill ovl descriptors
-	oda = parse_ovls(exf->buf, exf->siz, num_ovls);
-	if (!oda) {
-		printf("ovl parse fail\n");
-		fclose(outf);
-		return;
+	ovl_init();
+	cache_init(&cmd->cache);
+	if (cmd->store) make_dir(cmd->store);
+	run_parallel_w(NULL, jobs, nfiles, batch_one, &b);
+	for (i = 0; i < jobs; i++) {
+		ovl_arena_free(&b.arenas[i], NULL);
 	}
 
-	nex.img = NULL;
-	nex.relocs = NULL;
-
-	// gather ovl stats
-	for (i=0; i <= num_ovls; i++) {
-		num_relocs += oda[i].hdr.numReloc;
-		imgsiz += oda[i].img_siz;
-		num_ovlcalls += dump_ovlcalls(&exf->buf[oda[i].img_ofs], oda[i].img_siz, 0);
-	}
-
-	// check if it can be done by mapping OVLs *above* SS:SP.
-	// Assume we need 1 parag padding for each ovl
-	u16 required_segs = ((imgsiz - oda[0].img_siz) >> 4) + num_ovls;
-	u16 availseg = (0xFFFF - nextseg(exf->hdr.initSS, exf->hdr.initSP));
-	if (required_segs >= availseg) {
-		printf("not enough addressing space to unroll that shit\n");
-		goto fexit;
-	}
-
-	//allocate new data structures
-	nex.relocs = malloc((num_relocs + num_ovlcalls) * 4);
-	if (!nex.relocs) goto fexit;
-		// max total size is (headers) + (reloc table) + (base size up to SS:SP) + (ovl img data) + 1 parag per ovl
-	nex.img = calloc(	sizeof(struct header) +
-						num_relocs * sizeof(struct reloc_entry) +
-						(exf->hdr.initSS << 4) + exf->hdr.initSP + 16 +
-						(imgsiz - oda[0].img_siz) +
-						num_ovls * 16,
-						1);
-	if (!nex.img) goto fexit;
-
-	// write in root OVL_000 image, including its relocs
-	memcpy(nex.relocs, &exf->buf[oda[0].relocs_ofs], oda[0].hdr.numReloc * 4);
-	memcpy(nex.img, &exf->buf[oda[0].img_ofs], oda[0].img_siz);
-
-	rcur = oda[0].hdr.numReloc * 4;
-	imgcur_parags = exf->hdr.initSS + ((exf->hdr.initSP + 15) >> 4);	//bring cursor after stack area
-
-	//convert lut positions to "offset within image"
-	seglut_pos -= (exf->hdr.numParaHeader * 16);
-	olut_pos -= (exf->hdr.numParaHeader * 16);
-
-	// masterloop (tm)
-	for (i = 1; i <= num_ovls; i++) {
-		u16 chunk_segdelta;	//distance (in parags) from new location to original mapping location OVL_BASE
-
-		//copy ovl image, and append fixed up relocs to the main table
-		memcpy(&nex.img[imgcur_parags * 16], &exf->buf[oda[i].img_ofs], oda[i].img_siz);
-		fixup_relocs(&nex.relocs[rcur], imgcur_parags, ovl_base, &exf->buf[oda[i].relocs_ofs], oda[i].hdr.numReloc);
-
-		//adjust overlay segment LUT
-		chunk_segdelta = imgcur_parags - ovl_base;
-		fixup_seglut(nex.img, seglut_pos, olut_pos, lut_entries, i, chunk_segdelta);
-
-		printf("mapping OVL_%X @ %X0 within image\n", i, imgcur_parags);
-
-		//advance cursors
-		rcur += (oda[i].hdr.numReloc * 4);
-		imgcur_parags += ((oda[i].img_siz + 15) >> 4);	//round to next parag
-		if (imgcur_parags >= 0xFFFF) {
-			printf("busted address space !\n");
-			goto fexit;
+	for (i = 0; i < nfiles; i++) {
+		if (b.res[i].cache == CACHE_HIT) nhit++;
+		if (b.res[i].cache == CACHE_MISS) nmiss++;
+		if (!b.res[i].ok) {
+			printf("FAILED\t%s\n", files[i]);
+			continue;
 		}
+		nok++;
+		ds.new_chunks += b.res[i].dedup.new_chunks;
+		ds.dup_chunks += b.res[i].dedup.dup_chunks;
+		ds.new_bytes += b.res[i].dedup.new_bytes;
+		ds.dup_bytes += b.res[i].dedup.dup_bytes;
+		novls += b.res[i].num_ovls;
+		ncalls += b.res[i].ncalls;
+		load_t += b.res[i].load_t;
+		total_t += b.res[i].total_t;
+		for (ph = 0; ph < NUM_PHASES; ph++) phase_t[ph] += b.res[i].stats.t[ph];
+	}
+	printf(	"files\tok\tfailed\tovls\t%s\n"
+			"%lu\t%lu\t%lu\t%lu\t%lu\n",
+			((cmd->op == 'u') || (cmd->op == 'a')) ? "fixups" : "int3f calls",
+			(unsigned long) nfiles, nok, (unsigned long) nfiles - nok, novls, ncalls);
+	if (cmd->store && (cmd->op == 'd')) {
+		printf(	"new chunks\tdup chunks\tnew bytes\tdup bytes\n"
+				"%lu\t%lu\t%llu\t%llu\n",
+				(unsigned long) ds.new_chunks, (unsigned long) ds.dup_chunks,
+				(unsigned long long) ds.new_bytes, (unsigned long long) ds.dup_bytes);
+	}
+	if (cmd->cache.dir) {
+		printf(	"cache hits\tmisses\n"
+				"%lu\t%lu\n", nhit, nmiss);
+	}
+	if (cmd->stats) {
+		//summed over files, so more than wall time with several jobs
+		printf("ms, all files :\tload");
+		for (ph = 0; ph < NUM_PHASES; ph++) printf("\t%s", ovl_phase_name(ph));
+		printf("\ttotal\n\t%.1f", load_t * 1e3);
+		for (ph = 0; ph < NUM_PHASES; ph++) printf("\t%.1f", phase_t[ph] * 1e3);
+		printf("\t%.1f\n", total_t * 1e3);
 	}
 
-	//fixup INT 3F calls
-	num_fixups = fixup_int3f(&nex.img[seglut_pos], &nex.img[olut_pos], lut_entries, nex.img, imgcur_parags * 16, nex.relocs, rcur);
-	rcur += (num_fixups * 4);
-	printf("Fixed 0x%X int3f calls.\n", num_fixups);
+	free(b.res);
+	free(b.arenas);
+	return nfiles - nok;
+}
 
-	if (num_fixups != num_ovlcalls) {
-		printf("Mismatch in # of int3F fixups. Possible spurious hits or fixups\n");
+int main(int argc, char *argv[])
+{
+	struct cli_opts co = {0};
+	struct cmd cmd = {0};
+	struct job_result res;
+	struct sim_event *trace = NULL;
+	u32 trace_len = 0;
+	struct ovl_patset ps = {0};
+	int i, nargs, used;
+	bool ok;
+
+	co.min_confidence = 50;
+	co.map_seg = -1;
+
+	// pull out options; the remaining args are positional
+	for (i = 1, nargs = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--", 2)) {
+			if (!parse_option(&co, argv[i])) {
+				printf("bad option %s\n", argv[i]);
+				print_usage(argv[0]);
+				return 0;
+			}
+			continue;
+		}
+		argv[nargs++] = argv[i];
+	}
+	argc = nargs;
+	co.uo.map_seg = default_map_seg(&co);
+	if (co.tracefile && !read_trace(co.tracefile, &trace, &trace_len)) return -1;
+	if (co.npats) {
+		struct ovl_env env = {0};
+		env.msg = msg_file;
+		env.msg_ctx = stdout;
+		co.pats[0] = ovl_pat_msc;
+		if (ovl_patset_build(&ps, &env, co.pats, 1 + co.npats) != OVL_OK) {
+			printf("bad --pattern\n");
+			return -1;
+		}
+		cmd.ps = &ps;
 	}
 
-	//regen new exe header. mostly same as orig
-	memcpy(&nex.hdr, &exf->hdr, sizeof(struct header));
-	dump_newheader(outf, &nex, rcur, imgcur_parags);
+	if (co.batch) {
+		struct strlist files = {0};
+		u32 nfail;
 
-fexit:
-	fclose(outf);
-	if (nex.img) free(nex.img);
-	if (nex.relocs) free(nex.relocs);
-	free(oda);
-	return;
-}
-
-void print_usage(const char *argv0) {
-	printf(	"**** %s\n"
-		"**** overlayed DOS exe tool\n"
-		"**** (c) 2017 fenugrec\n"
-		"Usage:\t%s <exefile> <command> [command options]]\n"
-		"Commands and options:\n"
-		"\tc : list all int 0x3F calls.\n"
-		"\tl : list overlays\n"
-		"\td : dump overlays to separate files\n"
-		"\tu <SEGLUT_POS> <OVLLUT_POS> <OVL_BASE>: unfold overlays\n"
-		"\t\tSEGLUT_POS : file offset of overlay segment LUT\n"
-		"\t\tOVLLUT_POS : file offset of overlay number LUT\n"
-		"\t\tLUT_ENTRIES : number of entries in LUT\n"
-		"\t\tOVL_BASE : loaded overlay's segment (relative to image base)\n",
-		argv0, argv0);
-	return;
+		used = parse_cmd(&cmd, argc - 1, &argv[1]);
+		if (!used) {
+			printf("bad args\n");
+			print_usage(argv[0]);
+			return 0;
+		}
+		if (cmd.ps && (cmd.op != 'c')) {
+			printf("--pattern only applies to 'c'\n");
+			return 0;
+		}
+		cmd.uo = co.uo;
+		cmd.min_confidence = co.min_confidence;
+		cmd.fmt = co.fmt;
+		cmd.relocfilter = co.relocfilter;
+		cmd.relocbase = co.relocbase;
+		cmd.shard = co.shard;
+		cmd.cache = co.cache;
+		cmd.store = co.store;
+		cmd.stats = co.stats;
+		cmd.so.trace = trace;
+		cmd.so.trace_len = trace_len;
+
+		for (i = 1 + used; i < argc; i++) {
+			if (!strlist_add(&files, argv[i])) goto list_err;
+		}
+		if (co.listfile || !files.num) {
+			bool rv;
+			FILE *lf = stdin;
+			if (co.listfile && strcmp(co.listfile, "-")) {
+				lf = fopen(co.listfile, "r");
+				if (!lf) {
+					printf("can't open %s\n", co.listfile);
+					strlist_free(&files);
+					return -1;
+				}
+			}
+			rv = read_filelist(&files, lf);
+			if (lf != stdin) fclose(lf);
+			if (!rv) goto list_err;
+		}
 
-}
+		nfail = run_batch(&cmd, files.s, files.num, co.jobs);
+		strlist_free(&files);
+		free(trace);
+		ovl_patset_free(&ps, NULL);
+		return nfail ? -1 : 0;
 
-int main(int argc, char *argv[])
-{
-	struct exefile exf = {0};
-	bool badargs = 1;
+list_err:
+		printf("malloc choke\n");
+		strlist_free(&files);
+		free(trace);
+		return -1;
+	}
 
 	if (argc < 3) {
 		print_usage(argv[0]);
 		return 0;
 	}
 
-	if (!load_exe(&exf, argv[1])) {
-		printf("Trouble in loadexe\n");
-		return -1;
-	}
-
-	switch (argv[2][0]) {
-		case 'l':
-			list_ovls(&exf);
-			badargs = 0;
-			break;
-		case 'd':
-			dump_ovls(&exf,argv[1]);
-			badargs = 0;
-			break;
-		case 'c':
-			dump_ovlcalls(exf.buf, exf.siz, 1);
-			badargs = 0;
-			break;
-		case 'u':
-			if (argc != 7) {
-				break;
-			} else {
-				unsigned long seglut, olut;
-				unsigned lut_entries, ovlbase;
-				if (sscanf(argv[3], "%lx", &seglut) != 1) break;
-				if (sscanf(argv[4], "%lx", &olut) != 1) break;
-				if (sscanf(argv[5], "%x", &lut_entries) != 1) break;
-				if (sscanf(argv[6], "%x", &ovlbase) != 1) break;
-				if (seglut > exf.siz) break;
-				if (olut > exf.siz) break;
-				if (ovlbase >= 0xFFFF) break;
-				if (lut_entries >= 0xFF) break;
-				badargs = 0;
-				unfold_overlay(&exf, (u32) seglut, (u32) olut, (u8) lut_entries, (u16) ovlbase, "test.ex_");
-				break;
-			}
-
-			break;
-		default:
-			break;
-	}
-	if (badargs) {
+	used = parse_cmd(&cmd, argc - 2, &argv[2]);
+	if (!used || ((2 + used) != argc)) {
 		printf("bad args\n");
 		print_usage(argv[0]);
+		return 0;
 	}
-	close_exe(&exf);
-
-	return 0;
+	if (cmd.ps && (cmd.op != 'c')) {
+		printf("--pattern only applies to 'c'\n");
+		return 0;
+	}
+	cmd.uo = co.uo;
+	cmd.min_confidence = co.min_confidence;
+	cmd.fmt = co.fmt;
+	cmd.relocfilter = co.relocfilter;
+	cmd.relocbase = co.relocbase;
+	cmd.shard = co.shard;
+	cmd.cache = co.cache;
+	cmd.store = co.store;
+	cmd.stats = co.stats;
+	cmd.so.trace = trace;
+	cmd.so.trace_len = trace_len;
+
+#ifdef _WIN32
+	if (cmd.fmt == FMT_BIN) _setmode(_fileno(stdout), _O_BINARY);
+#endif
+	ovl_init();
+	cache_init(&cmd.cache);
+	if (cmd.store) make_dir(cmd.store);
+	ok = run_cmd_cached(&cmd, argv[1], co.outname ? co.outname : "test.ex_", stdout, &res, NULL);
+	if (cmd.stats) print_stats(stdout, &cmd, argv[1], &res);
+	free(trace);
+	ovl_patset_free(&ps, NULL);
+
+	return ok ? 0 : -1;
 }
@@ -0,0 +1,4923 @@
+/* libovlazy
+ *
+ * Everything but the command-line interface; see ovlazy.h for the API.
+ *
+ * Designed for binaries compiled with MS C compiler 5.1;
+ * Others of similar vintage might work too.
+ *
+ * (c) fenugrec 2017
+ * Licensed under GPLv3
+ *
+ *
+ * Assumptions:
+ * - host is little-endian (x86 etc).
+ * - C99 compliant compiler
+ * - source .exe is a valid DOS program
+ * - overlays don't have relative pointers to data/code outside their own image
+ * - overlays don't access data that is within the OVL mapping area, outside their own image
+ * - overlay area size < 64kB
+ *
+ * Note : unsafe code - limited bounds checking, naive string processing, etc. Run at your own risk !
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "stuff.h"
+#include "ovlazy.h"
+
+/* map input files instead of reading them in completely. */
+#ifndef USE_MMAP
+	#if defined(__unix__) || defined(__APPLE__)
+		#define USE_MMAP 1
+	#else
+		#define USE_MMAP 0
+	#endif
+#endif
+
+#if USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static inline void write_u16_LE(u8 *dest, u16 val) {
+	*dest++ = val & 0xFF;
+	*dest = val >> 8;
+	return;
+}
+
+/******** environment : allocator and diagnostics */
+
+static const struct ovl_env default_env = {0};
+
+static void *ovl_malloc(const struct ovl_env *env, size_t siz) {
+	if (env->alloc.alloc) return env->alloc.alloc(env->alloc.ctx, siz);
+	return malloc(siz);
+}
+
+static void *ovl_calloc(const struct ovl_env *env, size_t n, size_t siz) {
+	void *p;
+
+	if (!env->alloc.alloc) return calloc(n, siz);
+	if (siz && (n > (SIZE_MAX / siz))) return NULL;
+	p = env->alloc.alloc(env->alloc.ctx, n * siz);
+	if (p) memset(p, 0, n * siz);
+	return p;
+}
+
+static void *ovl_realloc(const struct ovl_env *env, void *ptr, size_t siz) {
+	if (env->alloc.resize) return env->alloc.resize(env->alloc.ctx, ptr, siz);
+	return realloc(ptr, siz);
+}
+
+static void ovl_free(const struct ovl_env *env, void *ptr) {
+	if (!ptr) return;
+	if (env->alloc.release) {
+		env->alloc.release(env->alloc.ctx, ptr);
+		return;
+	}
+	free(ptr);
+}
+
+/** printf-style diagnostic. Lines longer than the buffer are truncated. */
+static void ovl_msg(const struct ovl_env *env, const char *fmt, ...) {
+	char line[256];
+	va_list ap;
+
+	if (!env->msg) return;
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	env->msg(env->msg_ctx, line);
+	return;
+}
+
+const char *ovl_strerror(enum ovl_err err) {
+	switch (err) {
+	case OVL_OK: return "ok";
+	case OVL_ENOMEM: return "out of memory";
+	case OVL_EOPEN: return "can't open or read file";
+	case OVL_EFORMAT: return "not a usable MZ exe";
+	case OVL_ENOOVL: return "no overlays";
+	case OVL_EARGS: return "bad parameters";
+	case OVL_ESPACE: return "not enough address space";
+	case OVL_ENOLUT: return "no usable LUTs found";
+	case OVL_EWRITE: return "write error";
+	}
+	return "?";
+}
+
+/* TODO: take care of endianness */
+static void read_header(struct header *dest_header, const u8 *buf) {
+	memcpy(dest_header, buf, sizeof(struct header));
+	return;
+}
+
+
+void ovl_close(struct exefile *exf) {
+	const struct ovl_env *env = exf->env ? exf->env : &default_env;
+
+	if (exf->buf) {
+#if USE_MMAP
+		if (exf->mapped) {
+			munmap(exf->buf, exf->siz);
+		} else {
+			ovl_free(env, exf->buf);
+		}
+#else
+		ovl_free(env, exf->buf);
+#endif
+		exf->buf = NULL;
+	}
+	if (exf->ovls) {
+		ovl_free(env, exf->ovls);
+		exf->ovls = NULL;
+	}
+	return;
+}
+
+static enum ovl_err parse_header(struct exefile *exf) {
+	struct header *hdr = &exf->hdr;
+
+	bool validsig = (hdr->sigLo == 0x4D && hdr->sigHi == 0x5A);
+	if (!validsig) {
+		ovl_msg(exf->env, "bad MZ\n");
+		return OVL_EFORMAT;
+	}
+
+	/* This is a typical DOS kludge! */
+	if (hdr->relocTabOffset == 0x40) {
+		ovl_msg(exf->env, "new exe\n");
+		return OVL_EFORMAT;
+	}
+
+	return OVL_OK;
+}
+
+/** build overlay index : walk the MZ chunk chain once, validating each chunk.
+ *
+ * Fills exf->ovls[] (index = overlay #, [0] is the root OVL_000) and exf->num_ovls.
+ * The walk stops at the first chunk that isn't a sane MZ header or doesn't fit in the file;
+ * exf->chain_end tells where that happened (== exf->siz if the whole file was indexed).
+ *
+ * @return OVL_EFORMAT if the root chunk itself is unusable
+ */
+static enum ovl_err index_ovls(struct exefile *exf) {
+	struct ovl_desc *od_arr = NULL;
+	u32 alloc_ovls = 0;
+	u32 nchunks = 0;
+	u32 ofs = 0;
+
+	while (ofs < exf->siz) {
+		struct ovl_desc *oda;
+		struct header *hdr;
+		u32 datasiz;	//header + relocs + image, as per header
+		u32 hdrsiz;
+
+		if ((exf->siz - ofs) < sizeof(struct header)) break;
+
+		if (nchunks == alloc_ovls) {
+			struct ovl_desc *tmp;
+			alloc_ovls = alloc_ovls ? (alloc_ovls * 2) : 32;
+			tmp = ovl_realloc(exf->env, od_arr, alloc_ovls * sizeof(struct ovl_desc));
+			if (!tmp) {
+				ovl_msg(exf->env, "malloc choke\n");
+				ovl_free(exf->env, od_arr);
+				return OVL_ENOMEM;
+			}
+			od_arr = tmp;
+		}
+		oda = &od_arr[nchunks];
+		hdr = &oda->hdr;
+
+		read_header(hdr, &exf->buf[ofs]);
+		if (!(hdr->sigLo == 0x4D && hdr->sigHi == 0x5A)) break;
+		if (!hdr->numPages) break;
+
+		datasiz = (512 * (u32) (hdr->numPages - 1)) + hdr->lastPageSize;
+		hdrsiz = hdr->numParaHeader * 16;
+		if (datasiz < hdrsiz) break;
+		if (datasiz > (exf->siz - ofs)) break;
+		if ((hdr->relocTabOffset + (hdr->numReloc * 4UL)) > datasiz) break;
+
+		// fill in descriptor
+		oda->chunk_ofs = ofs;
+		oda->chunk_siz = 512 * (u32) hdr->numPages;
+		if (oda->chunk_siz > (exf->siz - ofs)) {
+			//last chunk needn't be padded to a full page
+			oda->chunk_siz = exf->siz - ofs;
+		}
+		oda->img_ofs = ofs + hdrsiz;
+		oda->img_siz = datasiz - hdrsiz;
+		oda->relocs_ofs = ofs + hdr->relocTabOffset;
+
+		nchunks++;
+		ofs += oda->chunk_siz;
+	}
+
+	if (!nchunks) {
+		ovl_msg(exf->env, "bad root chunk\n");
+		ovl_free(exf->env, od_arr);
+		return OVL_EFORMAT;
+	}
+
+	exf->ovls = od_arr;
+	exf->num_ovls = nchunks - 1;
+	exf->chain_end = ofs;
+	return OVL_OK;
+}
+
+#if USE_MMAP
+/** map whole file. Pages are only read in when touched.
+ * @param cow : if 1, buffer is writable but changes stay private (copy-on-write)
+ */
+static u8 *map_exe(const char *filename, u32 *len, bool cow, const struct ovl_env *env) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ovl_msg(env, "CANNOT_OPEN\n");
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		ovl_msg(env, "fstat err\n");
+		close(fd);
+		return NULL;
+	}
+	if ((st.st_size < (off_t) sizeof(struct header)) ||
+		((unsigned long long) st.st_size >= UINT32_MAX)) {
+		ovl_msg(env, "bad file length %llu\n", (unsigned long long) st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, cow ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);	//mapping stays valid
+	if (map == MAP_FAILED) {
+		ovl_msg(env, "mmap choke\n");
+		return NULL;
+	}
+
+	*len = (u32) st.st_size;
+	return map;
+}
+
+#else
+// hax, get file length but restore position
+static u32 flen(FILE *hf) {
+	long siz;
+	long orig;
+
+	if (!hf) return 0;
+	orig = ftell(hf);
+	if (orig < 0) return 0;
+
+	if (fseek(hf, 0, SEEK_END)) return 0;
+
+	siz = ftell(hf);
+	if (siz < 0) siz=0;
+		//the rest of the code just won't work if siz = UINT32_MAX
+	#if (LONG_MAX >= UINT32_MAX)
+		if ((long long) siz == (long long) UINT32_MAX) siz = 0;
+	#endif
+
+	if (fseek(hf, orig, SEEK_SET)) return 0;
+	return (u32) siz;
+}
+
+/** read complete file into an allocated buffer */
+static u8 *read_exe(const char *filename, u32 *len, const struct ovl_env *env) {
+	FILE   *fbin;
+	u32 file_len;
+	u8 *buf;
+
+	/* Open the input file */
+	if ((fbin = fopen(filename, "rb")) == NULL) {
+		ovl_msg(env, "CANNOT_OPEN\n");
+		return NULL;
+	}
+
+	file_len = flen(fbin);
+	if (file_len < sizeof(struct header)) {
+		ovl_msg(env, "bad file length %lu\n", (unsigned long) file_len);
+		fclose(fbin);
+		return NULL;
+	}
+
+	buf = ovl_malloc(env, file_len);
+	if (!buf) {
+		ovl_msg(env, "malloc choke\n");
+		fclose(fbin);
+		return NULL;
+	}
+
+	/* load whole ROM */
+	if (fread(buf,1,file_len,fbin) != file_len) {
+		ovl_msg(env, "trouble reading\n");
+		ovl_free(env, buf);
+		fclose(fbin);
+		return NULL;
+	}
+
+	fclose(fbin);
+	*len = file_len;
+	return buf;
+}
+#endif	//USE_MMAP
+
+/** parse header and index overlays of a freshly loaded exf->buf */
+static enum ovl_err load_common(struct exefile *exf) {
+	enum ovl_err rv;
+
+	read_header(&exf->hdr, exf->buf);
+	rv = parse_header(exf);
+	if (rv == OVL_OK) rv = index_ovls(exf);
+	return rv;
+}
+
+enum ovl_err ovl_load_file(struct exefile *exf, const struct ovl_env *env, const char *filename, bool cow) {
+	u32 file_len = 0;
+	u8 *buf;
+
+	memset(exf, 0, sizeof(*exf));
+	if (!env) env = &default_env;
+	exf->env = env;
+#if USE_MMAP
+	buf = map_exe(filename, &file_len, cow, env);
+	exf->mapped = 1;
+#else
+	(void) cow;	//allocated buffer is always writable
+	buf = read_exe(filename, &file_len, env);
+	exf->mapped = 0;
+#endif
+	if (!buf) return OVL_EOPEN;
+
+	exf->buf = buf;
+	exf->siz = file_len;
+	return load_common(exf);
+}
+
+enum ovl_err ovl_load_mem(struct exefile *exf, const struct ovl_env *env, const void *buf, u32 siz) {
+	memset(exf, 0, sizeof(*exf));
+	if (!env) env = &default_env;
+	exf->env = env;
+
+	if (siz < sizeof(struct header)) {
+		ovl_msg(env, "bad file length %lu\n", (unsigned long) siz);
+		return OVL_EFORMAT;
+	}
+	exf->buf = ovl_malloc(env, siz);
+	if (!exf->buf) {
+		ovl_msg(env, "malloc choke\n");
+		return OVL_ENOMEM;
+	}
+	memcpy(exf->buf, buf, siz);
+	exf->siz = siz;
+	return load_common(exf);
+}
+
+/******** content hash
+ *
+ * XXH64 (public algorithm by Y. Collet), so hashes can be checked with the usual xxhsum tools.
+ */
+
+#define XXH_P1	0x9E3779B185EBCA87ULL
+#define XXH_P2	0xC2B2AE3D27D4EB4FULL
+#define XXH_P3	0x165667B19E3779F9ULL
+#define XXH_P4	0x85EBCA77C2B2AE63ULL
+#define XXH_P5	0x27D4EB2F165667C5ULL
+
+static inline u64 rotl64(u64 x, unsigned r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 read_u64_LE(const u8 *p) {
+	u64 v;
+	memcpy(&v, p, sizeof(v));	//host is little-endian
+	return v;
+}
+
+static inline u32 read_u32_LE(const u8 *p) {
+	u32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u64 xxh_round(u64 acc, u64 input) {
+	acc += input * XXH_P2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline u64 xxh_merge(u64 acc, u64 val) {
+	acc ^= xxh_round(0, val);
+	return (acc * XXH_P1) + XXH_P4;
+}
+
+u64 ovl_hash64(const void *data, size_t len, u64 seed) {
+	const u8 *p = data;
+	const u8 *end = p + len;
+	u64 h;
+
+	if (len >= 32) {
+		u64 v1 = seed + XXH_P1 + XXH_P2;
+		u64 v2 = seed + XXH_P2;
+		u64 v3 = seed;
+		u64 v4 = seed - XXH_P1;
+
+		do {
+			v1 = xxh_round(v1, read_u64_LE(p));
+			v2 = xxh_round(v2, read_u64_LE(p + 8));
+			v3 = xxh_round(v3, read_u64_LE(p + 16));
+			v4 = xxh_round(v4, read_u64_LE(p + 24));
+			p += 32;
+		} while ((end - p) >= 32);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = seed + XXH_P5;
+	}
+	h += (u64) len;
+
+	for (; (end - p) >= 8; p += 8) {
+		h ^= xxh_round(0, read_u64_LE(p));
+		h = (rotl64(h, 27) * XXH_P1) + XXH_P4;
+	}
+	if ((end - p) >= 4) {
+		h ^= (u64) read_u32_LE(p) * XXH_P1;
+		h = (rotl64(h, 23) * XXH_P2) + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (*p) * XXH_P5;
+		h = rotl64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+enum ovl_err ovl_hash_file(const struct ovl_env *env, const char *filename, u64 seed, u64 *hash) {
+	u32 file_len = 0;
+	u8 *buf;
+
+	if (!env) env = &default_env;
+#if USE_MMAP
+	buf = map_exe(filename, &file_len, 0, env);
+	if (!buf) return OVL_EOPEN;
+	*hash = ovl_hash64(buf, file_len, seed);
+	munmap(buf, file_len);
+#else
+	buf = read_exe(filename, &file_len, env);
+	if (!buf) return OVL_EOPEN;
+	*hash = ovl_hash64(buf, file_len, seed);
+	ovl_free(env, buf);
+#endif
+	return OVL_OK;
+}
+
+/******** worker threads */
+
+/* build with -DUSE_THREADS=0 to do everything on the main thread */
+#ifndef USE_THREADS
+	#define USE_THREADS 1
+#endif
+
+#if USE_THREADS
+#include <pthread.h>
+#endif
+
+struct par_jobs {
+	void (*fn)(void *ctx, u32 job);
+	void (*fnw)(void *ctx, u32 job, unsigned worker);	//used instead of fn if set
+	void *ctx;
+	u32 njobs;
+	u32 next;	//next job to hand out
+#if USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+/** one per thread */
+struct par_worker_arg {
+	struct par_jobs *pj;
+	unsigned worker;
+#if USE_THREADS
+	pthread_t tid;
+#endif
+};
+
+static void *par_worker(void *arg) {
+	struct par_worker_arg *pw = arg;
+	struct par_jobs *pj = pw->pj;
+
+	while (1) {
+		u32 job;
+#if USE_THREADS
+		pthread_mutex_lock(&pj->lock);
+#endif
+		job = pj->next;
+		if (job < pj->njobs) pj->next++;
+#if USE_THREADS
+		pthread_mutex_unlock(&pj->lock);
+#endif
+		if (job >= pj->njobs) break;
+		if (pj->fnw) {
+			pj->fnw(pj->ctx, job, pw->worker);
+		} else {
+			pj->fn(pj->ctx, job);
+		}
+	}
+	return NULL;
+}
+
+static void par_run(struct par_jobs *pj, unsigned nthreads, const struct ovl_env *env) {
+	struct par_worker_arg self = {0};
+
+	self.pj = pj;
+#if USE_THREADS
+	struct par_worker_arg *pw = NULL;
+	unsigned started = 0;
+	unsigned i;
+
+	if (nthreads > pj->njobs) nthreads = pj->njobs;
+	pthread_mutex_init(&pj->lock, NULL);
+	if (nthreads > 1) {
+		pw = ovl_malloc(env, (nthreads - 1) * sizeof(struct par_worker_arg));
+	}
+	if (pw) {
+		for (started = 0; started < (nthreads - 1); started++) {
+			pw[started].pj = pj;
+			pw[started].worker = started + 1;
+			if (pthread_create(&pw[started].tid, NULL, par_worker, &pw[started])) break;
+		}
+	}
+	// if threads couldn't be started, this does all the work
+	par_worker(&self);
+	for (i = 0; i < started; i++) {
+		pthread_join(pw[i].tid, NULL);
+	}
+	ovl_free(env, pw);
+	pthread_mutex_destroy(&pj->lock);
+#else
+	(void) nthreads;
+	(void) env;
+	par_worker(&self);
+#endif
+	return;
+}
+
+/** run fn(ctx, job) for every job in 0 .. njobs - 1, on up to nthreads threads
+ * (the calling thread being one of them). Returns once all jobs are done.
+ *
+ * Jobs are handed out in order, but may complete in any order.
+ */
+void run_parallel(const struct ovl_env *env, unsigned nthreads, u32 njobs, void (*fn)(void *ctx, u32 job), void *ctx) {
+	struct par_jobs pj = {0};
+
+	if (!env) env = &default_env;
+
+	pj.fn = fn;
+	pj.ctx = ctx;
+	pj.njobs = njobs;
+	par_run(&pj, nthreads, env);
+	return;
+}
+
+void run_parallel_w(const struct ovl_env *env, unsigned nthreads, u32 njobs, void (*fn)(void *ctx, u32 job, unsigned worker), void *ctx) {
+	struct par_jobs pj = {0};
+
+	if (!env) env = &default_env;
+
+	pj.fnw = fn;
+	pj.ctx = ctx;
+	pj.njobs = njobs;
+	par_run(&pj, nthreads, env);
+	return;
+}
+
+unsigned num_cpus(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) return (unsigned) n;
+#endif
+	return 1;
+}
+
+/******** "int 0x3F" opcode scanner
+ *
+ * Shared by dump_ovlcalls() and fixup_int3f(). Returns candidate offsets in batches
+ * so the callers' per-hit work stays out of the inner loop.
+ * SSE2 / AVX2 kernels are picked at runtime when available, else memchr() does the work.
+ */
+
+#define INT3F_PATLEN 5	//CD 3F <ovl_id> <offs_lo> <offs_hi>
+#define SCAN_BATCH OVL_SCAN_BATCH	//max # of hits returned per call; must be >= 32 (one AVX2 step)
+
+/* build with -DSCAN_SIMD=0 to only use the generic scanner */
+#ifndef SCAN_SIMD
+	#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		#define SCAN_SIMD 1
+	#else
+		#define SCAN_SIMD 0
+	#endif
+#endif
+
+#if SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+typedef u32 (*scan_fn)(const u8 *buf, u32 lim, u32 *cursor, u32 *hits);
+
+/** generic scanner; also finishes the tail for the SIMD kernels.
+ * @param nhits : # of entries already in hits[]
+ * @return new # of entries in hits[]
+ */
+static u32 scan_int3f_tail(const u8 *buf, u32 lim, u32 *cursor, u32 *hits, u32 nhits) {
+	u32 ofs = *cursor;
+
+	while ((ofs < lim) && (nhits < SCAN_BATCH)) {
+		const u8 *p = memchr(&buf[ofs], 0xCD, lim - ofs);
+		if (!p) {
+			ofs = lim;
+			break;
+		}
+		ofs = p - buf;
+		if (buf[ofs + 1] == 0x3F) {
+			hits[nhits++] = ofs;
+		}
+		ofs++;
+	}
+	*cursor = ofs;
+	return nhits;
+}
+
+static u32 scan_int3f_generic(const u8 *buf, u32 lim, u32 *cursor, u32 *hits) {
+	return scan_int3f_tail(buf, lim, cursor, hits, 0);
+}
+
+#if SCAN_SIMD
+__attribute__((target("sse2")))
+static u32 scan_int3f_sse2(const u8 *buf, u32 lim, u32 *cursor, u32 *hits) {
+	const __m128i v_cd = _mm_set1_epi8((char) 0xCD);
+	const __m128i v_3f = _mm_set1_epi8(0x3F);
+	u32 ofs = *cursor;
+	u32 nhits = 0;
+
+	//compare 16 positions per step : buf[ofs + n] == CD && buf[ofs + n + 1] == 3F
+	while (((ofs + 16) <= lim) && ((nhits + 16) <= SCAN_BATCH)) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) &buf[ofs]);
+		__m128i hi = _mm_loadu_si128((const __m128i *) &buf[ofs + 1]);
+		u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(lo, v_cd), _mm_cmpeq_epi8(hi, v_3f)));
+		while (mask) {
+			hits[nhits++] = ofs + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+		ofs += 16;
+	}
+	*cursor = ofs;
+	return scan_int3f_tail(buf, lim, cursor, hits, nhits);
+}
+
+__attribute__((target("avx2")))
+static u32 scan_int3f_avx2(const u8 *buf, u32 lim, u32 *cursor, u32 *hits) {
+	const __m256i v_cd = _mm256_set1_epi8((char) 0xCD);
+	const __m256i v_3f = _mm256_set1_epi8(0x3F);
+	u32 ofs = *cursor;
+	u32 nhits = 0;
+
+	while (((ofs + 32) <= lim) && ((nhits + 32) <= SCAN_BATCH)) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *) &buf[ofs]);
+		__m256i hi = _mm256_loadu_si256((const __m256i *) &buf[ofs + 1]);
+		u32 mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(lo, v_cd), _mm256_cmpeq_epi8(hi, v_3f)));
+		while (mask) {
+			hits[nhits++] = ofs + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+		ofs += 32;
+	}
+	*cursor = ofs;
+	return scan_int3f_tail(buf, lim, cursor, hits, nhits);
+}
+#endif	//SCAN_SIMD
+
+static scan_fn pick_scanner(void) {
+#if SCAN_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return scan_int3f_avx2;
+	if (__builtin_cpu_supports("sse2")) return scan_int3f_sse2;
+#endif
+	return scan_int3f_generic;
+}
+
+/** find next batch of "CD 3F" candidates.
+ *
+ * @param buf : data to scan; must be readable up to and including buf[lim]
+ * @param lim : scan positions [*cursor, lim)
+ * @param cursor : where to start; updated to where the next call resumes
+ * @param hits : receives up to SCAN_BATCH offsets into buf, in ascending order
+ *
+ * @return # of hits written; 0 when the range is exhausted.
+ */
+static scan_fn scanner = NULL;
+
+/** pick scanner now rather than on first use; call before starting threads. */
+static void scan_init(void) {
+	if (!scanner) scanner = pick_scanner();
+	return;
+}
+
+static u32 scan_int3f(const u8 *buf, u32 lim, u32 *cursor, u32 *hits) {
+	if (!scanner) scanner = pick_scanner();
+	return scanner(buf, lim, cursor, hits);
+}
+
+u32 ovl_scan_calls(const u8 *buf, u32 lim, u32 *cursor, u32 *hits) {
+	return scan_int3f(buf, lim, cursor, hits);
+}
+
+/** scan limit for a buffer : the whole 5-byte pattern must fit */
+static inline u32 int3f_scanlim(u32 bufsiz) {
+	return (bufsiz > INT3F_PATLEN) ? (bufsiz - INT3F_PATLEN) : 0;
+}
+
+/******** reloc coverage
+ *
+ * A word patched by the loader (reloc item), or a LUT entry, can't be part of an overlay call.
+ * The cover bitmap has bit n set if a call of "span" bytes starting at n would overlap any
+ * of those bytes, so each candidate is rejected with one bit test.
+ */
+
+#define BIT_SET(bm, n)	((bm)[(n) >> 3] |= (u8) (1 << ((n) & 7)))
+#define BIT_TEST(bm, n)	((bm)[(n) >> 3] & (1 << ((n) & 7)))
+
+#define COVER_SCRATCH(bufsiz)	(((bufsiz) / 8) + 1)
+
+/** mark bytes [pos, pos + len) of a buffer of siz bytes as covered */
+static void cover_mark(u8 *cover, u32 siz, u32 pos, u32 len, u32 span) {
+	u32 lo = (pos >= (span - 1)) ? (pos - (span - 1)) : 0;
+	u32 hi = pos + len;
+
+	if (hi > siz) hi = siz;
+	for (; lo < hi; lo++) BIT_SET(cover, lo);
+	return;
+}
+
+/** mark the reloc items relocs[0 .. nrelocs - 1] as covered.
+ *
+ * @param base : buffer position of segment 0
+ * @param segbias : subtracted from reloc segments; items below it are ignored
+ */
+static void cover_relocs(u8 *cover, u32 siz, u32 base, const u8 *relocs, u32 nrelocs, u16 segbias, u32 span) {
+	u32 i;
+
+	for (i = 0; i < nrelocs; i++) {
+		u16 roffs = read_u16_LE(&relocs[(4 * i) + 0]);
+		u16 rseg = read_u16_LE(&relocs[(4 * i) + 2]);
+
+		if (rseg < segbias) continue;
+		cover_mark(cover, siz, base + ((u32) (rseg - segbias) * 16) + roffs, 2, span);
+	}
+	return;
+}
+
+/** cover bitmap of the whole file, from the reloc tables of the chunks.
+ * LUT positions aren't known here. Overlay reloc segments include the overlay load segment
+ * (see fixup_relocs()), so overlay relocs can only be placed if it is given.
+ *
+ * @param ovl_base : overlay load segment; 0 to use root relocs only
+ * @return bitmap indexed by file offset, to free with ovl_free(); NULL if malloc failed
+ */
+static u8 *cover_file(const struct exefile *exf, u16 ovl_base, u32 span) {
+	u8 *cover = ovl_calloc(exf->env, COVER_SCRATCH(exf->siz), 1);
+	u32 nchunks = ovl_base ? (exf->num_ovls + 1) : 1;
+	u32 i;
+
+	if (!cover) return NULL;
+	for (i = 0; i < nchunks; i++) {
+		const struct ovl_desc *oda = &exf->ovls[i];
+		cover_relocs(cover, exf->siz, oda->img_ofs, &exf->buf[oda->relocs_ofs], oda->hdr.numReloc,
+					i ? ovl_base : 0, span);
+	}
+	return cover;
+}
+
+/******** buffered listings
+ *
+ * Call and overlay listings can have many rows; they are formatted by hand into
+ * a large buffer instead of one fprintf() per row.
+ *
+ * FMT_BIN layout (all little-endian, records naturally aligned so the file can be
+ * mmap'd and indexed directly) :
+ *	file header, 16 bytes : "OVLZ", u16 version (1), u16 record type, u32 record size, u32 0
+ *	type 1 (overlays), 32 bytes per record :
+ *		u32 chunk_ofs, u32 img_siz, u32 img_ofs, u16 ovl #, u16 numReloc,
+ *		u16 numParaHeader, minAlloc, maxAlloc, initSS, initSP, initCS, initIP, overlayNum
+ *	type 2 (int 0x3F calls), 8 bytes per record :
+ *		u32 file_ofs, u16 offs, u8 ovl_idx, u8 0
+ *	type 3 (--pattern calls), 12 bytes per record :
+ *		u32 file_ofs, u16 ovl #, u16 offs, u8 ovl_idx, u8 pattern #,
+ *		u8 flags (PATREC_*: which operands the pattern has; absent ones are 0), u8 0
+ */
+#define OUTBUF_SIZ	(256 * 1024UL)
+#define OUTBUF_MAXREC	256	//largest formatted record
+
+#define BINREC_OVL	1
+#define BINREC_CALL	2
+#define BINREC_PATCALL	3
+#define BINREC_OVL_SIZ	32
+#define BINREC_CALL_SIZ	8
+#define BINREC_PATCALL_SIZ	12
+
+#define PATREC_OVL_IDX	1
+#define PATREC_OVL	2
+#define PATREC_OFFS	4
+
+struct outbuf {
+	const struct ovl_sink *out;
+	const struct ovl_env *env;
+	enum outfmt fmt;
+	char *buf;
+	u32 len;
+	bool err;	//a write failed
+};
+
+/** @return 0 if malloc failed */
+static bool ob_open(struct outbuf *ob, const struct ovl_sink *out, enum outfmt fmt, const struct ovl_env *env) {
+	ob->out = out;
+	ob->env = env;
+	ob->fmt = fmt;
+	ob->len = 0;
+	ob->err = 0;
+	ob->buf = ovl_malloc(env, OUTBUF_SIZ);
+	return (ob->buf != NULL);
+}
+
+static void ob_flush(struct outbuf *ob) {
+	if (ob->len && !ob->err && !ob->out->write(ob->out->ctx, ob->buf, ob->len)) ob->err = 1;
+	ob->len = 0;
+	return;
+}
+
+/** flush and free buffer
+ * @return 0 if any write failed
+ */
+static bool ob_close(struct outbuf *ob) {
+	ob_flush(ob);
+	ovl_free(ob->env, ob->buf);
+	ob->buf = NULL;
+	return !ob->err;
+}
+
+/** @return where to format the next record; room for OUTBUF_MAXREC chars */
+static inline char *ob_reserve(struct outbuf *ob) {
+	if ((ob->len + OUTBUF_MAXREC) > OUTBUF_SIZ) ob_flush(ob);
+	return &ob->buf[ob->len];
+}
+
+static inline void ob_commit(struct outbuf *ob, const char *end) {
+	ob->len = end - ob->buf;
+	return;
+}
+
+/** like "%0*X" : uppercase hex, at least mindigits.
+ * @return end of written chars
+ */
+static char *fmt_hex(char *p, u32 val, unsigned mindigits) {
+	static const char hexdigits[] = "0123456789ABCDEF";
+	unsigned nd = 1;
+	unsigned i;
+
+	while ((nd < 8) && (val >> (4 * nd))) nd++;
+	if (nd < mindigits) nd = mindigits;
+	for (i = nd; i > 0; i--) {
+		p[i - 1] = hexdigits[val & 0x0F];
+		val >>= 4;
+	}
+	return p + nd;
+}
+
+static char *fmt_dec(char *p, u32 val) {
+	char tmp[10];
+	unsigned nd = 0;
+
+	do {
+		tmp[nd++] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+	while (nd) *p++ = tmp[--nd];
+	return p;
+}
+
+/** copy string literal without its terminator */
+#define FMT_LIT(p, lit)	(memcpy((p), (lit), sizeof(lit) - 1), (p) + sizeof(lit) - 1)
+
+static char *put_u16(char *p, u16 val) {
+	write_u16_LE((u8 *) p, val);
+	return p + 2;
+}
+
+static char *put_u32(char *p, u32 val) {
+	write_u16_LE((u8 *) p, val & 0xFFFF);
+	write_u16_LE((u8 *) p + 2, val >> 16);
+	return p + 4;
+}
+
+/** FMT_BIN file header */
+static void ob_binheader(struct outbuf *ob, u16 rectype, u32 recsiz) {
+	char *p = ob_reserve(ob);
+
+	p = FMT_LIT(p, "OVLZ");
+	p = put_u16(p, 1);
+	p = put_u16(p, rectype);
+	p = put_u32(p, recsiz);
+	p = put_u32(p, 0);
+	ob_commit(ob, p);
+	return;
+}
+
+/** start of a call listing */
+static void emit_calls_header(struct outbuf *ob) {
+	char *p;
+
+	switch (ob->fmt) {
+	case FMT_TEXT:
+		p = ob_reserve(ob);
+		p = FMT_LIT(p, "file_ofs\tovl_idx\toffs\n");
+		ob_commit(ob, p);
+		break;
+	case FMT_BIN:
+		ob_binheader(ob, BINREC_CALL, BINREC_CALL_SIZ);
+		break;
+	default:
+		break;
+	}
+	return;
+}
+
+/** one int 0x3F call at file_ofs */
+static void emit_call(struct outbuf *ob, u32 file_ofs, u8 ovl_idx, u16 offs) {
+	char *p = ob_reserve(ob);
+
+	switch (ob->fmt) {
+	case FMT_TEXT:
+		p = fmt_hex(p, file_ofs, 4);
+		*p++ = '\t';
+		p = fmt_hex(p, ovl_idx, 2);
+		*p++ = '\t';
+		p = fmt_hex(p, offs, 4);
+		*p++ = '\n';
+		break;
+	case FMT_JSONL:
+		p = FMT_LIT(p, "{\"file_ofs\":");
+		p = fmt_dec(p, file_ofs);
+		p = FMT_LIT(p, ",\"ovl_idx\":");
+		p = fmt_dec(p, ovl_idx);
+		p = FMT_LIT(p, ",\"offs\":");
+		p = fmt_dec(p, offs);
+		p = FMT_LIT(p, "}\n");
+		break;
+	case FMT_BIN:
+		p = put_u32(p, file_ofs);
+		p = put_u16(p, offs);
+		*p++ = ovl_idx;
+		*p++ = 0;
+		break;
+	}
+	ob_commit(ob, p);
+	return;
+}
+
+/** raw search for all "int 0x3F" calls
+ *
+ * @param ob : where to print the list; quiet mode if NULL
+ * @param cover : if not NULL, drop hits on reloc items (see cover_file())
+ * @param covered : (output, can be NULL) # of hits dropped that way
+ *
+ * @return # of OVL calls found
+ *
+ * expect lots of spurious hits due to no filtering.
+ */
+static u32 dump_ovlcalls(const u8 *imgbuf, u32 bufiz, struct outbuf *ob, const u8 *cover, u32 *covered) {
+	u32 hits[SCAN_BATCH];
+	u32 nhits;
+	u32 ncalls = 0;
+	u32 ncov = 0;
+	u32 cursor = 0;	//within exe file
+	u32 lim = int3f_scanlim(bufiz);
+
+	if (ob) emit_calls_header(ob);
+
+	while ((nhits = scan_int3f(imgbuf, lim, &cursor, hits))) {
+		u32 h;
+
+		if (!ob && !cover) {
+			ncalls += nhits;
+			continue;
+		}
+		for (h = 0; h < nhits; h++) {
+			u32 ofs = hits[h];
+			if (cover && BIT_TEST(cover, ofs)) {
+				ncov++;
+				continue;
+			}
+			ncalls++;
+			if (ob) emit_call(ob, ofs, imgbuf[ofs+2], read_u16_LE(&imgbuf[ofs+3]));
+		}
+	}
+	if (covered) *covered = ncov;
+	return ncalls;
+}
+
+/******** 8086 instruction length decoder
+ *
+ * Table-driven, enough to linear-sweep 16-bit real mode code (8086 .. 286; 386 prefixes are
+ * skipped over but don't change operand sizes). Opcodes that aren't valid just count as 1 byte.
+ *
+ * "CD 3F" is special : the overlay manager's int 0x3F handler returns past 3 inline bytes,
+ * so it is decoded as a 5-byte instruction.
+ */
+#define OP_MODRM	0x01	//modrm byte (+ displacement) follows
+#define OP_I8	0x02	//1-byte immediate
+#define OP_I16	0x04	//2-byte immediate
+#define OP_I32	0x08	//far pointer (seg:ofs)
+#define OP_PFX	0x10	//prefix
+#define OP_GRP3	0x20	//F6 / F7 : TEST has an immediate, the others don't
+#define OP_0F	0x40	//two-byte opcode
+
+static const u8 optab[256] = {
+	0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x00, 0x40,	//00
+	0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x00, 0x00,	//10
+	0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x10, 0x00, 0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x10, 0x00,	//20
+	0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x10, 0x00, 0x01, 0x01, 0x01, 0x01, 0x02, 0x04, 0x10, 0x00,	//30
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//40
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//50
+	0x00, 0x00, 0x01, 0x01, 0x10, 0x10, 0x10, 0x10, 0x04, 0x05, 0x02, 0x03, 0x00, 0x00, 0x00, 0x00,	//60
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,	//70
+	0x03, 0x05, 0x03, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,	//80
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00,	//90
+	0x04, 0x04, 0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x02, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,	//A0
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,	//B0
+	0x03, 0x03, 0x04, 0x00, 0x01, 0x01, 0x03, 0x05, 0x06, 0x00, 0x04, 0x00, 0x00, 0x02, 0x00, 0x00,	//C0
+	0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,	//D0
+	0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x04, 0x04, 0x08, 0x02, 0x00, 0x00, 0x00, 0x00,	//E0
+	0x10, 0x00, 0x10, 0x10, 0x00, 0x00, 0x21, 0x21, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01,	//F0
+};
+
+/** length of the instruction at code[0]
+ * @param avail : # of bytes available; result is clipped to that.
+ * @return never 0 if avail > 0
+ */
+static u32 insn_len(const u8 *code, u32 avail) {
+	u32 len = 0;
+	u8 op, flags;
+
+	while ((len < avail) && (len < 4) && (optab[code[len]] & OP_PFX)) len++;
+	if (len >= avail) return avail;
+
+	op = code[len++];
+	flags = optab[op];
+	if (flags & OP_0F) {
+		if (len >= avail) return avail;
+		op = code[len++];
+		if (op <= 0x03) {
+			flags = OP_MODRM;	//LLDT / LGDT etc, LAR, LSL
+		} else if ((op & 0xF0) == 0x80) {
+			flags = OP_I16;	//386 near Jcc
+		} else {
+			flags = 0;
+		}
+	} else if ((op == 0xCD) && (len < avail) && (code[len] == 0x3F)) {
+		len += INT3F_PATLEN - 1;
+		return (len > avail) ? avail : len;
+	}
+
+	if (flags & OP_MODRM) {
+		u8 modrm, mod;
+
+		if (len >= avail) return avail;
+		modrm = code[len++];
+		mod = modrm >> 6;
+		if (mod == 1) {
+			len += 1;
+		} else if ((mod == 2) || ((mod == 0) && ((modrm & 7) == 6))) {
+			len += 2;
+		}
+		if ((flags & OP_GRP3) && (((modrm >> 3) & 7) <= 1)) {
+			flags |= (op & 1) ? OP_I16 : OP_I8;
+		}
+	}
+	if (flags & OP_I8) len += 1;
+	if (flags & OP_I16) len += 2;
+	if (flags & OP_I32) len += 4;
+
+	return (len > avail) ? avail : len;
+}
+
+/* Fast path tables, derived from optab[] : for most opcodes the length is
+ * (opcode + immediates) + (modrm + displacement), two lookups and no branches on flags.
+ * Prefixes, 0F xx, F6 / F7 and int 0x3F go through insn_len().
+ */
+#define DEC_MODRM	0x80	//add modrm_len[] of next byte
+#define DEC_SLOW	0x40	//use insn_len()
+#define DEC_MAXLEN	16	//fast path needs this many bytes available
+
+static u8 dectab[256];
+static u8 modrm_len[256];
+static bool dec_ready = 0;
+
+static void decoder_init(void) {
+	unsigned i;
+
+	for (i = 0; i < 256; i++) {
+		u8 flags = optab[i];
+		u8 len = 1;
+		u8 mod = i >> 6;
+
+		if (flags & OP_I8) len += 1;
+		if (flags & OP_I16) len += 2;
+		if (flags & OP_I32) len += 4;
+		if (flags & OP_MODRM) len |= DEC_MODRM;
+		if ((flags & (OP_PFX | OP_0F | OP_GRP3)) || (i == 0xCD)) len = DEC_SLOW;
+		dectab[i] = len;
+
+		modrm_len[i] = 1;
+		if (mod == 1) {
+			modrm_len[i] += 1;
+		} else if ((mod == 2) || ((mod == 0) && ((i & 7) == 6))) {
+			modrm_len[i] += 2;
+		}
+	}
+	dec_ready = 1;
+	return;
+}
+
+/** linear sweep of code[start .. end - 1], marking where each instruction starts.
+ *
+ * @param bounds : bitmap indexed like code[]; bits are only ever set.
+ */
+static void sweep_code(const u8 *code, u32 start, u32 end, u8 *bounds) {
+	u32 pc = start;
+
+	if (!dec_ready) decoder_init();
+
+	while ((end >= DEC_MAXLEN) && (pc <= end - DEC_MAXLEN)) {
+		u8 d = dectab[code[pc]];
+
+		BIT_SET(bounds, pc);
+		if (d & DEC_SLOW) {
+			pc += insn_len(&code[pc], end - pc);
+			continue;
+		}
+		//branchless : modrm length is masked off if the opcode has none
+		pc += (d & 0x0F) + (modrm_len[code[pc + 1]] & (u8) -(d >> 7));
+	}
+	while (pc < end) {
+		BIT_SET(bounds, pc);
+		pc += insn_len(&code[pc], end - pc);
+	}
+	return;
+}
+
+/** size of code region at start of an overlay image.
+ * Overlays are all code; in the root, DGROUP starts at SS in MSC programs.
+ */
+static u32 code_siz(const struct exefile *exf, u32 ovl) {
+	const struct ovl_desc *oda = &exf->ovls[ovl];
+	u32 dgroup = exf->hdr.initSS * 16UL;
+
+	if (ovl || (dgroup > oda->img_siz)) return oda->img_siz;
+	return dgroup;
+}
+
+/** like dump_ovlcalls(), but keep only calls that start on an instruction boundary
+ * within the code region img[0 .. code_end - 1].
+ *
+ * @param base : added to printed offsets
+ * @param ob : where to print the calls; quiet mode if NULL. Header isn't printed.
+ * @param rejected : (output, can be NULL) # of "CD 3F" hits that were dropped
+ * @param scratch : if not NULL, SWEEP_SCRATCH(bufsiz) bytes to use for the bitmap instead of allocating one
+ * @param cover : if not NULL, also drop hits on reloc items; indexed like base + ofs
+ * @param covered : (output, can be NULL) # of hits dropped that way, not counted in *rejected
+ *
+ * @return # of OVL calls found, -1 if malloc failed
+ */
+#define SWEEP_SCRATCH(bufsiz)	(((bufsiz) / 8) + 1)
+static u32 sweep_ovlcalls(const struct ovl_env *env, const u8 *imgbuf, u32 bufsiz, u32 code_end, u32 base,
+						struct outbuf *ob, u32 *rejected, u8 *scratch, const u8 *cover, u32 *covered) {
+	u32 hits[SCAN_BATCH];
+	u32 nhits;
+	u32 ncalls = 0;
+	u32 nrej = 0;
+	u32 ncov = 0;
+	u32 cursor = 0;
+	u32 lim = int3f_scanlim(bufsiz);
+	u8 *bounds;
+
+	if (code_end > bufsiz) code_end = bufsiz;
+	if (scratch) {
+		bounds = scratch;
+		memset(bounds, 0, SWEEP_SCRATCH(bufsiz));
+	} else {
+		bounds = ovl_calloc(env, SWEEP_SCRATCH(bufsiz), 1);
+		if (!bounds) return (u32) -1;
+	}
+	sweep_code(imgbuf, 0, code_end, bounds);
+
+	while ((nhits = scan_int3f(imgbuf, lim, &cursor, hits))) {
+		u32 h;
+		for (h = 0; h < nhits; h++) {
+			u32 ofs = hits[h];
+			if (!BIT_TEST(bounds, ofs)) {
+				nrej++;
+				continue;
+			}
+			if (cover && BIT_TEST(cover, base + ofs)) {
+				ncov++;
+				continue;
+			}
+			ncalls++;
+			if (!ob) continue;
+			emit_call(ob, base + ofs, imgbuf[ofs+2], read_u16_LE(&imgbuf[ofs+3]));
+		}
+	}
+	if (!scratch) ovl_free(env, bounds);
+	if (rejected) *rejected = nrej;
+	if (covered) *covered = ncov;
+	return ncalls;
+}
+
+/** list int 0x3F calls in code regions of every chunk, with file offsets.
+ * @param cover : see sweep_ovlcalls(), indexed by file offset
+ * @param covered : (output) # of hits dropped by cover[]
+ * @return # of calls found
+ */
+static enum ovl_err dump_ovlcalls_sweep(const struct exefile *exf, struct outbuf *ob, u32 *ncalls_out,
+						const u8 *cover, u32 *covered) {
+	u32 ncalls = 0;
+	u32 nrej = 0;
+	u32 i;
+
+	*covered = 0;
+	emit_calls_header(ob);
+	for (i = 0; i <= exf->num_ovls; i++) {
+		const struct ovl_desc *oda = &exf->ovls[i];
+		u32 rej, cov;
+		u32 n = sweep_ovlcalls(exf->env, &exf->buf[oda->img_ofs], oda->img_siz, code_siz(exf, i), oda->img_ofs, ob, &rej, NULL,
+							cover, &cov);
+		if (n == (u32) -1) {
+			ovl_msg(exf->env, "malloc choke\n");
+			return OVL_ENOMEM;
+		}
+		ncalls += n;
+		nrej += rej;
+		*covered += cov;
+	}
+	ob_flush(ob);
+	if (ob->fmt == FMT_TEXT) {
+		ovl_msg(exf->env, "%lu calls, %lu rejected (not on instruction boundary)\n",
+				(unsigned long) ncalls, (unsigned long) nrej);
+	}
+	*ncalls_out = ncalls;
+	return OVL_OK;
+}
+
+enum ovl_err ovl_list_calls(const struct exefile *exf, bool sweep, bool relocfilter, u16 ovl_base, enum outfmt fmt,
+					const struct ovl_sink *out, u32 *ncalls) {
+	struct outbuf ob;
+	enum ovl_err rv = OVL_OK;
+	u8 *cover = NULL;
+	u32 n = 0;
+	u32 covered = 0;
+
+	if (relocfilter) {
+		cover = cover_file(exf, ovl_base, INT3F_PATLEN);
+		if (!cover) {
+			ovl_msg(exf->env, "malloc choke\n");
+			return OVL_ENOMEM;
+		}
+	}
+	if (!ob_open(&ob, out, fmt, exf->env)) {
+		ovl_msg(exf->env, "malloc choke\n");
+		ovl_free(exf->env, cover);
+		return OVL_ENOMEM;
+	}
+	if (sweep) {
+		rv = dump_ovlcalls_sweep(exf, &ob, &n, cover, &covered);
+	} else {
+		n = dump_ovlcalls(exf->buf, exf->siz, &ob, cover, &covered);
+	}
+	if (!ob_close(&ob) && (rv == OVL_OK)) rv = OVL_EWRITE;
+	if (relocfilter && (rv == OVL_OK) && (fmt == FMT_TEXT)) {
+		ovl_msg(exf->env, "%lu rejected (on reloc items)\n", (unsigned long) covered);
+	}
+	ovl_free(exf->env, cover);
+	if (ncalls) *ncalls = n;
+	return rv;
+}
+
+/******** multi-pattern call scanner
+ *
+ * Overlay call encodings are described by a pattern table : fixed opcode bytes, then operands.
+ * An Aho-Corasick automaton built from the table finds every pattern in one pass over an
+ * image, whatever the number of patterns. Only patterns with a fixup rule are patched by
+ * ovl_unfold(), which keeps using the SIMD "CD 3F" scanner; the others are listed by ovl_list_patcalls().
+ */
+
+const struct call_pattern ovl_pat_msc = {"msc", {0xCD, 0x3F}, 2, "io", PATFIX_INT3F};
+
+/** @return # of operand bytes, -1 if bad operand letters */
+static int pat_oplen(const struct call_pattern *pat) {
+	const char *op;
+	int len = 0;
+
+	for (op = pat->operands; *op; op++) {
+		switch (*op) {
+		case 'i':
+		case 'b':
+			len += 1;
+			break;
+		case 'n':
+		case 'o':
+		case 'w':
+			len += 2;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return len;
+}
+
+static bool pat_valid(const struct call_pattern *pat) {
+	const char *c;
+
+	if (!pat->len || (pat->len > OVL_PAT_MAXLEN)) return 0;
+	if (!pat->name[0] || !memchr(pat->name, 0, sizeof(pat->name))) return 0;
+	for (c = pat->name; *c; c++) {
+		if (!(((*c >= 'a') && (*c <= 'z')) || ((*c >= 'A') && (*c <= 'Z')) || ((*c >= '0') && (*c <= '9')) || (*c == '_'))) return 0;
+	}
+	if (!memchr(pat->operands, 0, sizeof(pat->operands))) return 0;
+	return pat_oplen(pat) >= 0;
+}
+
+void ovl_patset_free(struct ovl_patset *ps, const struct ovl_env *env) {
+	if (!env) env = &default_env;
+	ovl_free(env, ps->next);
+	ovl_free(env, ps->out);
+	ovl_free(env, ps->olink);
+	ps->next = NULL;
+	ps->out = NULL;
+	ps->olink = NULL;
+	return;
+}
+
+enum ovl_err ovl_patset_build(struct ovl_patset *ps, const struct ovl_env *env, const struct call_pattern *pats, unsigned npats) {
+	u16 *fail;	//longest proper suffix that is also a state
+	u16 *queue;
+	u32 maxstates = 1;
+	u32 qhead = 0, qtail = 0;
+	unsigned p, q;
+	u32 s, b;
+
+	if (!env) env = &default_env;
+	memset(ps, 0, sizeof(*ps));
+	if (!npats || (npats > OVL_MAXPATS)) return OVL_EARGS;
+	for (p = 0; p < npats; p++) {
+		if (!pat_valid(&pats[p])) {
+			ovl_msg(env, "bad pattern #%u\n", p);
+			return OVL_EARGS;
+		}
+		for (q = 0; q < p; q++) {
+			if ((pats[q].len == pats[p].len) && !memcmp(pats[q].bytes, pats[p].bytes, pats[p].len)) {
+				ovl_msg(env, "patterns %s and %s have the same bytes\n", pats[q].name, pats[p].name);
+				return OVL_EARGS;
+			}
+		}
+		ps->pats[p] = pats[p];
+		ps->oplen[p] = pat_oplen(&pats[p]);
+		maxstates += pats[p].len;
+	}
+	ps->npats = npats;
+
+	//trie first : next[] = 0 means no edge yet
+	ps->next = ovl_calloc(env, maxstates * 256, sizeof(u16));
+	ps->out = ovl_calloc(env, maxstates, sizeof(u8));
+	ps->olink = ovl_calloc(env, maxstates, sizeof(u16));
+	fail = ovl_calloc(env, maxstates, sizeof(u16));
+	queue = ovl_malloc(env, maxstates * sizeof(u16));
+	if (!ps->next || !ps->out || !ps->olink || !fail || !queue) {
+		ovl_msg(env, "malloc choke\n");
+		ovl_free(env, fail);
+		ovl_free(env, queue);
+		ovl_patset_free(ps, env);
+		return OVL_ENOMEM;
+	}
+	ps->nstates = 1;
+	for (p = 0; p < npats; p++) {
+		s = 0;
+		for (q = 0; q < pats[p].len; q++) {
+			u16 *nx = &ps->next[(s << 8) | pats[p].bytes[q]];
+			if (!*nx) *nx = ps->nstates++;
+			s = *nx;
+		}
+		ps->out[s] = p + 1;
+	}
+
+	//then breadth-first : missing edges follow the failure links, making a DFA
+	for (b = 0; b < 256; b++) {
+		u16 t = ps->next[b];
+		if (t) queue[qtail++] = t;
+	}
+	while (qhead < qtail) {
+		s = queue[qhead++];
+		ps->olink[s] = ps->out[fail[s]] ? fail[s] : ps->olink[fail[s]];
+		for (b = 0; b < 256; b++) {
+			u16 *nx = &ps->next[(s << 8) | b];
+			u16 f = ps->next[((u32) fail[s] << 8) | b];
+			if (*nx) {
+				fail[*nx] = f;
+				queue[qtail++] = *nx;
+			} else {
+				*nx = f;
+			}
+		}
+	}
+	ovl_free(env, fail);
+	ovl_free(env, queue);
+	return OVL_OK;
+}
+
+/** decoded operands of a hit */
+struct pat_operands {
+	int ovl_idx;	//'i', -1 if none
+	int ovl;	//'n', -1 if none
+	int offs;	//'o', -1 if none
+};
+
+static void pat_decode(const struct call_pattern *pat, const u8 *p, struct pat_operands *po) {
+	const char *op;
+
+	po->ovl_idx = po->ovl = po->offs = -1;
+	p += pat->len;
+	for (op = pat->operands; *op; op++) {
+		switch (*op) {
+		case 'i':
+			po->ovl_idx = *p;
+			break;
+		case 'n':
+			po->ovl = read_u16_LE(p);
+			break;
+		case 'o':
+			po->offs = read_u16_LE(p);
+			break;
+		default:
+			break;
+		}
+		p += ((*op == 'i') || (*op == 'b')) ? 1 : 2;
+	}
+	return;
+}
+
+/** start of a multi-pattern call listing */
+static void emit_patcalls_header(struct outbuf *ob) {
+	char *p;
+
+	switch (ob->fmt) {
+	case FMT_TEXT:
+		p = ob_reserve(ob);
+		p = FMT_LIT(p, "file_ofs\tpattern\tovl_idx\tovl\toffs\n");
+		ob_commit(ob, p);
+		break;
+	case FMT_BIN:
+		ob_binheader(ob, BINREC_PATCALL, BINREC_PATCALL_SIZ);
+		break;
+	default:
+		break;
+	}
+	return;
+}
+
+/** text field : hex, or '-' if absent */
+static char *fmt_opt_hex(char *p, int val, unsigned mindigits) {
+	if (val < 0) {
+		*p++ = '-';
+		return p;
+	}
+	return fmt_hex(p, val, mindigits);
+}
+
+static void emit_patcall(struct outbuf *ob, u32 file_ofs, const struct call_pattern *pat, unsigned patno,
+				const struct pat_operands *po) {
+	char *p = ob_reserve(ob);
+	size_t nlen = strlen(pat->name);
+
+	switch (ob->fmt) {
+	case FMT_TEXT:
+		p = fmt_hex(p, file_ofs, 4);
+		*p++ = '\t';
+		memcpy(p, pat->name, nlen);
+		p += nlen;
+		*p++ = '\t';
+		p = fmt_opt_hex(p, po->ovl_idx, 2);
+		*p++ = '\t';
+		p = fmt_opt_hex(p, po->ovl, 4);
+		*p++ = '\t';
+		p = fmt_opt_hex(p, po->offs, 4);
+		*p++ = '\n';
+		break;
+	case FMT_JSONL:
+		p = FMT_LIT(p, "{\"file_ofs\":");
+		p = fmt_dec(p, file_ofs);
+		p = FMT_LIT(p, ",\"pattern\":\"");
+		memcpy(p, pat->name, nlen);
+		p += nlen;
+		*p++ = '"';
+		if (po->ovl_idx >= 0) {
+			p = FMT_LIT(p, ",\"ovl_idx\":");
+			p = fmt_dec(p, po->ovl_idx);
+		}
+		if (po->ovl >= 0) {
+			p = FMT_LIT(p, ",\"ovl\":");
+			p = fmt_dec(p, po->ovl);
+		}
+		if (po->offs >= 0) {
+			p = FMT_LIT(p, ",\"offs\":");
+			p = fmt_dec(p, po->offs);
+		}
+		p = FMT_LIT(p, "}\n");
+		break;
+	case FMT_BIN:
+		p = put_u32(p, file_ofs);
+		p = put_u16(p, (po->ovl >= 0) ? po->ovl : 0);
+		p = put_u16(p, (po->offs >= 0) ? po->offs : 0);
+		*p++ = (po->ovl_idx >= 0) ? po->ovl_idx : 0;
+		*p++ = patno;
+		*p++ = ((po->ovl_idx >= 0) ? PATREC_OVL_IDX : 0) | ((po->ovl >= 0) ? PATREC_OVL : 0) |
+				((po->offs >= 0) ? PATREC_OFFS : 0);
+		*p++ = 0;
+		break;
+	}
+	ob_commit(ob, p);
+	return;
+}
+
+/** one pass of the automaton over img[0 .. siz - 1].
+ * Hits are reported in the order they end; their operands must fit in the buffer.
+ * @param bounds : only keep hits that start on an instruction boundary; NULL : keep all
+ * @param base : added to printed offsets
+ * @param cover : if not NULL, drop hits on reloc items; indexed like base + start
+ * @param counts : per pattern, incremented
+ * @param covered : incremented for each hit dropped by cover[]
+ * @return # of hits
+ */
+static u32 patscan(const struct ovl_patset *ps, const u8 *img, u32 siz, const u8 *bounds, u32 base,
+				const u8 *cover, struct outbuf *ob, u32 *counts, u32 *covered) {
+	u32 state = 0;
+	u32 nhits = 0;
+	u32 i;
+
+	for (i = 0; i < siz; i++) {
+		u32 s;
+
+		state = ps->next[(state << 8) | img[i]];
+		for (s = ps->out[state] ? state : ps->olink[state]; s; s = ps->olink[s]) {
+			unsigned patno = ps->out[s] - 1;
+			const struct call_pattern *pat = &ps->pats[patno];
+			u32 start = i + 1 - pat->len;
+			struct pat_operands po;
+
+			if ((i + 1 + ps->oplen[patno]) > siz) continue;
+			if (bounds && !BIT_TEST(bounds, start)) continue;
+			if (cover && BIT_TEST(cover, base + start)) {
+				(*covered)++;
+				continue;
+			}
+			nhits++;
+			counts[patno]++;
+			if (!ob) continue;
+			pat_decode(pat, &img[start], &po);
+			emit_patcall(ob, base + start, pat, patno, &po);
+		}
+	}
+	return nhits;
+}
+
+enum ovl_err ovl_list_patcalls(const struct exefile *exf, const struct ovl_patset *ps, bool sweep, bool relocfilter, u16 ovl_base,
+					enum outfmt fmt, const struct ovl_sink *out, u32 *ncalls) {
+	const struct ovl_env *env = exf->env;
+	u32 counts[OVL_MAXPATS] = {0};
+	u8 *bounds = NULL;
+	u8 *cover = NULL;
+	struct outbuf ob;
+	u32 n = 0;
+	u32 covered = 0;
+	u32 max_img = 0;
+	unsigned p;
+	u32 i;
+
+	if (relocfilter) {
+		//longest call of the set : shorter ones near a reloc item may be dropped too
+		u32 span = 1;
+		for (p = 0; p < ps->npats; p++) {
+			if ((u32) (ps->pats[p].len + ps->oplen[p]) > span) span = ps->pats[p].len + ps->oplen[p];
+		}
+		cover = cover_file(exf, ovl_base, span);
+		if (!cover) {
+			ovl_msg(env, "malloc choke\n");
+			return OVL_ENOMEM;
+		}
+	}
+	if (!ob_open(&ob, out, fmt, env)) {
+		ovl_msg(env, "malloc choke\n");
+		ovl_free(env, cover);
+		return OVL_ENOMEM;
+	}
+	if (sweep) {
+		for (i = 0; i <= exf->num_ovls; i++) {
+			if (exf->ovls[i].img_siz > max_img) max_img = exf->ovls[i].img_siz;
+		}
+		bounds = ovl_malloc(env, SWEEP_SCRATCH(max_img));
+		if (!bounds) {
+			ovl_msg(env, "malloc choke\n");
+			ob_close(&ob);
+			ovl_free(env, cover);
+			return OVL_ENOMEM;
+		}
+	}
+
+	//like ovl_list_calls() : the whole file, or each chunk's code with --sweep
+	emit_patcalls_header(&ob);
+	if (!sweep) n = patscan(ps, exf->buf, exf->siz, NULL, 0, cover, &ob, counts, &covered);
+	for (i = 0; sweep && (i <= exf->num_ovls); i++) {
+		const struct ovl_desc *oda = &exf->ovls[i];
+		const u8 *img = &exf->buf[oda->img_ofs];
+
+		memset(bounds, 0, SWEEP_SCRATCH(oda->img_siz));
+		sweep_code(img, 0, code_siz(exf, i), bounds);
+		n += patscan(ps, img, oda->img_siz, bounds, oda->img_ofs, cover, &ob, counts, &covered);
+	}
+	ob_flush(&ob);
+	for (p = 0; (p < ps->npats) && (fmt == FMT_TEXT); p++) {
+		ovl_msg(env, "%s : %lu calls\n", ps->pats[p].name, (unsigned long) counts[p]);
+	}
+	if (relocfilter && (fmt == FMT_TEXT)) {
+		ovl_msg(env, "%lu rejected (on reloc items)\n", (unsigned long) covered);
+	}
+	ovl_free(env, bounds);
+	ovl_free(env, cover);
+	if (ncalls) *ncalls = n;
+	return ob_close(&ob) ? OVL_OK : OVL_EWRITE;
+}
+
+/** wall-clock time in seconds, for benchmarks */
+static double now_sec(void) {
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+#else
+	return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+double ovl_clock(void) {
+	return now_sec();
+}
+
+const char *ovl_phase_name(enum ovl_phase ph) {
+	static const char *const names[NUM_PHASES] = {
+		[PHASE_GUESS] = "guess",
+		[PHASE_COUNT] = "count",
+		[PHASE_LAYOUT] = "layout",
+		[PHASE_MAP] = "map",
+		[PHASE_INDEX] = "index",
+		[PHASE_FIXUP] = "fixup",
+		[PHASE_PACK] = "pack",
+		[PHASE_WRITE] = "write",
+	};
+	return (ph < NUM_PHASES) ? names[ph] : "?";
+}
+
+/** charge the time since *t to phase ph, and restart *t. No-op without stats */
+static void stat_lap(struct ovl_stats *st, enum ovl_phase ph, double *t) {
+	double t1;
+
+	if (!st) return;
+	t1 = now_sec();
+	st->t[ph] += t1 - *t;
+	*t = t1;
+	return;
+}
+
+#define BENCH_MINTIME 0.5	//seconds; repeat each pass at least this long
+
+enum ovl_err ovl_bench_scan(const struct exefile *exf, struct scan_bench *sb) {
+	unsigned raw_reps = 0, sweep_reps = 0;
+	double t0;
+	u32 i;
+
+	memset(sb, 0, sizeof(*sb));
+	for (i = 0; i <= exf->num_ovls; i++) {
+		sb->codebytes += code_siz(exf, i);
+	}
+	if (!sb->codebytes) {
+		ovl_msg(exf->env, "no code to scan\n");
+		return OVL_EFORMAT;
+	}
+
+	t0 = now_sec();
+	do {
+		sb->raw_calls = 0;
+		for (i = 0; i <= exf->num_ovls; i++) {
+			const struct ovl_desc *oda = &exf->ovls[i];
+			sb->raw_calls += dump_ovlcalls(&exf->buf[oda->img_ofs], code_siz(exf, i), NULL, NULL, NULL);
+		}
+		raw_reps++;
+		sb->raw_t = now_sec() - t0;
+	} while (sb->raw_t < BENCH_MINTIME);
+
+	t0 = now_sec();
+	do {
+		sb->sweep_calls = 0;
+		for (i = 0; i <= exf->num_ovls; i++) {
+			const struct ovl_desc *oda = &exf->ovls[i];
+			u32 n = sweep_ovlcalls(exf->env, &exf->buf[oda->img_ofs], oda->img_siz, code_siz(exf, i), 0, NULL, NULL, NULL, NULL, NULL);
+			if (n == (u32) -1) {
+				ovl_msg(exf->env, "malloc choke\n");
+				return OVL_ENOMEM;
+			}
+			sb->sweep_calls += n;
+		}
+		sweep_reps++;
+		sb->sweep_t = now_sec() - t0;
+	} while (sb->sweep_t < BENCH_MINTIME);
+
+	sb->raw_t /= raw_reps;
+	sb->sweep_t /= sweep_reps;
+	return OVL_OK;
+}
+
+/** print list of overlay chunks and their headers
+*/
+static void list_ovls(const struct exefile *exf, struct outbuf *ob) {
+	u32 i;
+	char *p;
+
+	switch (ob->fmt) {
+	case FMT_TEXT:
+		p = ob_reserve(ob);
+		p = FMT_LIT(p,	"OVL #\t"
+				"start(file ofs)\t"
+				"img siz\t"
+
+				"# relocs\t"
+				"Offset to load image (parags)\t"
+				"Minimum alloc (parags)\t"
+				"Maximum alloc (parags)\t"
+
+				"Initial SS:SP\t"
+				"Initial CS:IP\t"
+				"\n");
+		ob_commit(ob, p);
+		break;
+	case FMT_BIN:
+		ob_binheader(ob, BINREC_OVL, BINREC_OVL_SIZ);
+		break;
+	default:
+		break;
+	}
+	for (i = 0; i <= exf->num_ovls; i++) {
+		const struct ovl_desc *oda = &exf->ovls[i];
+		const struct header *hdr = &oda->hdr;
+
+		p = ob_reserve(ob);
+		switch (ob->fmt) {
+		case FMT_TEXT:
+			p = fmt_hex(p, i, 4);
+			*p++ = '\t';
+			p = fmt_hex(p, oda->chunk_ofs, 8);
+			*p++ = '\t';
+			p = fmt_hex(p, oda->img_siz, 8);
+			*p++ = '\t';
+
+			p = fmt_hex(p, hdr->numReloc, 4);
+			*p++ = '\t';
+			p = fmt_hex(p, hdr->numParaHeader, 4);
+			*p++ = '\t';
+			p = fmt_hex(p, hdr->minAlloc, 4);
+			*p++ = '\t';
+			p = fmt_hex(p, hdr->maxAlloc, 4);
+			*p++ = '\t';
+
+			p = fmt_hex(p, hdr->initSS, 4);
+			*p++ = ':';
+			p = fmt_hex(p, hdr->initSP, 4);
+			*p++ = '\t';
+			p = fmt_hex(p, hdr->initCS, 4);
+			*p++ = ':';
+			p = fmt_hex(p, hdr->initIP, 4);
+			*p++ = '\n';
+			break;
+		case FMT_JSONL:
+			p = FMT_LIT(p, "{\"ovl\":");
+			p = fmt_dec(p, i);
+			p = FMT_LIT(p, ",\"chunk_ofs\":");
+			p = fmt_dec(p, oda->chunk_ofs);
+			p = FMT_LIT(p, ",\"img_ofs\":");
+			p = fmt_dec(p, oda->img_ofs);
+			p = FMT_LIT(p, ",\"img_siz\":");
+			p = fmt_dec(p, oda->img_siz);
+			p = FMT_LIT(p, ",\"relocs\":");
+			p = fmt_dec(p, hdr->numReloc);
+			p = FMT_LIT(p, ",\"hdr_parags\":");
+			p = fmt_dec(p, hdr->numParaHeader);
+			p = FMT_LIT(p, ",\"min_alloc\":");
+			p = fmt_dec(p, hdr->minAlloc);
+			p = FMT_LIT(p, ",\"max_alloc\":");
+			p = fmt_dec(p, hdr->maxAlloc);
+			p = FMT_LIT(p, ",\"ss\":");
+			p = fmt_dec(p, hdr->initSS);
+			p = FMT_LIT(p, ",\"sp\":");
+			p = fmt_dec(p, hdr->initSP);
+			p = FMT_LIT(p, ",\"cs\":");
+			p = fmt_dec(p, hdr->initCS);
+			p = FMT_LIT(p, ",\"ip\":");
+			p = fmt_dec(p, hdr->initIP);
+			p = FMT_LIT(p, ",\"overlay_num\":");
+			p = fmt_dec(p, hdr->overlayNum);
+			p = FMT_LIT(p, "}\n");
+			break;
+		case FMT_BIN:
+			p = put_u32(p, oda->chunk_ofs);
+			p = put_u32(p, oda->img_siz);
+			p = put_u32(p, oda->img_ofs);
+			p = put_u16(p, i);
+			p = put_u16(p, hdr->numReloc);
+			p = put_u16(p, hdr->numParaHeader);
+			p = put_u16(p, hdr->minAlloc);
+			p = put_u16(p, hdr->maxAlloc);
+			p = put_u16(p, hdr->initSS);
+			p = put_u16(p, hdr->initSP);
+			p = put_u16(p, hdr->initCS);
+			p = put_u16(p, hdr->initIP);
+			p = put_u16(p, hdr->overlayNum);
+			break;
+		}
+		ob_commit(ob, p);
+	}
+	if (exf->chain_end < exf->siz) {
+		p = ob_reserve(ob);
+		switch (ob->fmt) {
+		case FMT_TEXT:
+			p = FMT_LIT(p, "bad MZ @ ");
+			p = fmt_dec(p, i);
+			*p++ = '\n';
+			break;
+		case FMT_JSONL:
+			p = FMT_LIT(p, "{\"bad_mz\":");
+			p = fmt_dec(p, exf->chain_end);
+			p = FMT_LIT(p, "}\n");
+			break;
+		default:
+			//a consumer can compare the last chunk's end with the file size
+			break;
+		}
+		ob_commit(ob, p);
+	}
+}
+
+enum ovl_err ovl_list(const struct exefile *exf, enum outfmt fmt, const struct ovl_sink *out) {
+	struct outbuf ob;
+
+	if (!ob_open(&ob, out, fmt, exf->env)) {
+		ovl_msg(exf->env, "malloc choke\n");
+		return OVL_ENOMEM;
+	}
+	list_ovls(exf, &ob);
+	return ob_close(&ob) ? OVL_OK : OVL_EWRITE;
+}
+
+/** fixup a set of relocs for a displaced chunk.
+ * (removed) param imgbuf must start at IMG_BASE and contain the appended newchunk
+ * @param relocbuf : destination for the new reloc table
+ * (removed) param dest_ofs : offset into imgbuf where to write the new reloc entries
+ * @param dispbase : offset into new load_image where the displaced chunk starts, in parags
+ * @param origbase : offset into original image where the chunk was meant to be mapped
+ * @param relocs : original reloc table, valid when newchunk was mapped at OVL_BASE
+ *
+ * All this does is change the reloc entries to point to the right items. The items themselves
+ * need not be changed since they are absolute pointers already.
+ */
+static void fixup_relocs(u8 *relocbuf, u16 dispbase, u16 origbase, const u8 *relocs, u16 num_relocs) {
+	u16 i;
+	u32 dest_ofs = 0;
+
+	for (i = 0; i < num_relocs; i++) {
+		u16 roffs = read_u16_LE(&relocs[(4 * i) + 0]);
+		u16 rseg = read_u16_LE(&relocs[(4 * i) + 2]);	//segment, relative to chunk base, where the item is located
+		//u32 r_lin = (rseg << 4) + roffs;	//"address" into displaced chunk of relocation item
+
+		u16 r_newseg = rseg - origbase + dispbase;
+
+		write_u16_LE(&relocbuf[dest_ofs], roffs);
+		dest_ofs += 2;
+		write_u16_LE(&relocbuf[dest_ofs], r_newseg);
+		dest_ofs += 2;
+
+	}
+	return;
+}
+
+/** correct all overlay segment LUT entries that point to the given overlay #.
+ *
+ * @param seglutpos : offset in imgbuf of seg LUT
+ * @param olutpos : offs in imgbuf of ovl # LUT
+ * @param lut_entries : # of entries
+ * @param seg_delta : value to add to LUT entry to point to new segment.
+ */
+static void fixup_seglut(u8 *imgbuf, u32 seglutpos, u32 olutpos, u16 lut_entries, u32 ovlno, u16 seg_delta) {
+	u32 i;
+
+	for (i = 0; i < lut_entries; i++) {
+		u8 test_no = imgbuf[olutpos + i];
+		if (test_no != ovlno) continue;
+
+		u16 seg = read_u16_LE(&imgbuf[seglutpos + (2*i) ]);
+		write_u16_LE(&imgbuf[seglutpos + (2*i) ], seg + seg_delta);
+	}
+}
+
+/******** reloc segment index
+ *
+ * For each new reloc item, fixup_int3f() wants an existing reloc segment that can reach it
+ * with a 16-bit offset. Instead of a linear search through the reloc table, keep the
+ * distinct segments sorted, plus a sparse table giving the lowest reloc table index among any
+ * run of segments; either query is then a binary search + O(1) lookup.
+ */
+
+struct segidx {
+	const u8 *relocs;	//indexed reloc table
+	u32 nsegs;
+	u32 levels;	//# of rows in first[]
+	u16 *seg;	//distinct segments, ascending
+	u32 *first;	//first[(k * nsegs) + i] : lowest reloc index among seg[i .. i + 2^k - 1]
+};
+
+/** # of rows in first[] for "nsegs" segments */
+static u32 segidx_levels(u32 nsegs) {
+	u32 k;
+
+	for (k = 1; (1UL << k) <= nsegs; k++);
+	return k;
+}
+
+/** memory needed by segidx_build() for a table of "num_relocs" entries.
+ * Worst case, every reloc has its own segment.
+ */
+static size_t segidx_memsiz(u32 num_relocs) {
+	u32 nsegs = (num_relocs < 0x10000) ? num_relocs : 0x10000;
+
+	return (0x10000 * sizeof(u32)) +
+		(segidx_levels(nsegs) * nsegs * sizeof(u32)) +
+		(nsegs * sizeof(u16));
+}
+
+/** build index from the first "num_relocs" entries of a reloc table.
+ * @param mem : segidx_memsiz(num_relocs) bytes, u32-aligned; the index points into it.
+ */
+static void segidx_build(struct segidx *sx, const u8 *relocs, u32 num_relocs, void *mem) {
+	u32 *firstseen = mem;	//indexed by segment
+	u32 i, k, nsegs = 0;
+
+	sx->relocs = relocs;
+	sx->seg = NULL;
+	sx->first = NULL;
+	sx->nsegs = 0;
+	sx->levels = 0;
+
+	memset(firstseen, 0xFF, 0x10000 * sizeof(u32));
+
+	for (i = 0; i < num_relocs; i++) {
+		u16 rseg = read_u16_LE(&relocs[(4 * i) + 2]);
+		if (firstseen[rseg] == UINT32_MAX) {
+			firstseen[rseg] = i;
+			nsegs++;
+		}
+	}
+	if (!nsegs) return;
+
+	sx->levels = segidx_levels(nsegs);
+	sx->first = &firstseen[0x10000];
+	sx->seg = (u16 *) &sx->first[sx->levels * nsegs];
+
+	// counting-sort style compaction
+	for (i = 0; i < 0x10000; i++) {
+		if (firstseen[i] == UINT32_MAX) continue;
+		sx->seg[sx->nsegs] = i;
+		sx->first[sx->nsegs] = firstseen[i];
+		sx->nsegs++;
+	}
+
+	for (k = 1; k < sx->levels; k++) {
+		const u32 *prev = &sx->first[(k - 1) * nsegs];
+		u32 *cur = &sx->first[k * nsegs];
+		u32 half = 1UL << (k - 1);
+		for (i = 0; (i + (2 * half)) <= nsegs; i++) {
+			cur[i] = (prev[i] < prev[i + half]) ? prev[i] : prev[i + half];
+		}
+	}
+	return;
+}
+
+/** index of first seg[] entry >= val
+ * @param steps : incremented for each search step
+ */
+static u32 segidx_lower(const struct segidx *sx, u32 val, u64 *steps) {
+	u32 lo = 0, hi = sx->nsegs;
+	while (lo < hi) {
+		u32 mid = (lo + hi) / 2;
+		(*steps)++;
+		if (sx->seg[mid] < val) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/** find an indexed segment that can reach linear address "lin" with an offset < 0xFFFF
+ *
+ * @param r_seg : result
+ * @param steps : incremented by the # of search steps
+ * @return 0 if no indexed segment is usable
+ */
+static bool segidx_find(const struct segidx *sx, u32 lin, enum segpick pick, u16 *r_seg, u64 *steps) {
+	u32 seg_lo, seg_hi;	//usable range, inclusive
+	u32 ilo, ihi;	//matching range in seg[], exclusive end
+	u32 k, a, b;
+
+	seg_lo = (lin > 0xFFFE) ? ((lin - 0xFFFE + 15) >> 4) : 0;
+	seg_hi = lin >> 4;
+	ilo = segidx_lower(sx, seg_lo, steps);
+	ihi = segidx_lower(sx, seg_hi + 1, steps);
+	if (ilo >= ihi) return 0;
+
+	if (pick == SEGPICK_CLOSEST) {
+		*r_seg = sx->seg[ihi - 1];
+		return 1;
+	}
+
+	//range minimum over first[], two overlapping power-of-2 blocks
+	for (k = 0; (2UL << k) <= (ihi - ilo); k++);
+	a = sx->first[(k * sx->nsegs) + ilo];
+	b = sx->first[(k * sx->nsegs) + ihi - (1UL << k)];
+	a = (a < b) ? a : b;
+	*r_seg = read_u16_LE(&sx->relocs[(4 * a) + 2]);
+	return 1;
+}
+
+/** fixup_int3f() counters, see ovl_stats */
+struct fixup_tally {
+	u32 reused;
+	u64 steps;
+	u32 covered;	//hits dropped by the cover bitmap
+	u32 foreign;	//calls into overlays of other shards
+};
+
+/** replace "CD 3F" opcode and following 3 bytes at img[cur] with a "call far ptr" to the correct destination */
+static void int3f_rewrite(const u8 *seglut, u8 *img, u32 cur) {
+	u8 ovl_id = img[cur + 2];	//not the same as overlay # !
+	u16 seg, offs;
+
+	//obtain actual call destination
+	offs = read_u16_LE(&img[cur + 3]);
+	seg = read_u16_LE(&seglut[(2 * ovl_id)]);
+
+	//write new opcode
+	img[cur] = 0x9A;	//opcode for "call (far ptr) seg:offs"
+	write_u16_LE(&img[cur+1], offs);
+	write_u16_LE(&img[cur+3], seg);
+	return;
+}
+
+/** write the reloc entry for the call patched at image position "cur".
+ *
+ * @param rpos : offs within relocs[] for the new reloc item
+ * @param ft : counters to update
+ */
+static void int3f_reloc(u32 cur, u8 *relocs, u32 rpos, const struct segidx *sx, enum segpick pick, struct fixup_tally *ft) {
+	u16 r_seg, r_offs;	//seg:ofs or relocation item within img[]
+
+	//Try to reuse an existing segment that can reach the reloc item with an offset < 64k
+	if (segidx_find(sx, cur + 3, pick, &r_seg, &ft->steps)) {
+		ft->reused++;
+	} else {
+		//we couldn't find an appropriate seg : too bad.
+		r_seg = (cur + 3) >> 4;
+	}
+	r_offs = (cur + 3) - (r_seg * 16);	//offset within segment of remapped OVL
+	write_u16_LE(&relocs[rpos + 0], r_offs);
+	write_u16_LE(&relocs[rpos + 2], r_seg);
+	return;
+}
+
+/** patch one int 0x3F call and add its reloc entry.
+ *
+ * @param cur : position of "CD 3F" in img[]
+ * @param rpos : offs within relocs[] for the new reloc item
+ * @param ft : counters to update
+ */
+static void patch_int3f(const u8 *seglut, u8 *img, u32 cur, u8 *relocs, u32 rpos,
+				const struct segidx *sx, enum segpick pick, struct fixup_tally *ft) {
+	int3f_rewrite(seglut, img, cur);
+	int3f_reloc(cur, relocs, rpos, sx, pick, ft);
+	return;
+}
+
+/** fixup INT 0x3F calls
+ *
+ * @param seglut : segment LUT
+ * @param olut : ovl # LUT
+ * @param lut_entries : # of entries
+ * @param img : image buffer to modify
+ * @param relocs : complete reloc table,
+ * @param rcur: offs within relocs[] for new reloc items
+ * @param rmax : relocs[] has room for this many new items after rcur
+ * @param sx : index of the segments in relocs[0 .. rcur - 1]
+ * @param pick : which existing segment to use for new reloc items
+ * @param bounds : if not NULL, bitmap of instruction boundaries (see sweep_code()); hits
+ *		elsewhere are left alone
+ * @param cover : if not NULL, hits overlapping reloc items or LUTs are left alone (see cover_mark())
+ * @param foreign : if not NULL, bitmap of ovl IDs whose calls are left alone (see shard_view())
+ * @param env : for diagnostics
+ * @param ft : counters to update
+ *
+ * @return # of fixups carried out.
+ *
+ * replaces "CD 3F" opcodes and following 3 bytes with a "call far ptr" to the correct destination
+ * this must be done after the LUT has been corrected with the new mapping.
+ */
+static u32 fixup_int3f(const u8 *seglut, const u8 *olut, u16 lut_entries, u8 *img, u32 imgsiz, u8 *relocs, u32 rcur, u32 rmax,
+				const struct segidx *sx, enum segpick pick, const u8 *bounds, const u8 *cover,
+				const u8 *foreign, const struct ovl_env *env, struct fixup_tally *ft) {
+	u32 nrelocs = 0;
+	u32 hits[SCAN_BATCH];
+	u32 nhits;
+	u32 scanpos = 0;
+	u32 nextpos = 0;	//hits before this are inside an already patched call
+	u32 lim = int3f_scanlim(imgsiz);
+
+	(void) olut;
+	while ((nhits = scan_int3f(img, lim, &scanpos, hits))) {
+		u32 h;
+		for (h = 0; h < nhits; h++) {
+			u32 cur = hits[h];
+
+			if (cur < nextpos) continue;
+			if (bounds && !BIT_TEST(bounds, cur)) continue;
+			if (cover && BIT_TEST(cover, cur)) {
+				ft->covered++;
+				continue;
+			}
+			if (foreign && BIT_TEST(foreign, img[cur + 2])) {
+				//a call all the same : skip its operands
+				ft->foreign++;
+				nextpos = cur + INT3F_PATLEN;
+				continue;
+			}
+
+			//match !
+			if (img[cur + 2] >= lut_entries) {
+				ovl_msg(env, "ovl ID > lut_entries @ %X !?\n", cur);
+				return nrelocs;
+			}
+			if (nrelocs >= rmax) {
+				ovl_msg(env, "reloc table full @ %X !?\n", cur);
+				return nrelocs;
+			}
+			patch_int3f(seglut, img, cur, relocs, rcur + (nrelocs * 4), sx, pick, ft);
+
+			nrelocs += 1;
+			nextpos = cur + INT3F_PATLEN;
+		}
+	}
+
+	return nrelocs;
+}
+
+/******** multi-threaded fixup_int3f()
+ *
+ * The image is cut in chunks that are scanned in parallel. Which hits are actually patched
+ * depends on the previous patch (a call covers 5 bytes), so that is resolved serially
+ * over the hit lists. Each chunk then knows where its reloc entries go, and patching
+ * runs in parallel again.
+ */
+
+#define INT3F_MINCHUNK	(64 * 1024UL)	//don't bother splitting finer than this
+
+struct int3f_chunk {
+	u32 start;	//scan positions [start, end)
+	u32 end;
+	u32 *hits;	//after resolve : only the hits to patch
+	u32 nhits;
+	u32 alloc;
+	u32 rfirst;	//index of this chunk's first new reloc entry
+	struct fixup_tally ft;
+	bool oom;
+};
+
+struct int3f_ctx {
+	const struct ovl_env *env;
+	const u8 *seglut;
+	u8 *img;
+	u8 *relocs;
+	u32 rcur;
+	const struct segidx *sx;
+	enum segpick pick;
+	struct int3f_chunk *chunks;
+};
+
+static void int3f_scan_chunk(void *vctx, u32 job) {
+	struct int3f_ctx *ctx = vctx;
+	struct int3f_chunk *ch = &ctx->chunks[job];
+	u32 cursor = ch->start;
+
+	while (1) {
+		u32 *tmp;
+
+		if ((ch->alloc - ch->nhits) < SCAN_BATCH) {
+			u32 newalloc = ch->alloc ? (ch->alloc * 2) : (4 * SCAN_BATCH);
+			tmp = ovl_realloc(ctx->env, ch->hits, newalloc * sizeof(u32));
+			if (!tmp) {
+				ch->oom = 1;
+				return;
+			}
+			ch->hits = tmp;
+			ch->alloc = newalloc;
+		}
+		u32 nhits = scan_int3f(ctx->img, ch->end, &cursor, &ch->hits[ch->nhits]);
+		if (!nhits) break;
+		ch->nhits += nhits;
+	}
+	return;
+}
+
+static void int3f_patch_chunk(void *vctx, u32 job) {
+	struct int3f_ctx *ctx = vctx;
+	struct int3f_chunk *ch = &ctx->chunks[job];
+	u32 h;
+
+	for (h = 0; h < ch->nhits; h++) {
+		patch_int3f(ctx->seglut, ctx->img, ch->hits[h], ctx->relocs, ctx->rcur + ((ch->rfirst + h) * 4),
+					ctx->sx, ctx->pick, &ch->ft);
+	}
+	return;
+}
+
+/** same as fixup_int3f(), split over "nthreads" threads. Output is identical.
+ */
+static u32 fixup_int3f_mt(const u8 *seglut, const u8 *olut, u16 lut_entries, u8 *img, u32 imgsiz, u8 *relocs, u32 rcur, u32 rmax,
+				const struct segidx *sx, enum segpick pick, const u8 *bounds, const u8 *cover,
+				const u8 *foreign, const struct ovl_env *env, struct fixup_tally *ft, unsigned nthreads) {
+	struct int3f_ctx ctx;
+	struct int3f_chunk *chunks;
+	u32 lim = int3f_scanlim(imgsiz);
+	u32 nchunks, chunksiz, c;
+	u32 nextpos = 0;
+	u32 nrelocs = 0;
+	bool stop = 0;
+	bool serial = 0;	//patches would change the LUT : must be done in order
+
+	nchunks = nthreads * 4;
+	if ((lim / nchunks) < INT3F_MINCHUNK) {
+		nchunks = (lim / INT3F_MINCHUNK) + 1;
+	}
+	chunksiz = (lim / nchunks) + 1;
+
+	chunks = ovl_calloc(env, nchunks, sizeof(struct int3f_chunk));
+	if (!chunks) {
+		return fixup_int3f(seglut, olut, lut_entries, img, imgsiz, relocs, rcur, rmax, sx, pick, bounds, cover, foreign, env, ft);
+	}
+	for (c = 0; c < nchunks; c++) {
+		chunks[c].start = c * chunksiz;
+		chunks[c].end = chunks[c].start + chunksiz;
+		if (chunks[c].start > lim) chunks[c].start = lim;
+		if (chunks[c].end > lim) chunks[c].end = lim;
+	}
+
+	ctx.env = env;
+	ctx.seglut = seglut;
+	ctx.img = img;
+	ctx.relocs = relocs;
+	ctx.rcur = rcur;
+	ctx.sx = sx;
+	ctx.pick = pick;
+	ctx.chunks = chunks;
+
+	// 1) find all candidates. Nothing is modified yet.
+	run_parallel(env, nthreads, nchunks, int3f_scan_chunk, &ctx);
+	for (c = 0; c < nchunks; c++) {
+		if (chunks[c].oom) break;
+	}
+	if (c < nchunks) {
+		for (c = 0; c < nchunks; c++) ovl_free(env, chunks[c].hits);
+		ovl_free(env, chunks);
+		return fixup_int3f(seglut, olut, lut_entries, img, imgsiz, relocs, rcur, rmax, sx, pick, bounds, cover, foreign, env, ft);
+	}
+
+	// 2) keep hits that don't overlap the previous call, stop at the first bad ID.
+	for (c = 0; c < nchunks; c++) {
+		struct int3f_chunk *ch = &chunks[c];
+		u32 h, kept = 0;
+
+		ch->rfirst = nrelocs;
+		for (h = 0; (h < ch->nhits) && !stop; h++) {
+			u32 cur = ch->hits[h];
+
+			if (cur < nextpos) continue;
+			if (bounds && !BIT_TEST(bounds, cur)) continue;
+			if (cover && BIT_TEST(cover, cur)) {
+				ft->covered++;
+				continue;
+			}
+			if (foreign && BIT_TEST(foreign, img[cur + 2])) {
+				ft->foreign++;
+				nextpos = cur + INT3F_PATLEN;
+				continue;
+			}
+			if (img[cur + 2] >= lut_entries) {
+				ovl_msg(env, "ovl ID > lut_entries @ %X !?\n", cur);
+				stop = 1;
+				break;
+			}
+			if ((nrelocs + kept) >= rmax) {
+				ovl_msg(env, "reloc table full @ %X !?\n", cur);
+				stop = 1;
+				break;
+			}
+			if ((cur < ((seglut - img) + (2 * lut_entries))) && ((cur + INT3F_PATLEN) > (u32) (seglut - img))) {
+				serial = 1;
+			}
+			ch->hits[kept++] = cur;
+			nextpos = cur + INT3F_PATLEN;
+		}
+		ch->nhits = kept;
+		nrelocs += kept;
+	}
+
+	// 3) patch
+	if (serial) {
+		for (c = 0; c < nchunks; c++) {
+			int3f_patch_chunk(&ctx, c);
+		}
+	} else {
+		run_parallel(env, nthreads, nchunks, int3f_patch_chunk, &ctx);
+	}
+
+	for (c = 0; c < nchunks; c++) {
+		ft->reused += chunks[c].ft.reused;
+		ft->steps += chunks[c].ft.steps;
+		ovl_free(env, chunks[c].hits);
+	}
+	ovl_free(env, chunks);
+	return nrelocs;
+}
+
+/** tweak header fields for mostly correct info.
+ *
+ * @param rcur size (bytes) of all relocs in in nex.relocs[]
+ * @param imgcur_parags size (parags) of load image
+ *
+ * checksum ignored
+ * new header must be already filled except
+ *	lastPageSize;
+ *	numPages;
+ *	numReloc;
+ *	numParaHeader;
+ *	inital SS:SP
+ */
+static void newheader_fill(struct new_exe *nex, u32 rcur, u16 imgcur_parags) {
+	nex->hdr.relocTabOffset = sizeof(struct header);	//1C != 1E !!
+	nex->hdr.numReloc = rcur / 4;
+	nex->hdr.numParaHeader = (sizeof(struct header) + rcur + 15) >> 4;	//round to next parag
+	nex->hdr.lastPageSize = ((nex->hdr.numParaHeader + imgcur_parags) * 16) & 511;
+    nex->hdr.numPages = (((nex->hdr.numParaHeader + imgcur_parags) * 16) + 511) / 512;
+    nex->hdr.initSS = imgcur_parags;
+    nex->hdr.initSP = 8;	//dummy 8-byte stack
+	return;
+}
+
+/** write header and relocs, 0-padded up to the image.
+ * @return # of bytes written, 0 if write failed
+ */
+static u32 newheader_write(const struct ovl_sink *out, const struct new_exe *nex, u32 rcur) {
+	u32 wcur = 0;
+	u32 padlen;
+	const u8 pagebuf[16] = {0};	//just used to write padding 0 bytes
+
+    //write hdr
+    if (!out->write(out->ctx, &nex->hdr, sizeof(struct header))) goto write_err;
+    wcur += sizeof(struct header);
+
+    //write relocs
+    if (rcur && !out->write(out->ctx, nex->relocs, rcur)) goto write_err;
+    wcur += rcur;
+
+	//0-pad relocs if necessary
+	padlen = (nex->hdr.numParaHeader * 16) - wcur;
+	if (padlen && !out->write(out->ctx, pagebuf, padlen)) goto write_err;
+	wcur += padlen;
+	return wcur;
+
+write_err:
+	return 0;
+}
+
+/** numReloc is a u16 */
+static bool newheader_fits(const struct ovl_env *env, u32 rcur) {
+	if ((rcur / 4) <= 0xFFFF) return 1;
+	ovl_msg(env, "0x%lX relocs don't fit in an .exe header (see --packrelocs, --shard)\n", (unsigned long) (rcur / 4));
+	return 0;
+}
+
+/** fill in header (see newheader_fill()), and write out with the image.
+ * @return 0 if write failed
+ */
+static bool dump_newheader(const struct ovl_sink *out, struct new_exe *nex, u32 rcur, u16 imgcur_parags, const struct ovl_env *env) {
+	u32 wcur;
+#if PADPAGE
+	u32 padlen;
+	const u8 pagebuf[512] = {0};	//just used to write padding 0 bytes
+#endif
+
+	newheader_fill(nex, rcur, imgcur_parags);
+	wcur = newheader_write(out, nex, rcur);
+	if (!wcur) goto write_err;
+
+	//write image
+	if (!out->write(out->ctx, nex->img, imgcur_parags * 16)) goto write_err;
+	wcur += imgcur_parags * 16;
+
+	//0-pad to 512-byte page if necessary
+#if PADPAGE
+	padlen = (nex->hdr.numPages * 512) - wcur;
+	if (padlen && !out->write(out->ctx, pagebuf, padlen)) goto write_err;
+#endif
+
+	return 1;
+
+write_err:
+	ovl_msg(env, "fwrite err\n");
+	return 0;
+}
+
+/******** reloc table packing
+ *
+ * The unfolded table is root relocs, then each overlay's, then the new call relocs, with
+ * whatever segments they came with. Any seg:ofs with the same linear address is equivalent
+ * to the loader, so entries are sorted by address, duplicates dropped, and every entry is
+ * rebased on the 64 kB-aligned segment that contains it (0000, 1000, 2000 ...).
+ */
+
+#define PACK_RADIX_BITS	11	//2 passes cover linear addresses up to 4 MB
+
+/** memory needed by pack_relocs() */
+#define PACK_MEMSIZ(num_relocs)	((2 * (size_t) (num_relocs) * sizeof(u32)) + ((1UL << PACK_RADIX_BITS) * sizeof(u32)))
+
+/** LSD radix sort of keys < 4 MB.
+ * @param tmp : room for n entries
+ * @param count : room for 1 << PACK_RADIX_BITS entries
+ * @return sorted keys : either a or tmp
+ */
+static u32 *radix_sort_u32(u32 *a, u32 *tmp, u32 n, u32 *count) {
+	u32 i, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		unsigned shift = pass * PACK_RADIX_BITS;
+		u32 mask = (1UL << PACK_RADIX_BITS) - 1;
+		u32 sum = 0;
+		u32 *swap;
+
+		memset(count, 0, (1UL << PACK_RADIX_BITS) * sizeof(u32));
+		for (i = 0; i < n; i++) {
+			count[(a[i] >> shift) & mask]++;
+		}
+		for (i = 0; i <= mask; i++) {
+			u32 c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++) {
+			tmp[count[(a[i] >> shift) & mask]++] = a[i];
+		}
+		swap = a;
+		a = tmp;
+		tmp = swap;
+	}
+	return a;
+}
+
+/** linear addresses of relocs[0 .. num_relocs - 1], sorted.
+ * @param mem : PACK_MEMSIZ(num_relocs) bytes, u32-aligned
+ */
+static u32 *reloc_lins_sorted(const u8 *relocs, u32 num_relocs, void *mem) {
+	u32 *lin = mem;
+	u32 *tmp = &lin[num_relocs];
+	u32 i;
+
+	for (i = 0; i < num_relocs; i++) {
+		u32 ofs = read_u16_LE(&relocs[(4 * i) + 0]);
+		u32 seg = read_u16_LE(&relocs[(4 * i) + 2]);
+		lin[i] = (seg << 4) + ofs;
+	}
+	return radix_sort_u32(lin, tmp, num_relocs, &tmp[num_relocs]);
+}
+
+/** sort, dedup and rebase relocs[0 .. num_relocs - 1] in place.
+ * @param mem : PACK_MEMSIZ(num_relocs) bytes, u32-aligned
+ * @return new # of entries
+ */
+static u32 pack_relocs(u8 *relocs, u32 num_relocs, void *mem) {
+	u32 *lin = reloc_lins_sorted(relocs, num_relocs, mem);
+	u32 i, n;
+
+	for (i = 0, n = 0; i < num_relocs; i++) {
+		u32 seg, ofs;
+
+		if (n && (lin[i] == lin[i - 1])) continue;
+		seg = (lin[i] >> 16) << 12;
+		ofs = lin[i] - (seg << 4);
+		if (ofs == 0xFFFF) {
+			//reloc item would straddle the end of the segment
+			seg = lin[i] >> 4;
+			ofs = lin[i] & 0x0F;
+		}
+		write_u16_LE(&relocs[(4 * n) + 0], ofs);
+		write_u16_LE(&relocs[(4 * n) + 2], seg);
+		n++;
+	}
+	return n;
+}
+
+/******** unfold memory plan
+ *
+ * Every buffer of an unfold is carved out of one arena. Sizes all follow from the overlay
+ * index, except the room for the new int 0x3F reloc entries : that's only known after counting
+ * calls, so the reloc table goes last and only the end of the plan moves.
+ * While counting, the per-overlay sweep bitmaps use the space where the segment index and
+ * the final bitmap go later.
+ */
+
+#define PLAN_ALIGN(x)	(((x) + 15) & ~(size_t) 15)
+
+/** parag where the first unfolded overlay goes : above the stack, or above the root image
+ * if that extends past SS:SP, so no chunk covers root bytes (e.g. LUTs) */
+static u32 ovl_first_parag(const struct exefile *exf) {
+	u32 stacktop = exf->hdr.initSS + ((exf->hdr.initSP + 15) >> 4);
+	u32 rootend = (exf->ovls[0].img_siz + 15) >> 4;
+
+	return (rootend > stacktop) ? rootend : stacktop;
+}
+
+struct unfold_plan {
+	size_t ovl_parag;	//per-overlay u32 arrays, see unfold_ctx
+	size_t ovl_rcur;
+	size_t ovl_calls;
+	size_t ovl_scratch;
+	size_t scratch;	//counting : sweep bitmaps. Then : segment index, bounds and cover
+	size_t segidx;
+	size_t bounds;
+	size_t cover;	//hits on reloc items and LUTs, see cover_mark()
+	size_t img;
+	size_t relocs;
+	size_t pack;	//pack_relocs() scratch, after relocs[]
+	size_t targets;	//ELF, map : call targets then sites; later dump_elf() scratch
+	size_t elf;	//chunk table, dump_elf() scratch
+	size_t hits;	//stream : calls to patch
+	size_t lut;	//stream : fixed-up LUTs
+	size_t counting;	//bytes needed to count calls
+	size_t total;	//bytes needed for everything
+	u32 imgbytes;	//size of img buffer
+	u32 num_relocs;	//of all chunks, excluding the new ones
+};
+
+/** fill in everything but plan->total */
+static void unfold_plan(const struct exefile *exf, bool sweep, struct unfold_plan *plan) {
+	const struct ovl_desc *oda = exf->ovls;
+	size_t arrsiz = PLAN_ALIGN((exf->num_ovls + 1) * sizeof(u32));
+	size_t countsiz = 0;
+	size_t fixsiz;
+	u32 imgcur_parags;
+	u32 i;
+
+	plan->num_relocs = 0;
+	imgcur_parags = ovl_first_parag(exf);
+	for (i = 0; i <= exf->num_ovls; i++) {
+		plan->num_relocs += oda[i].hdr.numReloc;
+		if (sweep) countsiz += PLAN_ALIGN(SWEEP_SCRATCH(oda[i].img_siz));
+		if (i) imgcur_parags += (oda[i].img_siz + 15) >> 4;
+	}
+	plan->imgbytes = imgcur_parags * 16;
+	if (plan->imgbytes < oda[0].img_siz) plan->imgbytes = oda[0].img_siz;
+
+	plan->ovl_parag = 0;
+	plan->ovl_rcur = plan->ovl_parag + arrsiz;
+	plan->ovl_calls = plan->ovl_rcur + arrsiz;
+	plan->ovl_scratch = plan->ovl_calls + arrsiz;
+	plan->scratch = plan->ovl_scratch + arrsiz;
+	plan->counting = plan->scratch + countsiz;
+
+	plan->segidx = plan->scratch;
+	plan->bounds = plan->segidx + PLAN_ALIGN(segidx_memsiz(plan->num_relocs));
+	plan->cover = plan->bounds;
+	if (sweep) plan->cover += PLAN_ALIGN(SWEEP_SCRATCH(plan->imgbytes));
+	fixsiz = plan->cover + PLAN_ALIGN(COVER_SCRATCH(plan->imgbytes));
+	if (fixsiz < plan->counting) fixsiz = plan->counting;
+
+	plan->img = fixsiz;
+	plan->relocs = plan->img + PLAN_ALIGN(plan->imgbytes);
+	plan->pack = 0;
+	plan->targets = 0;
+	plan->elf = 0;
+	plan->hits = 0;
+	plan->lut = 0;
+	return;
+}
+
+/** grow arena to at least siz bytes. Contents are kept. */
+static bool arena_reserve(struct ovl_arena *ar, const struct ovl_env *env, size_t siz) {
+	u8 *tmp;
+
+	if (siz <= ar->cap) return 1;
+	tmp = ovl_realloc(env, ar->base, siz);
+	if (!tmp) return 0;
+	ar->base = tmp;
+	ar->cap = siz;
+	return 1;
+}
+
+void ovl_arena_free(struct ovl_arena *ar, const struct ovl_env *env) {
+	if (!env) env = &default_env;
+	ovl_free(env, ar->base);
+	ar->base = NULL;
+	ar->cap = 0;
+	return;
+}
+
+/** printf into an outbuf record */
+static void ob_printf(struct outbuf *ob, const char *fmt, ...) {
+	char *p = ob_reserve(ob);
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(p, OUTBUF_MAXREC, fmt, ap);
+	va_end(ap);
+	if (len < 0) return;
+	if (len >= OUTBUF_MAXREC) len = OUTBUF_MAXREC - 1;
+	ob_commit(ob, p + len);
+	return;
+}
+
+/** write the new image with all relocations applied, as if loaded at load_seg:0000,
+ * and a text description of it to "layout" (if not NULL) :
+ *
+ *	load_seg SSSS
+ *	size XXXXXXXX		image size in bytes
+ *	entry SSSS:OOOO		CS:IP
+ *	stack SSSS:OOOO		SS:SP
+ *	chunk NNNN SSSS XXXXXXXX	overlay #, segment, size in bytes. 0000 is the root
+ *	seg SSSS		every distinct segment value found at reloc items, relocated
+ *
+ * Segments are absolute, i.e. load_seg already added. Modifies nex->img.
+ * @return 0 if write failed
+ */
+static bool dump_flat(const struct ovl_sink *out, const struct ovl_sink *layout, struct new_exe *nex, u32 rcur,
+				u32 imgcur_parags, u16 load_seg, const struct exefile *exf, const u32 *ovl_parag,
+				const struct ovl_env *env) {
+	u32 imgbytes = imgcur_parags * 16;
+	u8 segseen[0x10000 / 8] = {0};
+	u32 i, nbad = 0;
+	struct outbuf ob;
+
+	for (i = 0; i < (rcur / 4); i++) {
+		u32 lin = (read_u16_LE(&nex->relocs[(4 * i) + 2]) << 4) + read_u16_LE(&nex->relocs[(4 * i) + 0]);
+		u16 val;
+
+		if ((lin + 2) > imgbytes) {
+			nbad++;
+			continue;
+		}
+		val = read_u16_LE(&nex->img[lin]);
+		BIT_SET(segseen, val);
+		write_u16_LE(&nex->img[lin], val + load_seg);
+	}
+	if (nbad) {
+		ovl_msg(env, "%lu reloc items outside image, skipped\n", (unsigned long) nbad);
+	}
+
+	if (!out->write(out->ctx, nex->img, imgbytes)) {
+		ovl_msg(env, "fwrite err\n");
+		return 0;
+	}
+	if (!layout) return 1;
+
+	if (!ob_open(&ob, layout, FMT_TEXT, env)) {
+		ovl_msg(env, "malloc choke\n");
+		return 0;
+	}
+	ob_printf(&ob, "load_seg %04X\n", (unsigned) load_seg);
+	ob_printf(&ob, "size %08lX\n", (unsigned long) imgbytes);
+	ob_printf(&ob, "entry %04X:%04X\n", (unsigned) (u16) (exf->hdr.initCS + load_seg), (unsigned) exf->hdr.initIP);
+	ob_printf(&ob, "stack %04X:%04X\n", (unsigned) (u16) (exf->hdr.initSS + load_seg), (unsigned) exf->hdr.initSP);
+	ob_printf(&ob, "chunk 0000 %04X %08lX\n", (unsigned) load_seg, (unsigned long) exf->ovls[0].img_siz);
+	for (i = 1; i <= exf->num_ovls; i++) {
+		ob_printf(&ob, "chunk %04X %04X %08lX\n", (unsigned) i, (unsigned) (u16) (ovl_parag[i] + load_seg),
+				(unsigned long) exf->ovls[i].img_siz);
+	}
+	for (i = 0; i < 0x10000; i++) {
+		if (BIT_TEST(segseen, i)) ob_printf(&ob, "seg %04X\n", (unsigned) (u16) (i + load_seg));
+	}
+	if (!ob_close(&ob)) {
+		ovl_msg(env, "fwrite err\n");
+		return 0;
+	}
+	return 1;
+}
+
+/******** ELF output
+ *
+ * ELF32 executable, one PT_LOAD segment and one section per chunk (".root", ".ovl0001" ...)
+ * at the chunk's new place in the image. Addresses are linear, for the image loaded at 0000:0000.
+ * - ".rel.<chunk>" sections hold the reloc items of each chunk, as R_386_SEG16 (the ia16
+ *   binutils segment reloc type).
+ * - ".symtab" has one function symbol per int 0x3F call target, "ovlNNNN_OOOO" (overlay #, offset).
+ * There is no ELF machine type for real-mode x86; EM_386 is used and code must be
+ * disassembled as 16-bit.
+ */
+
+#define ELF_EHSIZE	52
+#define ELF_PHENTSIZE	32
+#define ELF_SHENTSIZE	40
+#define ELF_SYMSIZE	16
+#define ELF_RELSIZE	8
+#define R_386_SEG16	45
+#define SHN_ABS	0xFFF1
+
+/** per-chunk info for the ELF writer and analysis scripts */
+struct elf_chunk {
+	u32 start;	//linear
+	u32 siz;
+	u32 rfirst;	//index in sorted reloc lins
+	u32 nrel;
+};
+
+/** dump_elf() scratch, besides PACK_MEMSIZ() for relocs and room for twice the targets */
+#define ELF_MEMSIZ(num_ovls)	\
+	(((size_t) ((num_ovls) + 1) * sizeof(struct elf_chunk)) + ((1UL << PACK_RADIX_BITS) * sizeof(u32)))
+
+/** symbol name for a call target into chunk c (or none if c > num_ovls)
+ * @return length excluding 0 terminator
+ */
+static int elf_symname(char *dest, size_t len, u32 lin, u32 c, const struct elf_chunk *ch, u32 num_ovls) {
+	if (c > num_ovls) return snprintf(dest, len, "abs_%05lX", (unsigned long) lin);
+	if (!c) return snprintf(dest, len, "root_%05lX", (unsigned long) lin);
+	return snprintf(dest, len, "ovl%04X_%04lX", (unsigned) c, (unsigned long) (lin - ch[c].start));
+}
+
+/** fill ch[0 .. num_ovls] from the new layout. The root extends to the first overlay (stack, BSS) */
+static void elf_chunks(struct elf_chunk *ch, const struct exefile *exf, const u32 *ovl_parag) {
+	u32 c;
+
+	for (c = 0; c <= exf->num_ovls; c++) {
+		ch[c].start = ovl_parag[c] * 16;
+		ch[c].siz = exf->ovls[c].img_siz;
+		ch[c].nrel = 0;
+	}
+	if (exf->num_ovls) ch[0].siz = ch[1].start;
+	return;
+}
+
+/** which chunk contains lin, any order; > num_ovls if none */
+static u32 elf_chunk_find(const struct elf_chunk *ch, u32 num_ovls, u32 lin) {
+	u32 lo = 0, hi = num_ovls + 1u;	//last chunk starting at or below lin is in [lo, hi)
+
+	if (lin < ch[0].start) return num_ovls + 1u;
+	while ((hi - lo) > 1) {
+		u32 mid = (lo + hi) / 2;
+		if (ch[mid].start <= lin) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lin < (ch[lo].start + ch[lo].siz)) return lo;
+	return num_ovls + 1u;
+}
+
+/** which chunk contains lin; > num_ovls if none. Advances from *c (lin must not decrease between calls) */
+static u32 elf_chunk_of(const struct elf_chunk *ch, u32 num_ovls, u32 *c, u32 lin) {
+	while ((*c <= num_ovls) && (lin >= (ch[*c].start + ch[*c].siz))) (*c)++;
+	if ((*c <= num_ovls) && (lin >= ch[*c].start)) return *c;
+	return num_ovls + 1u;
+}
+
+static void ob_bin(struct outbuf *ob, const void *data, u32 len) {
+	ob_flush(ob);
+	if (len && !ob->err && !ob->out->write(ob->out->ctx, data, len)) ob->err = 1;
+	return;
+}
+
+static void ob_pad(struct outbuf *ob, u32 len) {
+	char *p = ob_reserve(ob);
+	memset(p, 0, len);
+	ob_commit(ob, p + len);
+	return;
+}
+
+static void elf_shdr(struct outbuf *ob, u32 name, u32 type, u32 flags, u32 addr, u32 ofs, u32 siz,
+				u32 link, u32 info, u32 align, u32 entsize) {
+	char *p = ob_reserve(ob);
+	p = put_u32(p, name);
+	p = put_u32(p, type);
+	p = put_u32(p, flags);
+	p = put_u32(p, addr);
+	p = put_u32(p, ofs);
+	p = put_u32(p, siz);
+	p = put_u32(p, link);
+	p = put_u32(p, info);
+	p = put_u32(p, align);
+	p = put_u32(p, entsize);
+	ob_commit(ob, p);
+	return;
+}
+
+/** write ELF file.
+ * @param targets : linear addresses of int 0x3F call targets, any order; room for 2 * ntargets
+ * @param mem : ELF_MEMSIZ(num_ovls) bytes, u32-aligned
+ * @param relmem : PACK_MEMSIZ(rcur / 4) bytes, u32-aligned
+ * @return 0 if write or malloc failed
+ */
+static bool dump_elf(const struct ovl_sink *out, const struct new_exe *nex, u32 rcur, u32 imgcur_parags,
+				const struct exefile *exf, const u32 *ovl_parag, u32 *targets, u32 ntargets,
+				void *mem, void *relmem, const struct ovl_env *env) {
+	u32 num_ovls = exf->num_ovls;
+	u32 nch = num_ovls + 1u;
+	u32 imgbytes = imgcur_parags * 16;
+	struct elf_chunk *ch = mem;
+	u32 *lins, *tsorted;
+	u32 nrel = rcur / 4;
+	u32 i, c, nsym, nbad = 0;
+	u32 strtab_siz, shstrtab_siz;
+	u32 img_ofs, rel_ofs, sym_ofs, str_ofs, shstr_ofs, sh_ofs;
+	u32 sh_symtab, sh_strtab, sh_shstrtab, shnum;
+	struct outbuf ob;
+	char name[32];
+	char *p;
+
+	elf_chunks(ch, exf, ovl_parag);
+
+	// relocs, grouped by chunk
+	lins = reloc_lins_sorted(nex->relocs, nrel, relmem);
+	for (i = 0, c = 0; i < nrel; i++) {
+		u32 k = elf_chunk_of(ch, num_ovls, &c, lins[i]);
+		if ((k >= nch) || ((lins[i] + 2) > (ch[k].start + ch[k].siz))) {
+			nbad++;
+			lins[i] = UINT32_MAX;	//skip
+			continue;
+		}
+		if (!ch[k].nrel) ch[k].rfirst = i;
+		ch[k].nrel++;
+	}
+	if (nbad) {
+		ovl_msg(env, "%lu reloc items outside chunks, skipped\n", (unsigned long) nbad);
+	}
+
+	// targets : sorted, unique
+	tsorted = radix_sort_u32(targets, &targets[ntargets], ntargets, (u32 *) &ch[nch]);
+	for (i = 0, nsym = 0; i < ntargets; i++) {
+		if (nsym && (tsorted[i] == tsorted[nsym - 1])) continue;
+		tsorted[nsym++] = tsorted[i];
+	}
+	strtab_siz = 1;
+	for (i = 0, c = 0; i < nsym; i++) {
+		u32 k = elf_chunk_of(ch, num_ovls, &c, tsorted[i]);
+		strtab_siz += elf_symname(name, sizeof(name), tsorted[i], k, ch, num_ovls) + 1;
+	}
+
+	// section name table : "\0.symtab\0.strtab\0.shstrtab\0" then ".rel.ovlNNNN\0" per chunk;
+	// ".ovlNNNN" points into the latter
+	shstrtab_siz = 1 + 8 + 8 + 10 + (nch * 13);
+
+	sh_symtab = 1 + (2 * nch);
+	sh_strtab = sh_symtab + 1;
+	sh_shstrtab = sh_strtab + 1;
+	shnum = sh_shstrtab + 1;
+
+	img_ofs = (ELF_EHSIZE + (nch * ELF_PHENTSIZE) + 15) & ~15UL;
+	rel_ofs = img_ofs + imgbytes;
+	sym_ofs = (rel_ofs + ((nrel - nbad) * ELF_RELSIZE) + 3) & ~3UL;
+	str_ofs = sym_ofs + ((nsym + 1) * ELF_SYMSIZE);
+	shstr_ofs = str_ofs + strtab_siz;
+	sh_ofs = (shstr_ofs + shstrtab_siz + 3) & ~3UL;
+
+	if (!ob_open(&ob, out, FMT_BIN, env)) {
+		ovl_msg(env, "malloc choke\n");
+		return 0;
+	}
+
+	// ELF header
+	p = ob_reserve(&ob);
+	p = FMT_LIT(p, "\x7F" "ELF\x01\x01\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00");
+	p = put_u16(p, 2);	//ET_EXEC
+	p = put_u16(p, 3);	//EM_386
+	p = put_u32(p, 1);
+	p = put_u32(p, (exf->hdr.initCS * 16UL) + exf->hdr.initIP);
+	p = put_u32(p, ELF_EHSIZE);
+	p = put_u32(p, sh_ofs);
+	p = put_u32(p, 0);
+	p = put_u16(p, ELF_EHSIZE);
+	p = put_u16(p, ELF_PHENTSIZE);
+	p = put_u16(p, nch);
+	p = put_u16(p, ELF_SHENTSIZE);
+	p = put_u16(p, shnum);
+	p = put_u16(p, sh_shstrtab);
+	ob_commit(&ob, p);
+
+	// program headers
+	for (c = 0; c < nch; c++) {
+		u32 filesz = ch[c].siz;
+		if ((ch[c].start + filesz) > imgbytes) filesz = imgbytes - ch[c].start;
+		p = ob_reserve(&ob);
+		p = put_u32(p, 1);	//PT_LOAD
+		p = put_u32(p, img_ofs + ch[c].start);
+		p = put_u32(p, ch[c].start);
+		p = put_u32(p, ch[c].start);
+		p = put_u32(p, filesz);
+		p = put_u32(p, ch[c].siz);
+		p = put_u32(p, 7);	//RWX
+		p = put_u32(p, 16);
+		ob_commit(&ob, p);
+	}
+	ob_pad(&ob, img_ofs - (ELF_EHSIZE + (nch * ELF_PHENTSIZE)));
+
+	ob_bin(&ob, nex->img, imgbytes);
+
+	// relocs
+	for (i = 0; i < nrel; i++) {
+		if (lins[i] == UINT32_MAX) continue;
+		p = ob_reserve(&ob);
+		p = put_u32(p, lins[i]);
+		p = put_u32(p, R_386_SEG16);
+		ob_commit(&ob, p);
+	}
+	ob_pad(&ob, sym_ofs - (rel_ofs + ((nrel - nbad) * ELF_RELSIZE)));
+
+	// symbols; [0] is the null symbol
+	ob_pad(&ob, ELF_SYMSIZE);
+	{
+		u32 stroff = 1;
+		for (i = 0, c = 0; i < nsym; i++) {
+			u32 k = elf_chunk_of(ch, num_ovls, &c, tsorted[i]);
+			p = ob_reserve(&ob);
+			p = put_u32(p, stroff);
+			p = put_u32(p, tsorted[i]);
+			p = put_u32(p, 0);
+			*p++ = (1 << 4) | 2;	//STB_GLOBAL, STT_FUNC
+			*p++ = 0;
+			p = put_u16(p, (k < nch) ? (1 + k) : SHN_ABS);
+			ob_commit(&ob, p);
+			stroff += elf_symname(name, sizeof(name), tsorted[i], k, ch, num_ovls) + 1;
+		}
+	}
+
+	// symbol names
+	ob_pad(&ob, 1);
+	for (i = 0, c = 0; i < nsym; i++) {
+		u32 k = elf_chunk_of(ch, num_ovls, &c, tsorted[i]);
+		int len = elf_symname(name, sizeof(name), tsorted[i], k, ch, num_ovls);
+		p = ob_reserve(&ob);
+		memcpy(p, name, len + 1);
+		ob_commit(&ob, p + len + 1);
+	}
+
+	// section names
+	p = ob_reserve(&ob);
+	memcpy(p, "\0.symtab\0.strtab\0.shstrtab", 27);
+	ob_commit(&ob, p + 27);
+	for (c = 0; c < nch; c++) {
+		p = ob_reserve(&ob);
+		if (c) {
+			snprintf(p, 14, ".rel.ovl%04X", (unsigned) (u16) c);	//each overlay takes a parag : c < 0x10000
+		} else {
+			snprintf(p, 14, ".rel.root");
+			memset(p + 9, 0, 4);	//same length as the others
+		}
+		ob_commit(&ob, p + 13);
+	}
+	ob_pad(&ob, sh_ofs - (shstr_ofs + shstrtab_siz));
+
+	// section headers
+	elf_shdr(&ob, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	for (c = 0; c < nch; c++) {
+		u32 siz = ch[c].siz;
+		if ((ch[c].start + siz) > imgbytes) siz = imgbytes - ch[c].start;
+		elf_shdr(&ob, 27 + (c * 13) + 4, 1, 7, ch[c].start, img_ofs + ch[c].start, siz, 0, 0, 16, 0);
+	}
+	{
+		u32 rofs = rel_ofs;
+		for (c = 0; c < nch; c++) {
+			elf_shdr(&ob, 27 + (c * 13), 9, 0x40, 0, rofs, ch[c].nrel * ELF_RELSIZE, sh_symtab, 1 + c, 4, ELF_RELSIZE);
+			rofs += ch[c].nrel * ELF_RELSIZE;
+		}
+	}
+	elf_shdr(&ob, 1, 2, 0, 0, sym_ofs, (nsym + 1) * ELF_SYMSIZE, sh_strtab, 1, 4, ELF_SYMSIZE);
+	elf_shdr(&ob, 9, 3, 0, 0, str_ofs, strtab_siz, 0, 0, 1, 0);
+	elf_shdr(&ob, 17, 3, 0, 0, shstr_ofs, shstrtab_siz, 0, 0, 1, 0);
+
+	if (!ob_close(&ob)) {
+		ovl_msg(env, "fwrite err\n");
+		return 0;
+	}
+	return 1;
+}
+
+/******** analysis scripts
+ *
+ * What ovl_unfold() found, for disassemblers : the overlay ranges of the new image, and each
+ * patched int 0x3F call with its target, named like the ELF symbols. The script makes the
+ * overlay segments, adds the call xrefs and creates the target functions, instead of having
+ * the tool scan for "CD 3F" again (like IDA_scripts/ovl_fixup_intcalls.idc does).
+ * Addresses are linear, for the image loaded at map_seg:0000. The IDC and Python scripts keep
+ * that base in one variable, to edit if the file was loaded elsewhere.
+ */
+
+static const char *const map_head_idc[] = {
+	"// overlay segments and int 0x3F calls found by overlazy. IDA 7 or later : File / Script file\n",
+	"#include <idc.idc>\n\n",
+	"static ovlseg(start, end, name)\n{\n",
+	"\tadd_segm_ex(start, end, start >> 4, 0, saRelPara, scPub, ADDSEG_NOSREG);\n",
+	"\tset_segm_name(start, name);\n",
+	"\tset_segm_class(start, \"CODE\");\n}\n\n",
+	"static ovlcall(site, target, name)\n{\n",
+	"\tcreate_insn(site);\n",
+	"\tcreate_insn(target);\n",
+	"\tadd_cref(site, target, fl_CF);\n",
+	"\tadd_func(target, BADADDR);\n",
+	"\tset_name(target, name, SN_NOCHECK | SN_NOWARN);\n}\n\n",
+	"static main()\n{\n",
+	"\tauto b;\n",
+	NULL
+};
+
+static const char *const map_head_ghidra[] = {
+	"# overlay segments and int 0x3F calls found by overlazy. Run from Ghidra's Script Manager\n",
+	"#@category overlazy\n",
+	"from ghidra.program.model.symbol import RefType, SourceType\n\n",
+	NULL
+};
+
+static const char *const map_tail_ghidra[] = {
+	"]\n\n",
+	"mem = currentProgram.getMemory()\n",
+	"refs = currentProgram.getReferenceManager()\n\n",
+	"def addr(lin):\n\treturn toAddr((BASE << 4) + lin)\n\n",
+	"def split_at(a):\n",
+	"\tb = mem.getBlock(a)\n",
+	"\tif b is not None and b.getStart() != a:\n\t\tmem.split(b, a)\n\n",
+	"for start, siz, name in SEGS:\n",
+	"\tsplit_at(addr(start))\n",
+	"\tsplit_at(addr(start + siz))\n",
+	"\tb = mem.getBlock(addr(start))\n",
+	"\tif b is not None:\n\t\tb.setName(name)\n\t\tb.setExecute(True)\n\n",
+	"for site, target, name in CALLS:\n",
+	"\ts = addr(site)\n",
+	"\tt = addr(target)\n",
+	"\tdisassemble(s)\n",
+	"\tdisassemble(t)\n",
+	"\trefs.addMemoryReference(s, t, RefType.UNCONDITIONAL_CALL, SourceType.ANALYSIS, 0)\n",
+	"\tf = getFunctionAt(t)\n",
+	"\tif f is None:\n\t\tcreateFunction(t, name)\n",
+	"\telif f.getSymbol().getSource() == SourceType.DEFAULT:\n\t\tf.setName(name, SourceType.ANALYSIS)\n\n",
+	"print(\"%d overlays, %d calls\" % (len(SEGS), len(CALLS)))\n",
+	NULL
+};
+
+static void ob_lines(struct outbuf *ob, const char *const *lines) {
+	for (; *lines; lines++) {
+		char *p = ob_reserve(ob);
+		size_t len = strlen(*lines);
+		memcpy(p, *lines, len);
+		ob_commit(ob, p + len);
+	}
+	return;
+}
+
+/** write analysis script.
+ * @param ch : chunk table, see elf_chunks()
+ * @param sites, targets : linear addresses of patched calls and their targets
+ * @return 0 if write or malloc failed
+ */
+static bool dump_map(const struct ovl_sink *out, enum map_fmt fmt, u16 map_seg, const struct exefile *exf,
+				const struct elf_chunk *ch, const u32 *sites, const u32 *targets, u32 ncalls,
+				const struct ovl_env *env) {
+	u32 num_ovls = exf->num_ovls;
+	u32 base = map_seg * 16UL;
+	u32 i;
+	struct outbuf ob;
+	char name[32];
+
+	if (!ob_open(&ob, out, FMT_TEXT, env)) {
+		ovl_msg(env, "malloc choke\n");
+		return 0;
+	}
+
+	switch (fmt) {
+	case MAP_IDC:
+		ob_lines(&ob, map_head_idc);
+		ob_printf(&ob, "\tb = 0x%lX;\t// load segment * 16\n", (unsigned long) base);
+		for (i = 1; i <= num_ovls; i++) {
+			ob_printf(&ob, "\tovlseg(b + 0x%05lX, b + 0x%05lX, \"ovl%04X\");\n", (unsigned long) ch[i].start,
+					(unsigned long) (ch[i].start + ch[i].siz), (unsigned) i);
+		}
+		for (i = 0; i < ncalls; i++) {
+			elf_symname(name, sizeof(name), targets[i], elf_chunk_find(ch, num_ovls, targets[i]), ch, num_ovls);
+			ob_printf(&ob, "\tovlcall(b + 0x%05lX, b + 0x%05lX, \"%s\");\n", (unsigned long) sites[i],
+					(unsigned long) targets[i], name);
+		}
+		ob_printf(&ob, "\tmsg(\"%u overlays, %lu calls\\n\");\n}\n", (unsigned) num_ovls, (unsigned long) ncalls);
+		break;
+	case MAP_GHIDRA:
+		ob_lines(&ob, map_head_ghidra);
+		ob_printf(&ob, "BASE = 0x%04X\t# load segment\n\n", (unsigned) map_seg);
+		ob_printf(&ob, "SEGS = [\n");
+		for (i = 1; i <= num_ovls; i++) {
+			ob_printf(&ob, "\t(0x%05lX, 0x%05lX, \"ovl%04X\"),\n", (unsigned long) ch[i].start,
+					(unsigned long) ch[i].siz, (unsigned) i);
+		}
+		ob_printf(&ob, "]\n\nCALLS = [\n");
+		for (i = 0; i < ncalls; i++) {
+			elf_symname(name, sizeof(name), targets[i], elf_chunk_find(ch, num_ovls, targets[i]), ch, num_ovls);
+			ob_printf(&ob, "\t(0x%05lX, 0x%05lX, \"%s\"),\n", (unsigned long) sites[i],
+					(unsigned long) targets[i], name);
+		}
+		ob_lines(&ob, map_tail_ghidra);
+		break;
+	case MAP_R2:
+	default:
+		ob_printf(&ob, "# overlay segments and int 0x3F calls found by overlazy, for the image at %04X:0000.\n",
+				(unsigned) map_seg);
+		ob_printf(&ob, "# r2 -i <this file> <unfolded file>, or \". <this file>\" from the r2 prompt\n");
+		ob_printf(&ob, "fs segments\n");
+		for (i = 1; i <= num_ovls; i++) {
+			ob_printf(&ob, "f ovl%04X 0x%lX @ 0x%05lX\n", (unsigned) i, (unsigned long) ch[i].siz,
+					(unsigned long) (base + ch[i].start));
+		}
+		ob_printf(&ob, "fs functions\n");
+		for (i = 0; i < ncalls; i++) {
+			unsigned long s = base + sites[i];
+			unsigned long t = base + targets[i];
+			elf_symname(name, sizeof(name), targets[i], elf_chunk_find(ch, num_ovls, targets[i]), ch, num_ovls);
+			ob_printf(&ob, "axC 0x%05lX @ 0x%05lX\naf @ 0x%05lX\nafn %s @ 0x%05lX\n", t, s, t, name, t);
+		}
+		ob_printf(&ob, "fs *\n");
+		break;
+	}
+
+	if (!ob_close(&ob)) {
+		ovl_msg(env, "fwrite err\n");
+		return 0;
+	}
+	return 1;
+}
+
+/** shared state for the per-overlay work of ovl_unfold() */
+struct unfold_ctx {
+	const struct exefile *exf;
+	struct new_exe *nex;
+	u32 *ovl_parag;	//where each overlay goes in the new image, in parags
+	u32 *ovl_rcur;	//where each overlay's relocs go in nex->relocs[], in bytes
+	u32 *ovl_calls;	//# of int 0x3F hits in each overlay's original image
+	u32 *ovl_scratch;	//where each overlay's sweep bitmap goes in scratch[], when counting calls
+	u8 *scratch;
+	u32 seglut_pos;	//(offset within image)
+	u32 olut_pos;	//(offset within image)
+	u16 lut_entries;
+	u16 ovl_base;
+	bool sweep;
+	u32 ovl_shift;	//exf->ovls[i] is overlay # i + ovl_shift; only a shard starts past 1
+	const u8 *foreign;	//ovl IDs of overlays outside the shard, NULL if not sharded
+};
+
+/** point everything at its place in the arena. Needed again whenever the arena moves */
+static void unfold_carve(const struct unfold_plan *plan, u8 *base, struct unfold_ctx *uc, u8 **bounds, u8 **cover) {
+	uc->ovl_parag = (u32 *) &base[plan->ovl_parag];
+	uc->ovl_rcur = (u32 *) &base[plan->ovl_rcur];
+	uc->ovl_calls = (u32 *) &base[plan->ovl_calls];
+	uc->ovl_scratch = (u32 *) &base[plan->ovl_scratch];
+	uc->scratch = &base[plan->scratch];
+	uc->nex->img = &base[plan->img];
+	uc->nex->relocs = &base[plan->relocs];
+	*bounds = uc->sweep ? &base[plan->bounds] : NULL;
+	*cover = &base[plan->cover];
+	return;
+}
+
+/** build the cover bitmap of an image of siz bytes : reloc items, both LUTs */
+static void unfold_cover(const struct unfold_ctx *uc, u8 *cover, u32 siz, const u8 *relocs, u32 nrelocs) {
+	memset(cover, 0, COVER_SCRATCH(siz));
+	cover_relocs(cover, siz, 0, relocs, nrelocs, 0, INT3F_PATLEN);
+	cover_mark(cover, siz, uc->seglut_pos, 2UL * uc->lut_entries, INT3F_PATLEN);
+	cover_mark(cover, siz, uc->olut_pos, uc->lut_entries, INT3F_PATLEN);
+	return;
+}
+
+static void unfold_count_one(void *vctx, u32 i) {
+	struct unfold_ctx *uc = vctx;
+	const struct ovl_desc *oda = &uc->exf->ovls[i];
+	const u8 *img = &uc->exf->buf[oda->img_ofs];
+
+	if (uc->sweep) {
+		uc->ovl_calls[i] = sweep_ovlcalls(uc->exf->env, img, oda->img_siz, code_siz(uc->exf, i), 0, NULL, NULL,
+									&uc->scratch[uc->ovl_scratch[i]], NULL, NULL);
+	} else {
+		uc->ovl_calls[i] = dump_ovlcalls(img, oda->img_siz, NULL, NULL, NULL);
+	}
+	return;
+}
+
+/** map one overlay. Every overlay touches different parts of nex, so these can run in parallel */
+static void unfold_map_one(void *vctx, u32 job) {
+	struct unfold_ctx *uc = vctx;
+	u32 i = job + 1;	//skip root
+	const struct ovl_desc *oda = &uc->exf->ovls[i];
+	const u8 *buf = uc->exf->buf;
+	u8 *dest = &uc->nex->img[uc->ovl_parag[i] * 16];
+	u16 chunk_segdelta;	//distance (in parags) from new location to original mapping location OVL_BASE
+
+	//copy ovl image and clear padding to the next parag (the arena isn't zeroed),
+	//and append fixed up relocs to the main table
+	memcpy(dest, &buf[oda->img_ofs], oda->img_siz);
+	memset(&dest[oda->img_siz], 0, ((oda->img_siz + 15) & ~15UL) - oda->img_siz);
+	fixup_relocs(&uc->nex->relocs[uc->ovl_rcur[i]], uc->ovl_parag[i], uc->ovl_base, &buf[oda->relocs_ofs], oda->hdr.numReloc);
+
+	//adjust overlay segment LUT
+	chunk_segdelta = uc->ovl_parag[i] - uc->ovl_base;
+	fixup_seglut(uc->nex->img, uc->seglut_pos, uc->olut_pos, uc->lut_entries, i + uc->ovl_shift, chunk_segdelta);
+	return;
+}
+
+/** passes writes on to another sink, counting bytes */
+struct count_sink {
+	const struct ovl_sink *out;
+	u64 *count;
+};
+
+static bool count_write(void *ctx, const void *data, size_t len) {
+	struct count_sink *cs = ctx;
+
+	*cs->count += len;
+	return cs->out->write(cs->out->ctx, data, len);
+}
+
+static bool count_pwrite(void *ctx, const void *data, size_t len, u64 ofs) {
+	struct count_sink *cs = ctx;
+
+	*cs->count += len;
+	return cs->out->pwrite(cs->out->ctx, data, len, ofs);
+}
+
+/******** streaming unfold
+ *
+ * Same .exe as the in-memory path, without ever holding the whole new image :
+ * 1) relocs of all chunks and the fixed-up LUTs are built first; they are small.
+ * 2) each chunk is rebuilt in a window buffer, and int 0x3F calls are picked exactly like
+ *    fixup_int3f() does; their reloc entries are added. The final reloc count, hence the
+ *    header size, is then known.
+ * 3) header and relocs are written, then each chunk is rebuilt again, patched and written
+ *    at its place. With a positional sink, the zero gap after the root (stack, BSS) is left
+ *    as a hole.
+ * A patched call can spill up to 4 bytes past its chunk; those are carried to the next one.
+ */
+
+struct stream_ctx {
+	const struct exefile *exf;
+	const u32 *ovl_parag;
+	u32 imgbytes;
+	u32 root_end;	//root chunk is [0, root_end); overlays start past it, see ovl_first_parag()
+	u8 *lut;	//image bytes [lut_lo, lut_lo + lut_siz) : both LUTs, fixed up
+	u32 lut_lo;
+	u32 lut_siz;
+	u8 *win;	//current chunk, plus INT3F_PATLEN bytes of what follows
+	u8 *wbounds;	//instruction boundaries in win[], for --sweep
+	u8 *cover;	//calls on reloc items or LUTs, whole image
+	u32 *hits;	//image positions of the calls to patch, ascending
+	u8 carry[INT3F_PATLEN];	//bytes following the last chunk written, as patched
+	u32 carry_pos;
+};
+
+/** chunk c is [*start, *end) in the new image, including padding */
+static void stream_chunk(const struct stream_ctx *sc, u32 c, u32 *start, u32 *end) {
+	if (!c) {
+		*start = 0;
+		*end = sc->root_end;
+		return;
+	}
+	*start = sc->ovl_parag[c] * 16;
+	*end = *start + ((sc->exf->ovls[c].img_siz + 15) & ~15UL);
+	return;
+}
+
+/** copy the part of src[] = image [src_pos, src_pos + src_len) that falls in dst[] = image [pos, pos + len) */
+static void stream_overlay(u8 *dst, u32 pos, u32 len, const u8 *src, u32 src_pos, u32 src_len) {
+	u32 lo = (src_pos > pos) ? src_pos : pos;
+	u32 hi = ((src_pos + src_len) < (pos + len)) ? (src_pos + src_len) : (pos + len);
+
+	if (lo < hi) memcpy(&dst[lo - pos], &src[lo - src_pos], hi - lo);
+	return;
+}
+
+/** fill win[] with image [pos, pos + len), starting at chunk c : chunk images, zeros between them, LUTs.
+ * Calls aren't patched, except what was carried over.
+ */
+static void stream_fill(const struct stream_ctx *sc, u32 c, u32 pos, u32 len) {
+	const struct exefile *exf = sc->exf;
+
+	memset(sc->win, 0, len);
+	for (; c <= exf->num_ovls; c++) {
+		u32 start = c ? (sc->ovl_parag[c] * 16) : 0;
+		u32 siz = c ? exf->ovls[c].img_siz : sc->root_end;
+		if (start >= (pos + len)) break;
+		stream_overlay(sc->win, pos, len, &exf->buf[exf->ovls[c].img_ofs], start, siz);
+	}
+	stream_overlay(sc->win, pos, len, sc->lut, sc->lut_lo, sc->lut_siz);
+	stream_overlay(sc->win, pos, len, sc->carry, sc->carry_pos, INT3F_PATLEN);
+	return;
+}
+
+/** pick the calls fixup_int3f() would patch, chunk by chunk, and add their reloc entries.
+ * @return # of calls, listed in sc->hits[]
+ */
+static u32 stream_pick(struct stream_ctx *sc, const struct unfold_ctx *uc, u8 *relocs, u32 rcur, u32 rmax,
+				const struct segidx *sx, enum segpick pick, struct fixup_tally *ft) {
+	const struct exefile *exf = sc->exf;
+	u32 lim = int3f_scanlim(sc->imgbytes);
+	u32 nextpos = 0;
+	u32 n = 0;
+	u32 batch[SCAN_BATCH];
+	u32 c;
+
+	for (c = 0; c <= exf->num_ovls; c++) {
+		u32 start, end, wlim, nb;
+		u32 cursor = 0;
+
+		stream_chunk(sc, c, &start, &end);
+		stream_fill(sc, c, start, end - start + INT3F_PATLEN);
+		if (uc->sweep) {
+			u32 code_end = code_siz(exf, c);
+			if (code_end > (end - start)) code_end = end - start;
+			memset(sc->wbounds, 0, SWEEP_SCRATCH(end - start + INT3F_PATLEN));
+			sweep_code(sc->win, 0, code_end, sc->wbounds);
+		}
+
+		wlim = (end < lim) ? end : lim;
+		if (wlim <= start) continue;
+		wlim -= start;
+		while ((nb = scan_int3f(sc->win, wlim, &cursor, batch))) {
+			u32 h;
+			for (h = 0; h < nb; h++) {
+				u32 cur = start + batch[h];
+
+				if (cur < nextpos) continue;
+				if (uc->sweep && !BIT_TEST(sc->wbounds, batch[h])) continue;
+				if (BIT_TEST(sc->cover, cur)) {
+					ft->covered++;
+					continue;
+				}
+				if (uc->foreign && BIT_TEST(uc->foreign, sc->win[batch[h] + 2])) {
+					ft->foreign++;
+					nextpos = cur + INT3F_PATLEN;
+					continue;
+				}
+				if (sc->win[batch[h] + 2] >= uc->lut_entries) {
+					ovl_msg(exf->env, "ovl ID > lut_entries @ %X !?\n", cur);
+					return n;
+				}
+				if (n >= rmax) {
+					ovl_msg(exf->env, "reloc table full @ %X !?\n", cur);
+					return n;
+				}
+				sc->hits[n] = cur;
+				int3f_reloc(cur, relocs, rcur + (n * 4), sx, pick, ft);
+				n++;
+				nextpos = cur + INT3F_PATLEN;
+			}
+		}
+	}
+	return n;
+}
+
+/** write image [pos, pos + len) at file offset hdrbytes + pos. Without pwrite, the output must be at that offset already */
+static bool stream_put(const struct ovl_sink *out, u32 hdrbytes, const u8 *data, u32 pos, u32 len) {
+	if (!len) return 1;
+	if (out->pwrite) return out->pwrite(out->ctx, data, len, (u64) hdrbytes + pos);
+	return out->write(out->ctx, data, len);
+}
+
+/** rebuild each chunk, patch the picked calls and write it out after the header.
+ * @return 0 if write failed
+ */
+static bool stream_write(struct stream_ctx *sc, const struct ovl_sink *out, u32 hdrbytes, u32 seglut_pos, u32 nhits) {
+	const u8 zeros[256] = {0};
+	const u8 *seglut = &sc->lut[seglut_pos - sc->lut_lo];
+	u32 wpos = 0;	//image written up to here
+	u32 h = 0;
+	u32 c;
+
+	for (c = 0; c <= sc->exf->num_ovls; c++) {
+		u32 start, end;
+
+		stream_chunk(sc, c, &start, &end);
+		if (start < wpos) start = wpos;	//root image under the first overlay
+		if (end <= start) continue;
+
+		// gap since the previous chunk : calls patched at its end may have spilled into it
+		if (start > wpos) {
+			u32 spill = ((start - wpos) < INT3F_PATLEN) ? (start - wpos) : INT3F_PATLEN;
+			u32 i;
+
+			for (i = 0; (i < spill) && !sc->carry[i]; i++);
+			if (i < spill) {
+				if (!stream_put(out, hdrbytes, sc->carry, wpos, spill)) return 0;
+				wpos += spill;
+			}
+			while (!out->pwrite && (wpos < start)) {
+				u32 len = ((start - wpos) < sizeof(zeros)) ? (start - wpos) : sizeof(zeros);
+				if (!out->write(out->ctx, zeros, len)) return 0;
+				wpos += len;
+			}
+		}
+
+		stream_fill(sc, c, start, end - start + INT3F_PATLEN);
+		for (; (h < nhits) && (sc->hits[h] < end); h++) {
+			int3f_rewrite(seglut, sc->win, sc->hits[h] - start);
+			//patched bytes within the LUTs : later calls see them, like fixup_int3f() patching in place
+			stream_overlay(sc->lut, sc->lut_lo, sc->lut_siz, sc->win, start, end - start + INT3F_PATLEN);
+		}
+		if (!stream_put(out, hdrbytes, sc->win, start, end - start)) return 0;
+		wpos = end;
+		memcpy(sc->carry, &sc->win[end - start], INT3F_PATLEN);
+		sc->carry_pos = end;
+	}
+	return 1;
+}
+
+/** ovl_unfold() for uo->stream, once the layout is known.
+ * @param t : start of current phase, for stats
+ */
+static enum ovl_err unfold_stream(struct unfold_ctx *uc, const struct unfold_opts *uo, struct unfold_plan *plan,
+						struct ovl_arena *ar, u32 num_ovlcalls, u32 imgcur_parags, const struct ovl_sink *out,
+						u32 *fixups_done, double *t) {
+	const struct exefile *exf = uc->exf;
+	const struct ovl_env *env = exf->env;
+	const struct ovl_desc *oda = exf->ovls;
+	struct ovl_stats *st = uo->stats;
+	struct stream_ctx sc = {0};
+	struct new_exe nex;
+	struct segidx sx;
+	struct fixup_tally ft = {0};
+	u32 lut_hi, maxchunk = 0;
+	u32 rcur = plan->num_relocs * 4;
+	u32 num_fixups, hdrbytes;
+	u32 c;
+
+	*fixups_done = 0;
+	sc.exf = exf;
+	sc.imgbytes = imgcur_parags * 16;
+	sc.root_end = oda[0].img_siz;
+	sc.lut_lo = (uc->seglut_pos < uc->olut_pos) ? uc->seglut_pos : uc->olut_pos;
+	lut_hi = uc->seglut_pos + (2UL * uc->lut_entries);
+	if ((uc->olut_pos + uc->lut_entries) > lut_hi) lut_hi = uc->olut_pos + uc->lut_entries;
+	sc.lut_siz = lut_hi - sc.lut_lo;
+	sc.carry_pos = UINT32_MAX - INT3F_PATLEN;	//nothing carried yet
+
+	// plan : no image, one chunk at a time
+	for (c = 0; c <= exf->num_ovls; c++) {
+		u32 start, end;
+		sc.ovl_parag = uc->ovl_parag;
+		stream_chunk(&sc, c, &start, &end);
+		if ((end - start) > maxchunk) maxchunk = end - start;
+	}
+	plan->segidx = plan->scratch;
+	plan->relocs = plan->segidx + PLAN_ALIGN(segidx_memsiz(plan->num_relocs));
+	plan->pack = plan->relocs + PLAN_ALIGN((plan->num_relocs + num_ovlcalls) * 4UL);
+	plan->hits = plan->pack;
+	if (uo->packrelocs) plan->hits += PLAN_ALIGN(PACK_MEMSIZ(plan->num_relocs + num_ovlcalls));
+	plan->lut = plan->hits + PLAN_ALIGN(num_ovlcalls * sizeof(u32));
+	plan->img = plan->lut + PLAN_ALIGN(sc.lut_siz);
+	plan->bounds = plan->img + PLAN_ALIGN(maxchunk + INT3F_PATLEN);
+	plan->cover = plan->bounds;
+	if (uc->sweep) plan->cover += PLAN_ALIGN(SWEEP_SCRATCH(maxchunk + INT3F_PATLEN));
+	plan->total = plan->cover + COVER_SCRATCH(sc.imgbytes);
+	if (plan->total < plan->counting) plan->total = plan->counting;
+	if (!arena_reserve(ar, env, plan->total)) {
+		ovl_msg(env, "malloc choke\n");
+		return OVL_ENOMEM;
+	}
+	uc->ovl_parag = (u32 *) &ar->base[plan->ovl_parag];
+	uc->ovl_rcur = (u32 *) &ar->base[plan->ovl_rcur];
+	sc.ovl_parag = uc->ovl_parag;
+	nex.relocs = &ar->base[plan->relocs];
+	sc.hits = (u32 *) &ar->base[plan->hits];
+	sc.lut = &ar->base[plan->lut];
+	sc.win = &ar->base[plan->img];
+	sc.wbounds = &ar->base[plan->bounds];
+	sc.cover = &ar->base[plan->cover];
+	stat_lap(st, PHASE_LAYOUT, t);
+
+	// relocs of all chunks, LUTs
+	memcpy(nex.relocs, &exf->buf[oda[0].relocs_ofs], oda[0].hdr.numReloc * 4);
+	memcpy(sc.lut, &exf->buf[oda[0].img_ofs + sc.lut_lo], sc.lut_siz);
+	for (c = 1; c <= exf->num_ovls; c++) {
+		fixup_relocs(&nex.relocs[uc->ovl_rcur[c]], uc->ovl_parag[c], uc->ovl_base, &exf->buf[oda[c].relocs_ofs], oda[c].hdr.numReloc);
+		fixup_seglut(sc.lut, uc->seglut_pos - sc.lut_lo, uc->olut_pos - sc.lut_lo, uc->lut_entries, c + uc->ovl_shift,
+					uc->ovl_parag[c] - uc->ovl_base);
+	}
+	stat_lap(st, PHASE_MAP, t);
+
+	segidx_build(&sx, nex.relocs, rcur / 4, &ar->base[plan->segidx]);
+	unfold_cover(uc, sc.cover, sc.imgbytes, nex.relocs, rcur / 4);
+	stat_lap(st, PHASE_INDEX, t);
+
+	num_fixups = stream_pick(&sc, uc, nex.relocs, rcur, num_ovlcalls, &sx, uo->segpick, &ft);
+	rcur += num_fixups * 4;
+	ovl_msg(env, "Fixed 0x%X int3f calls.\n", num_fixups);
+	if (ft.covered) ovl_msg(env, "Skipped 0x%X int3f hits on reloc items or LUTs.\n", ft.covered);
+	if (ft.foreign) ovl_msg(env, "Left 0x%X int3f calls into other shards.\n", ft.foreign);
+	if ((num_fixups + ft.covered + ft.foreign) != num_ovlcalls) {
+		ovl_msg(env, "Mismatch in # of int3F fixups. Possible spurious hits or fixups\n");
+	}
+	stat_lap(st, PHASE_FIXUP, t);
+	if (st) {
+		st->scanned += int3f_scanlim(sc.imgbytes);
+		st->fixups += num_fixups;
+		st->covered += ft.covered;
+		st->foreign += ft.foreign;
+		st->seg_reused += ft.reused;
+		st->seg_steps += ft.steps;
+	}
+
+	if (uo->packrelocs) {
+		u32 before = rcur / 4;
+		u32 after = pack_relocs(nex.relocs, before, &ar->base[plan->pack]);
+		u32 hdr_before = (sizeof(struct header) + (before * 4) + 15) & ~15UL;
+		u32 hdr_after = (sizeof(struct header) + (after * 4) + 15) & ~15UL;
+
+		ovl_msg(env, "Packed relocs : %lu -> %lu entries, header %lu -> %lu bytes (saved %lu)\n",
+				(unsigned long) before, (unsigned long) after,
+				(unsigned long) hdr_before, (unsigned long) hdr_after, (unsigned long) (hdr_before - hdr_after));
+		rcur = after * 4;
+		stat_lap(st, PHASE_PACK, t);
+	}
+
+	if (!newheader_fits(env, rcur)) return OVL_ESPACE;
+	memcpy(&nex.hdr, &exf->hdr, sizeof(struct header));
+	newheader_fill(&nex, rcur, imgcur_parags);
+	hdrbytes = newheader_write(out, &nex, rcur);
+	if (!hdrbytes || !stream_write(&sc, out, hdrbytes, uc->seglut_pos, num_fixups)) {
+		ovl_msg(env, "fwrite err\n");
+		return OVL_EWRITE;
+	}
+	*fixups_done = num_fixups;
+	stat_lap(st, PHASE_WRITE, t);
+	if (st) st->relocs_out += rcur / 4;
+	return OVL_OK;
+}
+
+/******** sharded unfold
+ *
+ * Unfolded overlays go above the root's stack, and must all fit below 1 MB; the new relocs
+ * must fit in one MZ header. Bigger programs are split in runs of overlays ("shards"), each
+ * unfolded with the whole root into its own .exe. Calls into the overlays of other shards are
+ * left as int 0x3F, and the LUT entries of those overlays keep their OVL_BASE segment.
+ */
+
+/** parags left above the root's stack for overlays */
+static u32 unfold_room(const struct exefile *exf) {
+	u32 rootsegs = nextseg((u32) exf->hdr.initSS, (u32) exf->hdr.initSP);
+
+	if (ovl_first_parag(exf) >= rootsegs) rootsegs = ovl_first_parag(exf) + 1;	//root image past SS:SP
+	return (rootsegs < 0xFFFF) ? (0xFFFF - rootsegs) : 0;
+}
+
+/** relocs that chunk i brings to an unfolded exe, counting one per int 0x3F hit */
+static u32 shard_relocs(const struct exefile *exf, u32 i) {
+	const struct ovl_desc *oda = &exf->ovls[i];
+
+	return oda->hdr.numReloc + dump_ovlcalls(&exf->buf[oda->img_ofs], oda->img_siz, NULL, NULL, NULL);
+}
+
+u32 ovl_shard_plan(const struct exefile *exf, u32 *first) {
+	u32 room = unfold_room(exf);
+	u32 root_relocs;
+	u32 parags = 0, relocs = 0;
+	u32 nshards = 0;
+	u32 i;
+
+	if (!exf->num_ovls) return 0;
+	root_relocs = shard_relocs(exf, 0);
+	for (i = 1; i <= exf->num_ovls; i++) {
+		u32 p = ((exf->ovls[i].img_siz + 15) >> 4) + 1;	//with the padding ovl_unfold() allows for
+		u32 r = shard_relocs(exf, i);
+
+		if ((p >= room) || ((root_relocs + r) > 0xFFFF)) {
+			ovl_msg(exf->env, "OVL_%lX doesn't fit in a shard by itself\n", (unsigned long) i);
+			return 0;
+		}
+		if (!nshards || ((parags + p) >= room) || ((root_relocs + relocs + r) > 0xFFFF)) {
+			first[nshards++] = i;
+			parags = 0;
+			relocs = 0;
+		}
+		parags += p;
+		relocs += r;
+	}
+	first[nshards] = exf->num_ovls + 1;
+	return nshards;
+}
+
+/** exf with the root and overlays [first, last] only, sharing its buffer.
+ *
+ * @param olut_pos : file offset
+ * @param foreign : bitmap of ovl IDs whose OVLLUT entry is an overlay outside the range
+ * @return view->ovls, to free once done; NULL if malloc failed
+ */
+static struct ovl_desc *shard_view(const struct exefile *exf, u32 first, u32 last, u32 olut_pos, u16 lut_entries,
+					struct exefile *view, u8 *foreign) {
+	struct ovl_desc *ovls = ovl_malloc(exf->env, (last - first + 2) * sizeof(struct ovl_desc));
+	u32 id;
+
+	if (!ovls) return NULL;
+	ovls[0] = exf->ovls[0];
+	memcpy(&ovls[1], &exf->ovls[first], (last - first + 1) * sizeof(struct ovl_desc));
+	*view = *exf;
+	view->ovls = ovls;
+	view->num_ovls = last - first + 1;
+	for (id = 0; id < lut_entries; id++) {
+		u8 ovl = exf->buf[olut_pos + id];
+		if (ovl && ((ovl < first) || (ovl > last))) BIT_SET(foreign, id);
+	}
+	return ovls;
+}
+
+/** The resulting .exe will probably not run properly anymore. */
+enum ovl_err ovl_unfold(struct exefile *exf, const struct lut_params *lp, const struct unfold_opts *uo,
+					const struct ovl_sink *out, u32 *fixups_done) {
+	const struct ovl_env *env = exf->env;
+	u32 seglut_pos = lp->seglut_pos;
+	u32 olut_pos = lp->olut_pos;
+	u16 lut_entries = lp->lut_entries;
+	u16 ovl_base = lp->ovl_base;
+	u32 num_ovls;	//excluding root
+	u32 num_ovlcalls = 0;
+	u32 num_fixups;
+	u32 imgsiz = 0;
+	u32 scratchcur = 0;
+	u32 i;
+	const struct ovl_desc *oda;	//array of descriptors
+	struct new_exe nex;
+	struct segidx sx;
+	struct unfold_ctx uc = {0};
+	struct unfold_plan plan;
+	struct ovl_arena tmp_arena = {0};
+	struct ovl_arena *ar = uo->arena ? uo->arena : &tmp_arena;
+	u8 *bounds;	//instruction boundaries in nex.img
+	u8 *cover;	//calls on reloc items or LUTs in nex.img
+	unsigned nthreads = uo->threads ? uo->threads : 1;
+	u32 imgcur_parags;
+	u32 rcur;	//cursors into new img and reloc tables
+	bool want_calls = (uo->ufmt == UNFOLD_ELF) || (uo->map && (uo->mapfmt != MAP_NONE));
+	struct ovl_stats *st = uo->stats;
+	struct count_sink cs = {out, NULL};
+	struct ovl_sink counted_out = {count_write, &cs, out->pwrite ? count_pwrite : NULL};
+	struct fixup_tally ft = {0};
+	struct exefile shard;	//exf cut down to the overlays of uo->ovl_first .. ovl_last
+	struct ovl_desc *shard_ovls = NULL;
+	u8 foreign[OVL_LUT_MAXENTRIES / 8] = {0};
+	double t = 0;	//start of current phase
+	enum ovl_err rv = OVL_ENOMEM;
+
+	if ((seglut_pos > exf->siz) || (olut_pos > exf->siz)) {
+		ovl_msg(env, "LUT position past end of file\n");
+		return OVL_EARGS;
+	}
+	if ((seglut_pos < exf->ovls[0].img_ofs) || (olut_pos < exf->ovls[0].img_ofs) ||
+		((seglut_pos + (2UL * lut_entries)) > (exf->ovls[0].img_ofs + exf->ovls[0].img_siz)) ||
+		((olut_pos + lut_entries) > (exf->ovls[0].img_ofs + exf->ovls[0].img_siz))) {
+		ovl_msg(env, "LUTs not within root image\n");
+		return OVL_EARGS;
+	}
+	ovl_msg(env, "seglut @ %lX, ovllut @ %lX, entries=%X ovlbase %X:0000\n",
+			(unsigned long) seglut_pos, (unsigned long) olut_pos,
+			(unsigned) lut_entries, (unsigned) ovl_base);
+
+	num_ovls = exf->num_ovls;
+	if (!num_ovls) {
+		ovl_msg(env, "no ovl\n");
+		return OVL_ENOOVL;
+	}
+	if (uo->ovl_first) {
+		if ((uo->ovl_last < uo->ovl_first) || (uo->ovl_last > num_ovls) ||
+			(uo->ufmt != UNFOLD_MZ) || (uo->map && (uo->mapfmt != MAP_NONE))) {
+			ovl_msg(env, "bad overlay range (only for .exe output)\n");
+			return OVL_EARGS;
+		}
+		shard_ovls = shard_view(exf, uo->ovl_first, uo->ovl_last, olut_pos, lut_entries, &shard, foreign);
+		if (!shard_ovls) {
+			ovl_msg(env, "malloc choke\n");
+			return OVL_ENOMEM;
+		}
+		ovl_msg(env, "shard : overlays %lX - %lX\n", (unsigned long) uo->ovl_first, (unsigned long) uo->ovl_last);
+		exf = &shard;
+		num_ovls = exf->num_ovls;
+		uc.ovl_shift = uo->ovl_first - 1;
+		uc.foreign = foreign;
+	}
+	oda = exf->ovls;
+
+	if (st) {
+		t = now_sec();
+		cs.count = &st->written;
+		out = &counted_out;
+	}
+
+	uc.exf = exf;
+	uc.nex = &nex;
+	uc.lut_entries = lut_entries;
+	uc.ovl_base = ovl_base;
+	uc.sweep = uo->sweep;
+
+	unfold_plan(exf, uo->sweep, &plan);
+	if (!arena_reserve(ar, env, plan.counting)) {
+		ovl_msg(env, "malloc choke\n");
+		goto fexit;
+	}
+	unfold_carve(&plan, ar->base, &uc, &bounds, &cover);
+
+	// gather ovl stats
+	for (i = 0; i <= num_ovls; i++) {
+		uc.ovl_scratch[i] = scratchcur;
+		if (uo->sweep) scratchcur += PLAN_ALIGN(SWEEP_SCRATCH(oda[i].img_siz));
+	}
+	run_parallel(env, nthreads, num_ovls + 1, unfold_count_one, &uc);
+	for (i=0; i <= num_ovls; i++) {
+		imgsiz += oda[i].img_siz;
+		num_ovlcalls += uc.ovl_calls[i];
+	}
+	stat_lap(st, PHASE_COUNT, &t);
+	if (st) {
+		st->scanned += imgsiz;
+		st->hits += num_ovlcalls;
+		st->relocs_in += plan.num_relocs;
+	}
+
+	// check if it can be done by mapping OVLs *above* SS:SP.
+	// Assume we need 1 parag padding for each ovl
+	u32 required_segs = ((imgsiz - oda[0].img_siz) >> 4) + num_ovls;
+	u32 availseg = unfold_room(exf);
+	if (required_segs >= availseg) {
+		ovl_msg(env, "not enough addressing space to unroll that shit (see --shard)\n");
+		rv = OVL_ESPACE;
+		goto fexit;
+	}
+
+	// layout : every overlay's position only depends on the sizes of those before it.
+	rcur = oda[0].hdr.numReloc * 4;
+	imgcur_parags = ovl_first_parag(exf);	//bring cursor after stack area
+	uc.ovl_parag[0] = 0;
+	uc.ovl_rcur[0] = 0;
+	for (i = 1; i <= num_ovls; i++) {
+		uc.ovl_parag[i] = imgcur_parags;
+		uc.ovl_rcur[i] = rcur;
+
+		ovl_msg(env, "mapping OVL_%lX @ %lX0 within image\n", (unsigned long) (i + uc.ovl_shift), (unsigned long) imgcur_parags);
+
+		//advance cursors
+		rcur += (oda[i].hdr.numReloc * 4);
+		imgcur_parags += ((oda[i].img_siz + 15) >> 4);	//round to next parag
+		if (imgcur_parags >= 0xFFFF) {
+			ovl_msg(env, "busted address space !\n");
+			rv = OVL_ESPACE;
+			goto fexit;
+		}
+	}
+
+	//convert lut positions to "offset within image"
+	seglut_pos -= (exf->hdr.numParaHeader * 16);
+	olut_pos -= (exf->hdr.numParaHeader * 16);
+	uc.seglut_pos = seglut_pos;
+	uc.olut_pos = olut_pos;
+
+	if (uo->stream && (uo->ufmt == UNFOLD_MZ) && !want_calls) {
+		rv = unfold_stream(&uc, uo, &plan, ar, num_ovlcalls, imgcur_parags, out, &num_fixups, &t);
+		if (fixups_done) *fixups_done = num_fixups;
+		goto fexit;
+	}
+	if (uo->stream) {
+		ovl_msg(env, "--stream only applies to .exe output, unfolding in memory\n");
+	}
+
+	// rest of the plan : room for all relocs. Arena may move.
+	plan.total = plan.relocs + ((plan.num_relocs + num_ovlcalls) * 4UL);
+	plan.pack = PLAN_ALIGN(plan.total);
+	if (uo->packrelocs || (uo->ufmt == UNFOLD_ELF)) plan.total = plan.pack + PACK_MEMSIZ(plan.num_relocs + num_ovlcalls);
+	if (want_calls) {
+		plan.targets = PLAN_ALIGN(plan.total);
+		plan.elf = plan.targets + PLAN_ALIGN(2 * (size_t) num_ovlcalls * sizeof(u32));
+		plan.total = plan.elf + ELF_MEMSIZ(num_ovls);
+	}
+	if (!arena_reserve(ar, env, plan.total)) {
+		ovl_msg(env, "malloc choke\n");
+		goto fexit;
+	}
+	unfold_carve(&plan, ar->base, &uc, &bounds, &cover);
+	stat_lap(st, PHASE_LAYOUT, &t);
+
+	// write in root OVL_000 image, including its relocs. Clear the gap up to the first overlay
+	memcpy(nex.relocs, &exf->buf[oda[0].relocs_ofs], oda[0].hdr.numReloc * 4);
+	memcpy(nex.img, &exf->buf[oda[0].img_ofs], oda[0].img_siz);
+	if ((uc.ovl_parag[1] * 16) > oda[0].img_siz) {
+		memset(&nex.img[oda[0].img_siz], 0, (uc.ovl_parag[1] * 16) - oda[0].img_siz);
+	}
+
+	// masterloop (tm)
+	run_parallel(env, nthreads, num_ovls, unfold_map_one, &uc);
+	stat_lap(st, PHASE_MAP, &t);
+
+	//fixup INT 3F calls
+	segidx_build(&sx, nex.relocs, rcur / 4, &ar->base[plan.segidx]);
+	if (bounds) {
+		memset(bounds, 0, SWEEP_SCRATCH(imgcur_parags * 16));
+		sweep_code(nex.img, 0, code_siz(exf, 0), bounds);
+		for (i = 1; i <= num_ovls; i++) {
+			sweep_code(nex.img, uc.ovl_parag[i] * 16, (uc.ovl_parag[i] * 16) + oda[i].img_siz, bounds);
+		}
+	}
+	unfold_cover(&uc, cover, imgcur_parags * 16, nex.relocs, rcur / 4);
+	stat_lap(st, PHASE_INDEX, &t);
+	if (nthreads > 1) {
+		num_fixups = fixup_int3f_mt(&nex.img[seglut_pos], &nex.img[olut_pos], lut_entries, nex.img, imgcur_parags * 16, nex.relocs, rcur,
+								num_ovlcalls, &sx, uo->segpick, bounds, cover, uc.foreign, env, &ft, nthreads);
+	} else {
+		num_fixups = fixup_int3f(&nex.img[seglut_pos], &nex.img[olut_pos], lut_entries, nex.img, imgcur_parags * 16, nex.relocs, rcur,
+								num_ovlcalls, &sx, uo->segpick, bounds, cover, uc.foreign, env, &ft);
+	}
+	if (want_calls) {
+		//call sites and targets, from the patched "call far" : reloc item is at the segment word.
+		//dump_elf() sorts targets in place, so it has to come after dump_map()
+		u32 *targets = (u32 *) &ar->base[plan.targets];
+		u32 *sites = &targets[num_ovlcalls];
+		u32 f;
+		for (f = 0; f < num_fixups; f++) {
+			const u8 *re = &nex.relocs[rcur + (4 * f)];
+			u32 item = (read_u16_LE(&re[2]) << 4) + read_u16_LE(&re[0]);
+			targets[f] = (read_u16_LE(&nex.img[item]) << 4) + read_u16_LE(&nex.img[item - 2]);
+			sites[f] = item - 3;
+		}
+	}
+	rcur += (num_fixups * 4);
+	ovl_msg(env, "Fixed 0x%X int3f calls.\n", num_fixups);
+	if (ft.covered) ovl_msg(env, "Skipped 0x%X int3f hits on reloc items or LUTs.\n", ft.covered);
+	if (ft.foreign) ovl_msg(env, "Left 0x%X int3f calls into other shards.\n", ft.foreign);
+
+	if ((num_fixups + ft.covered + ft.foreign) != num_ovlcalls) {
+		ovl_msg(env, "Mismatch in # of int3F fixups. Possible spurious hits or fixups\n");
+	}
+	stat_lap(st, PHASE_FIXUP, &t);
+	if (st) {
+		st->scanned += int3f_scanlim(imgcur_parags * 16);
+		st->fixups += num_fixups;
+		st->covered += ft.covered;
+		st->foreign += ft.foreign;
+		st->seg_reused += ft.reused;
+		st->seg_steps += ft.steps;
+	}
+
+	if (uo->map && (uo->mapfmt != MAP_NONE)) {
+		u32 *targets = (u32 *) &ar->base[plan.targets];
+		struct elf_chunk *ch = (struct elf_chunk *) &ar->base[plan.elf];
+
+		elf_chunks(ch, exf, uc.ovl_parag);
+		if (!dump_map(uo->map, uo->mapfmt, uo->map_seg, exf, ch, &targets[num_ovlcalls], targets, num_fixups, env)) {
+			rv = OVL_EWRITE;
+			goto fexit;
+		}
+		stat_lap(st, PHASE_WRITE, &t);
+	}
+
+	if (uo->packrelocs) {
+		u32 before = rcur / 4;
+		u32 after = pack_relocs(nex.relocs, before, &ar->base[plan.pack]);
+		u32 hdr_before = (sizeof(struct header) + (before * 4) + 15) & ~15UL;
+		u32 hdr_after = (sizeof(struct header) + (after * 4) + 15) & ~15UL;
+
+		ovl_msg(env, "Packed relocs : %lu -> %lu entries, header %lu -> %lu bytes (saved %lu)\n",
+				(unsigned long) before, (unsigned long) after,
+				(unsigned long) hdr_before, (unsigned long) hdr_after, (unsigned long) (hdr_before - hdr_after));
+		rcur = after * 4;
+		stat_lap(st, PHASE_PACK, &t);
+	}
+
+	switch (uo->ufmt) {
+	case UNFOLD_FLAT:
+		rv = dump_flat(out, uo->layout, &nex, rcur, imgcur_parags, uo->load_seg, exf, uc.ovl_parag, env) ? OVL_OK : OVL_EWRITE;
+		break;
+	case UNFOLD_ELF:
+		rv = dump_elf(out, &nex, rcur, imgcur_parags, exf, uc.ovl_parag, (u32 *) &ar->base[plan.targets], num_fixups,
+					&ar->base[plan.elf], &ar->base[plan.pack], env) ? OVL_OK : OVL_EWRITE;
+		break;
+	case UNFOLD_MZ:
+	default:
+		if (!newheader_fits(env, rcur)) {
+			rv = OVL_ESPACE;
+			goto fexit;
+		}
+		//regen new exe header. mostly same as orig
+		memcpy(&nex.hdr, &exf->hdr, sizeof(struct header));
+		rv = dump_newheader(out, &nex, rcur, imgcur_parags, env) ? OVL_OK : OVL_EWRITE;
+		break;
+	}
+	if (fixups_done) *fixups_done = num_fixups;
+	stat_lap(st, PHASE_WRITE, &t);
+	if (st) st->relocs_out += rcur / 4;
+
+fexit:
+	ovl_arena_free(&tmp_arena, env);
+	ovl_free(env, shard_ovls);
+	return rv;
+}
+
+/******** overlay cache simulator
+ *
+ * The MSC overlay manager has a single overlay area : calling into another overlay
+ * reads it from the .exe over the current one, and returning into an overlay that was
+ * swapped out reads that one back. Overlay needs, in order, are replayed against that
+ * policy and against LRU caches of a few slots, counting loads and bytes read (img_siz).
+ *
+ * Without a recorded trace, the needs come from the static call graph : every call
+ * site that fixup_int3f() would patch is taken once, in file order, as
+ *	caller, callee, caller (return)
+ * which only gives a rough idea of which overlays call each other across the area.
+ */
+
+#define SIM_MAXSLOTS	8
+static const unsigned sim_slots[] = {1, 2, 4, SIM_MAXSLOTS};
+#define SIM_NPOLICIES	(sizeof(sim_slots) / sizeof(sim_slots[0]))
+#define SIM_TOPOVLS	16	//overlays listed in the report
+
+struct sim_result {
+	u32 needs;	//overlay needs, root excluded
+	u32 loads;
+	u64 bytes;
+};
+
+/** per-overlay counters */
+struct sim_ovl {
+	u32 loads;
+	u32 evicts;	//loads that pushed another overlay out
+	u32 evicted;
+	u16 ovl;
+};
+
+/** replay seq[0 .. n - 1] (overlay #s, 0 = root) through an LRU cache of "slots" overlays.
+ * @param siz : bytes read to load each overlay
+ * @param so : per-overlay counters, can be NULL
+ */
+static void sim_run(const u32 *siz, const u16 *seq, u32 n, unsigned slots,
+				struct sim_result *sr, struct sim_ovl *so) {
+	u16 res[SIM_MAXSLOTS];	//resident overlays
+	u32 used[SIM_MAXSLOTS];	//last need
+	unsigned nres = 0;
+	u32 i;
+
+	memset(sr, 0, sizeof(*sr));
+	for (i = 0; i < n; i++) {
+		u16 ovl = seq[i];
+		unsigned s, lru;
+
+		if (!ovl) continue;
+		sr->needs++;
+		for (s = 0; s < nres; s++) {
+			if (res[s] == ovl) break;
+		}
+		if (s == nres) {
+			sr->loads++;
+			sr->bytes += siz[ovl];
+			if (so) so[ovl].loads++;
+			if (nres < slots) {
+				nres++;
+			} else {
+				for (lru = 0, s = 1; s < nres; s++) {
+					if (used[s] < used[lru]) lru = s;
+				}
+				s = lru;
+				if (so) {
+					so[ovl].evicts++;
+					so[res[s]].evicted++;
+				}
+			}
+			res[s] = ovl;
+		}
+		used[s] = i;
+	}
+	return;
+}
+
+/** int 0x3F calls of chunk c that fixup_int3f() would patch, as (caller << 8) | callee overlay # edges.
+ * @param bounds : --sweep instruction bounds scratch, NULL to take every hit
+ * @param bad : incremented for calls with an ID past the LUT
+ * @return # of edges stored
+ */
+static u32 sim_edges(const struct exefile *exf, u32 c, const u8 *olut, u16 lut_entries, u8 *bounds,
+				u32 *edges, u32 *bad) {
+	const struct ovl_desc *oda = &exf->ovls[c];
+	const u8 *img = &exf->buf[oda->img_ofs];
+	u32 hits[SCAN_BATCH];
+	u32 nhits;
+	u32 nedges = 0;
+	u32 scanpos = 0;
+	u32 nextpos = 0;
+	u32 lim = int3f_scanlim(oda->img_siz);
+
+	if (bounds) {
+		memset(bounds, 0, SWEEP_SCRATCH(oda->img_siz));
+		sweep_code(img, 0, code_siz(exf, c), bounds);
+	}
+	while ((nhits = scan_int3f(img, lim, &scanpos, hits))) {
+		u32 h;
+		for (h = 0; h < nhits; h++) {
+			u32 cur = hits[h];
+
+			if (cur < nextpos) continue;
+			if (bounds && !BIT_TEST(bounds, cur)) continue;
+			nextpos = cur + INT3F_PATLEN;
+			if ((img[cur + 2] >= lut_entries) || (olut[img[cur + 2]] > exf->num_ovls)) {
+				(*bad)++;
+				continue;
+			}
+			edges[nedges++] = ((u32) c << 8) | olut[img[cur + 2]];
+		}
+	}
+	return nedges;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	u32 x = *(const u32 *) a, y = *(const u32 *) b;
+	return (x > y) - (x < y);
+}
+
+/** edge and its # of call sites; sorted by decreasing count */
+struct sim_edge {
+	u32 edge;
+	u32 calls;
+};
+
+static int cmp_sim_edge(const void *a, const void *b) {
+	const struct sim_edge *x = a, *y = b;
+	if (x->calls != y->calls) return (x->calls < y->calls) - (x->calls > y->calls);
+	return cmp_u32(&x->edge, &y->edge);
+}
+
+static int cmp_sim_ovl(const void *a, const void *b) {
+	const struct sim_ovl *x = a, *y = b;
+	if (x->loads != y->loads) return (x->loads < y->loads) - (x->loads > y->loads);
+	return (int) x->ovl - (int) y->ovl;
+}
+
+/** print one line per policy */
+static void sim_report(struct outbuf *ob, const u32 *siz, const char *what, const u16 *seq, u32 n) {
+	unsigned p;
+
+	ob_printf(ob, "%s\tslots\tneeds\tloads\tbytes read\thit %%\n", what);
+	for (p = 0; p < SIM_NPOLICIES; p++) {
+		struct sim_result sr;
+		sim_run(siz, seq, n, sim_slots[p], &sr, NULL);
+		ob_printf(ob, "%s\t%u\t%lu\t%lu\t%llu\t%.1f\n", (p == 0) ? "single" : "LRU", sim_slots[p],
+				(unsigned long) sr.needs, (unsigned long) sr.loads, (unsigned long long) sr.bytes,
+				sr.needs ? (100.0 * (sr.needs - sr.loads) / sr.needs) : 100.0);
+	}
+	return;
+}
+
+/** what the simulation replays */
+struct sim_input {
+	u32 *edges;	//static call graph, see sim_edges()
+	u32 nedges;
+	u16 *seq;	//static needs
+	u32 nseq;
+	u16 *trace;	//recorded needs, mapped to overlay #s
+	u32 ntrace;
+	u32 *siz;	//img_siz of each overlay
+};
+
+static void sim_release(const struct ovl_env *env, struct sim_input *si) {
+	ovl_free(env, si->edges);
+	ovl_free(env, si->seq);
+	ovl_free(env, si->trace);
+	ovl_free(env, si->siz);
+	return;
+}
+
+/** check LUT params, build the static call graph and needs, map the trace.
+ * si must be released with sim_release(), even on failure.
+ */
+static enum ovl_err sim_prepare(const struct exefile *exf, const struct lut_params *lp, const struct sim_opts *so,
+					struct sim_input *si) {
+	const struct ovl_env *env = exf->env;
+	const u8 *olut = &exf->buf[lp->olut_pos];
+	u32 max_edges = 0;
+	u32 max_img = 0;
+	u32 bad = 0, bad_trace = 0;
+	u8 *bounds = NULL;
+	u32 i;
+	u32 c;
+
+	memset(si, 0, sizeof(*si));
+	if ((lp->olut_pos < exf->ovls[0].img_ofs) ||
+		((lp->olut_pos + lp->lut_entries) > (exf->ovls[0].img_ofs + exf->ovls[0].img_siz))) {
+		ovl_msg(env, "LUTs not within root image\n");
+		return OVL_EARGS;
+	}
+	if (!exf->num_ovls) {
+		ovl_msg(env, "no ovl\n");
+		return OVL_ENOOVL;
+	}
+
+	//raw hit counts bound the edges
+	for (c = 0; c <= exf->num_ovls; c++) {
+		const struct ovl_desc *oda = &exf->ovls[c];
+		max_edges += dump_ovlcalls(&exf->buf[oda->img_ofs], oda->img_siz, NULL, NULL, NULL);
+		if (oda->img_siz > max_img) max_img = oda->img_siz;
+	}
+	si->edges = ovl_malloc(env, (max_edges ? max_edges : 1) * sizeof(u32));
+	si->seq = ovl_malloc(env, (3 * (size_t) max_edges + 1) * sizeof(u16));
+	si->siz = ovl_malloc(env, (exf->num_ovls + 1) * sizeof(u32));
+	if (so->trace_len) si->trace = ovl_malloc(env, so->trace_len * sizeof(u16));
+	if (so->sweep) bounds = ovl_malloc(env, SWEEP_SCRATCH(max_img));
+	if (!si->edges || !si->seq || !si->siz || (so->trace_len && !si->trace) || (so->sweep && !bounds)) {
+		ovl_msg(env, "malloc choke\n");
+		ovl_free(env, bounds);
+		return OVL_ENOMEM;
+	}
+
+	//static needs : caller, callee, caller
+	for (c = 0; c <= exf->num_ovls; c++) {
+		u32 n = sim_edges(exf, c, olut, lp->lut_entries, bounds, &si->edges[si->nedges], &bad);
+		for (i = si->nedges; i < (si->nedges + n); i++) {
+			si->seq[si->nseq++] = c;
+			si->seq[si->nseq++] = si->edges[i] & 0xFF;
+			si->seq[si->nseq++] = c;
+		}
+		si->nedges += n;
+		si->siz[c] = exf->ovls[c].img_siz;
+	}
+	ovl_free(env, bounds);
+	if (bad) ovl_msg(env, "%lu calls with ovl ID past LUT, ignored\n", (unsigned long) bad);
+
+	for (i = 0; i < so->trace_len; i++) {
+		u16 ovl = so->trace[i].val;
+		if (so->trace[i].is_id) {
+			ovl = (ovl < lp->lut_entries) ? olut[ovl] : 0xFFFF;
+		}
+		if (ovl > exf->num_ovls) {
+			bad_trace++;
+			continue;
+		}
+		si->trace[si->ntrace++] = ovl;
+	}
+	if (bad_trace) ovl_msg(env, "%lu trace events with unknown overlay, ignored\n", (unsigned long) bad_trace);
+	return OVL_OK;
+}
+
+/** sort edges[0 .. n - 1] and count duplicates into runs[], by decreasing count.
+ * @return # of runs
+ */
+static u32 sim_count(u32 *edges, u32 n, struct sim_edge *runs) {
+	u32 nruns = 0;
+	u32 i;
+
+	qsort(edges, n, sizeof(u32), cmp_u32);
+	for (i = 0; i < n; i++) {
+		if (nruns && (runs[nruns - 1].edge == edges[i])) {
+			runs[nruns - 1].calls++;
+			continue;
+		}
+		runs[nruns].edge = edges[i];
+		runs[nruns].calls = 1;
+		nruns++;
+	}
+	qsort(runs, nruns, sizeof(struct sim_edge), cmp_sim_edge);
+	return nruns;
+}
+
+enum ovl_err ovl_simulate(const struct exefile *exf, const struct lut_params *lp, const struct sim_opts *so,
+					const struct ovl_sink *out, u32 *ncalls) {
+	const struct ovl_env *env = exf->env;
+	struct sim_input si;
+	struct sim_edge *runs = NULL;
+	struct sim_ovl *ovls = NULL;
+	struct sim_result sr;
+	struct outbuf ob;
+	u32 nruns;
+	u32 i;
+	enum ovl_err rv;
+
+	if (!ob_open(&ob, out, FMT_TEXT, env)) {
+		ovl_msg(env, "malloc choke\n");
+		return OVL_ENOMEM;
+	}
+	rv = sim_prepare(exf, lp, so, &si);
+	if (rv != OVL_OK) goto fexit;
+
+	rv = OVL_ENOMEM;
+	runs = ovl_malloc(env, (si.nedges ? si.nedges : 1) * sizeof(struct sim_edge));
+	ovls = ovl_calloc(env, exf->num_ovls + 1, sizeof(struct sim_ovl));
+	if (!runs || !ovls) {
+		ovl_msg(env, "malloc choke\n");
+		goto fexit;
+	}
+
+	//call sites per edge
+	nruns = sim_count(si.edges, si.nedges, runs);
+	ob_printf(&ob, "static call graph : %lu calls, %lu caller -> callee edges\n",
+			(unsigned long) si.nedges, (unsigned long) nruns);
+	ob_printf(&ob, "caller\tcallee\tcalls\n");
+	for (i = 0; i < nruns; i++) {
+		ob_printf(&ob, "%04X\t%04X\t%lu\n", (unsigned) (runs[i].edge >> 8), (unsigned) (runs[i].edge & 0xFF),
+				(unsigned long) runs[i].calls);
+	}
+
+	ob_printf(&ob, "\n");
+	sim_report(&ob, si.siz, "static", si.seq, si.nseq);
+	if (so->trace_len) {
+		ob_printf(&ob, "\n");
+		sim_report(&ob, si.siz, "trace", si.trace, si.ntrace);
+	}
+
+	//who swaps most under the real policy
+	for (i = 0; i <= exf->num_ovls; i++) ovls[i].ovl = i;
+	if (so->trace_len) {
+		sim_run(si.siz, si.trace, si.ntrace, 1, &sr, ovls);
+	} else {
+		sim_run(si.siz, si.seq, si.nseq, 1, &sr, ovls);
+	}
+	qsort(&ovls[1], exf->num_ovls, sizeof(struct sim_ovl), cmp_sim_ovl);
+	ob_printf(&ob, "\nmost loaded overlays, single slot, %s\n", so->trace_len ? "trace" : "static");
+	ob_printf(&ob, "ovl\timg siz\tloads\tbytes read\tevicts\tevicted\n");
+	for (i = 1; (i <= exf->num_ovls) && (i <= SIM_TOPOVLS) && ovls[i].loads; i++) {
+		const struct sim_ovl *o = &ovls[i];
+		ob_printf(&ob, "%04X\t%lX\t%lu\t%llu\t%lu\t%lu\n", (unsigned) o->ovl,
+				(unsigned long) si.siz[o->ovl], (unsigned long) o->loads,
+				(unsigned long long) o->loads * si.siz[o->ovl],
+				(unsigned long) o->evicts, (unsigned long) o->evicted);
+	}
+	if (ncalls) *ncalls = si.nedges;
+	rv = OVL_OK;
+
+fexit:
+	if (!ob_close(&ob) && (rv == OVL_OK)) rv = OVL_EWRITE;
+	sim_release(env, &si);
+	ovl_free(env, runs);
+	ovl_free(env, ovls);
+	return rv;
+}
+
+/******** refold : regroup overlays to cut swaps
+ *
+ * Overlays that keep pushing each other out of the overlay area are merged into one chunk,
+ * as long as it still fits the area (as big as the biggest original overlay) and the
+ * single-area cost of the profile goes down : a bigger overlay costs more every time it is
+ * loaded, so only pairs that swap each other more than they swap with others are worth it.
+ * Pairs are tried by decreasing # of swaps between them. Each original
+ * overlay becomes a member of a new one, at a paragraph-aligned delta from its start :
+ * - member reloc items move by delta, and so do relocated words that point into the overlay area
+ * - SEGLUT entries for the member move by delta, its OVLLUT entries get the new overlay #
+ * - int 0x3F calls between members stay as they are : the overlay manager finds the
+ *   overlay already loaded.
+ * New overlays are numbered by their first member. Unmerged overlays and the root are copied as is,
+ * except for the overlay # in the header and the LUTs.
+ */
+
+#define REFOLD_LOADCOST	2048	//bytes' worth of reading a load costs on top of the image : seek, header, relocs
+
+/** drop root needs and repeats from seq[], which a single overlay area gets for free.
+ * @return new length
+ */
+static u32 refold_squeeze(u16 *seq, u32 n) {
+	u32 len = 0;
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		if (!seq[i]) continue;
+		if (len && (seq[len - 1] == seq[i])) continue;
+		seq[len++] = seq[i];
+	}
+	return len;
+}
+
+/** consecutive needs of a squeezed seq[], as (lo << 16) | hi pairs. These are the swaps a
+ * single overlay area can't avoid unless both are in the same overlay.
+ */
+static void refold_pairs(const u16 *seq, u32 n, u32 *pairs) {
+	u32 i;
+
+	for (i = 1; i < n; i++) {
+		u16 a = seq[i - 1], b = seq[i];
+		pairs[i - 1] = (a < b) ? (((u32) a << 16) | b) : (((u32) b << 16) | a);
+	}
+	return;
+}
+
+/** single-area cost of a squeezed seq[] when overlays are grouped as grp[], with group
+ * "from" merged into group "into" (same : no merge).
+ * @param gpar : group sizes in parags, by group
+ */
+static u64 refold_cost(const u16 *seq, u32 n, const u32 *grp, const u32 *gpar, u32 into, u32 from) {
+	u64 cost = 0;
+	u32 prev = 0;
+	u32 i;
+
+	for (i = 0; i < n; i++) {
+		u32 g = grp[seq[i]];
+		if (g == from) g = into;
+		if (g == prev) continue;
+		cost += REFOLD_LOADCOST + (16 * (u64) gpar[g]);
+		if ((g == into) && (from != into)) cost += 16 * (u64) gpar[from];
+		prev = g;
+	}
+	return cost;
+}
+
+/** write one merged overlay : header, relocs, then members at their deltas.
+ * @param img, relocs : scratch, big enough for the merged image and all member relocs
+ */
+static bool refold_write_merged(const struct exefile *exf, const struct ovl_sink *out, u16 ovl_base, u32 area_parags,
+					u32 first, const u32 *next, const u32 *delta, u16 newno, u8 *img, u8 *relocs) {
+	const u8 *buf = exf->buf;
+	static const u8 zeros[512] = {0};
+	struct header hdr = exf->ovls[first].hdr;
+	u32 imgsiz = 0;
+	u32 rcur = 0;
+	u32 hdrsiz, datasiz, padlen;
+	u32 m;
+
+	for (m = first; m; m = next[m]) {
+		const struct ovl_desc *oda = &exf->ovls[m];
+		u32 d = delta[m];
+		u8 *dest = &img[d * 16];
+		u16 r;
+
+		memset(&img[imgsiz], 0, (d * 16) - imgsiz);	//padding after previous member
+		memcpy(dest, &buf[oda->img_ofs], oda->img_siz);
+		imgsiz = (d * 16) + oda->img_siz;
+		for (r = 0; r < oda->hdr.numReloc; r++) {
+			u16 roffs = read_u16_LE(&buf[oda->relocs_ofs + (4 * r) + 0]);
+			u16 rseg = read_u16_LE(&buf[oda->relocs_ofs + (4 * r) + 2]);
+			u32 pos = ((u32) (u16) (rseg - ovl_base) * 16) + roffs;
+
+			if (d && ((pos + 1) < oda->img_siz)) {
+				u16 val = read_u16_LE(&dest[pos]);
+				if ((val >= ovl_base) && (val < (ovl_base + area_parags))) write_u16_LE(&dest[pos], val + d);
+			}
+			write_u16_LE(&relocs[rcur], roffs);
+			write_u16_LE(&relocs[rcur + 2], rseg + d);
+			rcur += 4;
+		}
+	}
+
+	//headers are page-aligned, like LINK does
+	hdrsiz = (sizeof(struct header) + rcur + 511) & ~511UL;
+	datasiz = hdrsiz + imgsiz;
+	hdr.relocTabOffset = sizeof(struct header);
+	hdr.numReloc = rcur / 4;
+	hdr.numParaHeader = hdrsiz / 16;
+	hdr.lastPageSize = datasiz & 511;
+	hdr.numPages = (datasiz + 511) / 512;
+	hdr.overlayNum = newno;
+
+	if (!out->write(out->ctx, &hdr, sizeof(struct header))) return 0;
+	if (rcur && !out->write(out->ctx, relocs, rcur)) return 0;
+	padlen = hdrsiz - sizeof(struct header) - rcur;
+	if (padlen && !out->write(out->ctx, zeros, padlen)) return 0;
+	if (!out->write(out->ctx, img, imgsiz)) return 0;
+	padlen = (512 - (datasiz & 511)) & 511;
+	if (padlen && !out->write(out->ctx, zeros, padlen)) return 0;
+	return 1;
+}
+
+/** copy an unmerged overlay with a new overlay #, padded to whole pages */
+static bool refold_write_single(const struct exefile *exf, const struct ovl_sink *out, u32 ovl, u16 newno) {
+	static const u8 zeros[512] = {0};
+	const struct ovl_desc *oda = &exf->ovls[ovl];
+	const u8 *chunk = &exf->buf[oda->chunk_ofs];
+	u32 pagesiz = 512 * (u32) oda->hdr.numPages;
+	u8 num[2];
+
+	write_u16_LE(num, newno);
+	if (!out->write(out->ctx, chunk, 0x1A)) return 0;
+	if (!out->write(out->ctx, num, 2)) return 0;
+	if (!out->write(out->ctx, &chunk[0x1C], oda->chunk_siz - 0x1C)) return 0;
+	if ((pagesiz > oda->chunk_siz) && !out->write(out->ctx, zeros, pagesiz - oda->chunk_siz)) return 0;
+	return 1;
+}
+
+enum ovl_err ovl_refold(const struct exefile *exf, const struct lut_params *lp, const struct sim_opts *so,
+				const struct ovl_sink *out, u32 *num_new) {
+	const struct ovl_env *env = exf->env;
+	const struct ovl_desc *oda = exf->ovls;
+	u32 num_ovls = exf->num_ovls;
+	struct sim_input si;
+	struct sim_result before, after;
+	struct sim_edge *runs = NULL;
+	u32 *pairs = NULL;
+	u32 *grp = NULL, *gpar, *grel, *newno, *delta, *next, *first, *last, *newsiz;
+	u16 *mapped = NULL;
+	u8 *root = NULL, *img = NULL, *relocs = NULL;
+	const u16 *needs;
+	u32 nneeds, nsq, nruns;
+	u64 cost;
+	u32 area_parags = 0;
+	u32 total_relocs = 0;
+	u32 ngroups = 0;
+	u32 rootsiz;
+	u32 i;
+	enum ovl_err rv;
+
+	rv = sim_prepare(exf, lp, so, &si);
+	if (rv != OVL_OK) goto fexit;
+	if ((lp->seglut_pos < oda[0].img_ofs) ||
+		((lp->seglut_pos + (2UL * lp->lut_entries)) > (oda[0].img_ofs + oda[0].img_siz))) {
+		ovl_msg(env, "LUTs not within root image\n");
+		rv = OVL_EARGS;
+		goto fexit;
+	}
+	for (i = 1; i <= num_ovls; i++) {
+		u32 parags = (oda[i].img_siz + 15) / 16;
+		if (parags > area_parags) area_parags = parags;
+		total_relocs += oda[i].hdr.numReloc;
+	}
+	needs = so->trace_len ? si.trace : si.seq;
+	nneeds = so->trace_len ? si.ntrace : si.nseq;
+	rootsiz = oda[1].chunk_ofs;
+
+	rv = OVL_ENOMEM;
+	pairs = ovl_malloc(env, (nneeds ? nneeds : 1) * sizeof(u32));
+	runs = ovl_malloc(env, (nneeds ? nneeds : 1) * sizeof(struct sim_edge));
+	grp = ovl_malloc(env, 9 * (num_ovls + 1) * sizeof(u32));
+	mapped = ovl_malloc(env, (nneeds ? nneeds : 1) * sizeof(u16));
+	root = ovl_malloc(env, rootsiz);
+	img = ovl_malloc(env, (area_parags + 1) * 16);
+	relocs = ovl_malloc(env, (total_relocs ? total_relocs : 1) * 4UL);
+	if (!pairs || !runs || !grp || !mapped || !root || !img || !relocs) {
+		ovl_msg(env, "malloc choke\n");
+		goto fexit;
+	}
+	gpar = &grp[num_ovls + 1];	//group size in parags, at the group's representative
+	grel = &gpar[num_ovls + 1];	//# of relocs, same
+	newno = &grel[num_ovls + 1];
+	delta = &newno[num_ovls + 1];	//in parags, from the start of the new overlay
+	next = &delta[num_ovls + 1];	//next member of the same new overlay, 0 = last
+	first = &next[num_ovls + 1];	//by new overlay #
+	last = &first[num_ovls + 1];
+	newsiz = &last[num_ovls + 1];	//bytes, by new overlay #
+
+	//groups are named by their first member
+	for (i = 0; i <= num_ovls; i++) {
+		grp[i] = i;
+		gpar[i] = (oda[i].img_siz + 15) / 16;
+		grel[i] = oda[i].hdr.numReloc;
+	}
+	memcpy(mapped, needs, nneeds * sizeof(u16));
+	nsq = refold_squeeze(mapped, nneeds);
+	refold_pairs(mapped, nsq, pairs);
+	nruns = sim_count(pairs, nsq ? (nsq - 1) : 0, runs);
+	cost = refold_cost(mapped, nsq, grp, gpar, 0, 0);
+	for (i = 0; i < nruns; i++) {
+		u32 a = grp[runs[i].edge >> 16];
+		u32 b = grp[runs[i].edge & 0xFFFF];
+		u64 newcost;
+		u32 j;
+
+		if (a == b) continue;
+		if ((gpar[a] + gpar[b]) > area_parags) continue;
+		if ((grel[a] + grel[b]) > 0xFFFF) continue;
+		if (b < a) {
+			u32 tmp = a;
+			a = b;
+			b = tmp;
+		}
+		newcost = refold_cost(mapped, nsq, grp, gpar, a, b);
+		if (newcost >= cost) continue;
+		cost = newcost;
+		for (j = b; j <= num_ovls; j++) {
+			if (grp[j] == b) grp[j] = a;
+		}
+		gpar[a] += gpar[b];
+		grel[a] += grel[b];
+	}
+
+	//number new overlays by first member, and place members in original order
+	newno[0] = 0;
+	delta[0] = 0;
+	for (i = 1; i <= num_ovls; i++) {
+		u32 g = grp[i];
+		u32 k;
+
+		next[i] = 0;
+		if (g == i) {
+			k = ++ngroups;
+			newno[i] = k;
+			first[k] = last[k] = i;
+			delta[i] = 0;
+		} else {
+			const struct ovl_desc *prev;
+			k = newno[g];
+			newno[i] = k;
+			prev = &oda[last[k]];
+			delta[i] = delta[last[k]] + ((prev->img_siz + 15) / 16);
+			next[last[k]] = i;
+			last[k] = i;
+		}
+		newsiz[k] = (delta[i] * 16) + oda[i].img_siz;
+	}
+	newsiz[0] = oda[0].img_siz;
+
+	for (i = 0; i < nneeds; i++) mapped[i] = newno[needs[i]];
+	sim_run(si.siz, needs, nneeds, 1, &before, NULL);
+	sim_run(newsiz, mapped, nneeds, 1, &after, NULL);
+	ovl_msg(env, "%lu overlays -> %lu; single slot, %s : %lu loads, %llu bytes -> %lu loads, %llu bytes\n",
+			(unsigned long) num_ovls, (unsigned long) ngroups, so->trace_len ? "trace" : "static",
+			(unsigned long) before.loads, (unsigned long long) before.bytes,
+			(unsigned long) after.loads, (unsigned long long) after.bytes);
+	for (i = 1; i <= ngroups; i++) {
+		char line[80];
+		u32 m, len;
+
+		if (!next[first[i]]) continue;
+		len = snprintf(line, sizeof(line), "%04X :", (unsigned) i);
+		for (m = first[i]; m && (len < (sizeof(line) - 16)); m = next[m]) {
+			len += snprintf(&line[len], sizeof(line) - len, " %04X", (unsigned) m);
+		}
+		ovl_msg(env, "%s%s, %lX bytes\n", line, m ? " ..." : "", (unsigned long) newsiz[i]);
+	}
+
+	//root, with the LUTs pointing at the new overlays
+	memcpy(root, exf->buf, rootsiz);
+	for (i = 0; i < lp->lut_entries; i++) {
+		u8 ovl = exf->buf[lp->olut_pos + i];
+		u8 *segp = &root[lp->seglut_pos + (2 * i)];
+
+		if (!ovl || (ovl > num_ovls)) continue;
+		root[lp->olut_pos + i] = newno[ovl];
+		write_u16_LE(segp, read_u16_LE(segp) + delta[ovl]);
+	}
+
+	rv = OVL_EWRITE;
+	if (!out->write(out->ctx, root, rootsiz)) goto fexit;
+	for (i = 1; i <= ngroups; i++) {
+		bool ok;
+		if (next[first[i]]) {
+			ok = refold_write_merged(exf, out, lp->ovl_base, area_parags, first[i], next, delta, i, img, relocs);
+		} else {
+			ok = refold_write_single(exf, out, first[i], i);
+		}
+		if (!ok) goto fexit;
+	}
+	//anything after the chunks, e.g. debug info
+	if ((exf->chain_end < exf->siz) && !out->write(out->ctx, &exf->buf[exf->chain_end], exf->siz - exf->chain_end)) {
+		goto fexit;
+	}
+	if (num_new) *num_new = ngroups;
+	rv = OVL_OK;
+
+fexit:
+	if (rv == OVL_EWRITE) ovl_msg(env, "fwrite err\n");
+	sim_release(env, &si);
+	ovl_free(env, runs);
+	ovl_free(env, pairs);
+	ovl_free(env, grp);
+	ovl_free(env, mapped);
+	ovl_free(env, root);
+	ovl_free(env, img);
+	ovl_free(env, relocs);
+	return rv;
+}
+
+/******** LUT discovery for auto-unfold
+ *
+ * The overlay manager has a byte array of overlay numbers (OVLLUT) and a parallel u16 array
+ * of segments (SEGLUT), both indexed by the "ovl ID" of "CD 3F <ID> <offs>" calls.
+ * MSC 5.1 puts SEGLUT right before OVLLUT, i.e. SEGLUT_POS = OVLLUT_POS - (2 * LUT_ENTRIES).
+ *
+ * Candidates are scored by how many of the int 0x3F calls they explain :
+ * ID within LUT, mapped to an existing overlay, and the call offset landing inside that overlay.
+ */
+
+/** int 0x3F hits, grouped per ovl ID */
+struct call_tally {
+	u32 total;	//# of hits
+	u32 calls[256];	//# of hits per ID
+	u32 first[256];	//where each ID's offsets start in offs[]
+	u16 *offs;	//call offsets, grouped by ID and sorted
+	u32 alloc;
+	u8 ids[256];	//IDs that were seen, most called first
+	u16 nids;
+	u8 *hit_ids;	//temp : ID of each offs[] entry, in scan order
+};
+
+/** LUT parameters for ovl_unfold(), and how well they fit */
+struct lut_guess {
+	struct lut_params lp;	//positions are file offsets once returned by find_luts()
+	u32 score;	//# of calls explained by this guess
+	u32 plausible;	//# of LUT entries that look sane; tie-breaker
+};
+
+static bool tally_ovlcalls(struct call_tally *ct, const struct ovl_env *env, const u8 *imgbuf, u32 bufsiz) {
+	u32 hits[SCAN_BATCH];
+	u32 nhits;
+	u32 cursor = 0;
+	u32 lim = int3f_scanlim(bufsiz);
+
+	while ((nhits = scan_int3f(imgbuf, lim, &cursor, hits))) {
+		u32 h;
+
+		if ((ct->alloc - ct->total) < nhits) {
+			u32 newalloc = ct->alloc ? (ct->alloc * 2) : 4096;
+			u16 *tmp_o = ovl_realloc(env, ct->offs, newalloc * sizeof(u16));
+			if (tmp_o) ct->offs = tmp_o;
+			u8 *tmp_i = ovl_realloc(env, ct->hit_ids, newalloc);
+			if (tmp_i) ct->hit_ids = tmp_i;
+			if (!tmp_o || !tmp_i) return 0;
+			ct->alloc = newalloc;
+		}
+		for (h = 0; h < nhits; h++) {
+			u8 id = imgbuf[hits[h] + 2];
+			ct->hit_ids[ct->total] = id;
+			ct->offs[ct->total] = read_u16_LE(&imgbuf[hits[h] + 3]);
+			ct->calls[id]++;
+			ct->total++;
+		}
+	}
+	return 1;
+}
+
+static int cmp_u16(const void *a, const void *b) {
+	return (int) *(const u16 *) a - (int) *(const u16 *) b;
+}
+
+/** group offsets by ID, sort each group, and sort seen IDs by decreasing # of calls
+ * (so bad candidates are rejected early)
+ */
+static bool tally_sort(struct call_tally *ct, const struct ovl_env *env) {
+	u16 *sorted;
+	u32 fill[256];
+	u32 i, j, pos = 0;
+
+	for (i = 0; i < 256; i++) {
+		ct->first[i] = fill[i] = pos;
+		pos += ct->calls[i];
+	}
+	sorted = ovl_malloc(env, (ct->total ? ct->total : 1) * sizeof(u16));
+	if (!sorted) return 0;
+	for (i = 0; i < ct->total; i++) {
+		sorted[fill[ct->hit_ids[i]]++] = ct->offs[i];
+	}
+	ovl_free(env, ct->offs);
+	ovl_free(env, ct->hit_ids);
+	ct->offs = sorted;
+	ct->hit_ids = NULL;
+
+	ct->nids = 0;
+	for (i = 0; i < 256; i++) {
+		if (!ct->calls[i]) continue;
+		qsort(&ct->offs[ct->first[i]], ct->calls[i], sizeof(u16), cmp_u16);
+		//insertion sort, at most 256 entries
+		for (j = ct->nids; (j > 0) && (ct->calls[ct->ids[j - 1]] < ct->calls[i]); j--) {
+			ct->ids[j] = ct->ids[j - 1];
+		}
+		ct->ids[j] = i;
+		ct->nids++;
+	}
+	return 1;
+}
+
+static void tally_free(struct call_tally *ct, const struct ovl_env *env) {
+	ovl_free(env, ct->offs);
+	ovl_free(env, ct->hit_ids);
+	ct->offs = NULL;
+	ct->hit_ids = NULL;
+	return;
+}
+
+/** # of calls to "id" with an offset < lim */
+static u32 tally_below(const struct call_tally *ct, u8 id, u32 lim) {
+	const u16 *o = &ct->offs[ct->first[id]];
+	u32 lo = 0, hi = ct->calls[id];
+
+	while (lo < hi) {
+		u32 mid = (lo + hi) / 2;
+		if (o[mid] < lim) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/** score one candidate layout. Positions are offsets within root image.
+ * @return 0 if not a candidate at all
+ */
+static bool score_luts(const struct exefile *exf, const struct call_tally *ct, u32 seglut, u32 olut, u32 entries,
+					struct lut_guess *lg) {
+	const u8 *root = &exf->buf[exf->ovls[0].img_ofs];
+	u32 rootsiz = exf->ovls[0].img_siz;
+	u32 ovl_base = 0xFFFF;
+	u32 i, score = 0, plausible = 0;
+
+	if (((seglut + (2 * entries)) > rootsiz) || ((olut + entries) > rootsiz)) return 0;
+
+	//overlays are mapped at the lowest segment used by overlay entries
+	for (i = 0; i < entries; i++) {
+		if (!root[olut + i]) continue;
+		u16 seg = read_u16_LE(&root[seglut + (2 * i)]);
+		if (seg < ovl_base) ovl_base = seg;
+	}
+	if ((ovl_base == 0xFFFF) || ((ovl_base * 16UL) >= rootsiz)) return 0;
+
+	for (i = 0; i < ct->nids; i++) {
+		u8 id = ct->ids[i];
+		u8 ovl;
+		u32 segofs;
+
+		if (id >= entries) continue;
+		ovl = root[olut + id];
+		if (!ovl || (ovl > exf->num_ovls)) continue;
+
+		//count calls that land within the overlay
+		segofs = 16UL * (read_u16_LE(&root[seglut + (2 * id)]) - ovl_base);
+		if (segofs >= exf->ovls[ovl].img_siz) continue;
+		score += tally_below(ct, id, exf->ovls[ovl].img_siz - segofs);
+	}
+
+	for (i = 0; i < entries; i++) {
+		u16 seg = read_u16_LE(&root[seglut + (2 * i)]);
+		u8 ovl = root[olut + i];
+		if (ovl) {
+			//overlay code segment : within that overlay's image once mapped
+			if ((16UL * (seg - ovl_base)) < exf->ovls[ovl].img_siz) plausible++;
+		} else {
+			//root segment : within root image
+			if ((seg * 16UL) < rootsiz) plausible++;
+		}
+	}
+
+	lg->lp.seglut_pos = seglut;
+	lg->lp.olut_pos = olut;
+	lg->lp.lut_entries = entries;
+	lg->lp.ovl_base = ovl_base;
+	lg->score = score;
+	lg->plausible = plausible;
+	return 1;
+}
+
+static bool better_guess(const struct lut_guess *a, const struct lut_guess *b) {
+	if (a->score != b->score) return (a->score > b->score);
+	return (a->plausible > b->plausible);
+}
+
+/** find overlay LUTs and OVL_BASE.
+ *
+ * @param lg : best guess, with positions converted to file offsets
+ * @param ct : (zeroed by caller) receives int 0x3F calls of the whole program, per ovl ID;
+ *		must be released with tally_free()
+ *
+ * @return 0 if nothing usable found
+ *
+ * One pass over the root image computes, for every position, how many of the following
+ * bytes are valid overlay numbers; an OVLLUT must start where that run covers all called IDs.
+ */
+static bool find_luts(const struct exefile *exf, struct call_tally *ct, struct lut_guess *lg) {
+	const u8 *root = &exf->buf[exf->ovls[0].img_ofs];
+	u32 rootsiz = exf->ovls[0].img_siz;
+	u32 i, p;
+	u32 run = 0;	//# of valid overlay #s starting at p, capped to OVL_LUT_MAXENTRIES
+	u32 min_entries;
+	struct lut_guess best = {0};
+	bool found = 0;
+
+	for (i = 0; i <= exf->num_ovls; i++) {
+		if (!tally_ovlcalls(ct, exf->env, &exf->buf[exf->ovls[i].img_ofs], exf->ovls[i].img_siz)) return 0;
+	}
+	if (!tally_sort(ct, exf->env)) return 0;
+	if (!ct->nids || !exf->num_ovls) return 0;
+
+	//only the most called ID is mandatory; stray hits with random IDs shouldn't
+	//rule out the real LUT, they just lower its score.
+	min_entries = ct->ids[0] + 1;
+	if (min_entries > OVL_LUT_MAXENTRIES) return 0;
+
+	//walk backwards so the run length is known at each position
+	for (p = rootsiz; p-- > 0; ) {
+		u32 n;
+
+		if (root[p] <= exf->num_ovls) {
+			if (run < OVL_LUT_MAXENTRIES) run++;
+		} else {
+			run = 0;
+		}
+		if (run < min_entries) continue;
+		//quick reject : most called ID must go to an overlay
+		if (!root[p + ct->ids[0]]) continue;
+
+		for (n = min_entries; n <= run; n++) {
+			struct lut_guess lgt;
+			if (p < (2 * n)) break;
+			if (!score_luts(exf, ct, p - (2 * n), p, n, &lgt)) continue;
+			if (!found || better_guess(&lgt, &best)) {
+				best = lgt;
+				found = 1;
+			}
+		}
+	}
+
+	if (!found) return 0;
+	best.lp.seglut_pos += exf->ovls[0].img_ofs;
+	best.lp.olut_pos += exf->ovls[0].img_ofs;
+	*lg = best;
+	return 1;
+}
+
+enum ovl_err ovl_auto_unfold(struct exefile *exf, const struct unfold_opts *uo, unsigned min_confidence,
+					const struct ovl_sink *out, struct lut_params *lp, u32 *fixups_done) {
+	struct call_tally ct = {0};
+	struct lut_guess lg;
+	unsigned confidence;
+	bool found;
+	double t = now_sec();
+	u32 i;
+
+	if (!exf->num_ovls) {
+		ovl_msg(exf->env, "no ovl\n");
+		return OVL_ENOOVL;
+	}
+	found = find_luts(exf, &ct, &lg);
+	tally_free(&ct, exf->env);
+	stat_lap(uo->stats, PHASE_GUESS, &t);
+	if (uo->stats) {
+		for (i = 0; i <= exf->num_ovls; i++) uo->stats->scanned += exf->ovls[i].img_siz;
+	}
+	if (!found) {
+		ovl_msg(exf->env, "no LUT candidates found\n");
+		return OVL_ENOLUT;
+	}
+
+	confidence = (unsigned) ((100ULL * lg.score) / ct.total);
+	ovl_msg(exf->env, "LUT guess : %lX %lX %X %X ; confidence %u%% (%lu of %lu calls, %lu of %u entries plausible)\n",
+			(unsigned long) lg.lp.seglut_pos, (unsigned long) lg.lp.olut_pos, (unsigned) lg.lp.lut_entries, (unsigned) lg.lp.ovl_base,
+			confidence, (unsigned long) lg.score, (unsigned long) ct.total,
+			(unsigned long) lg.plausible, (unsigned) lg.lp.lut_entries);
+	if (lp) *lp = lg.lp;
+	if (confidence < min_confidence) {
+		ovl_msg(exf->env, "confidence too low, not unfolding\n");
+		return OVL_ENOLUT;
+	}
+
+	return ovl_unfold(exf, &lg.lp, uo, out, fixups_done);
+}
+
+void ovl_init(void) {
+	scan_init();
+	if (!dec_ready) decoder_init();
+	return;
+}
@@ -0,0 +1,332 @@
+/* libovlazy
+ *
+ * Library part of overlazy : load an overlayed DOS .exe, index its overlays,
+ * find "int 0x3F" overlay calls and unfold everything into one flat .exe.
+ *
+ * - nothing is printed; diagnostics go to the ovl_env message callback, listings and
+ *   unfolded .exe files go to caller-supplied sinks.
+ * - all allocations go through the ovl_env allocator.
+ * - no global state besides some constant tables, set up by ovl_init().
+ *   Different exefiles can be processed concurrently from different threads.
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef OVLAZY_H
+#define OVLAZY_H
+
+#include <stddef.h>
+#include "stuff.h"
+
+enum ovl_err {
+	OVL_OK = 0,
+	OVL_ENOMEM,	//allocation failed
+	OVL_EOPEN,	//can't open or read input file
+	OVL_EFORMAT,	//not a usable MZ exe
+	OVL_ENOOVL,	//exe has no overlays
+	OVL_EARGS,	//bad parameters, e.g. LUT past end of file
+	OVL_ESPACE,	//unfolded image wouldn't fit in the address space
+	OVL_ENOLUT,	//auto-unfold : no LUTs found, or not confident enough
+	OVL_EWRITE,	//output sink failed
+};
+
+/** @return short description of an error code */
+const char *ovl_strerror(enum ovl_err err);
+
+/** caller-supplied allocator : set all three members, or none to use the C library.
+ * Must be thread-safe if any unfold_opts.threads > 1.
+ */
+struct ovl_alloc {
+	void *(*alloc)(void *ctx, size_t siz);
+	void *(*resize)(void *ctx, void *ptr, size_t siz);	//like realloc()
+	void (*release)(void *ctx, void *ptr);	//never called with NULL
+	void *ctx;
+};
+
+/** environment for one exefile. Must stay valid until ovl_close(). */
+struct ovl_env {
+	struct ovl_alloc alloc;
+	void (*msg)(void *ctx, const char *line);	//diagnostics, one '\n'-terminated line per call; NULL = quiet
+	void *msg_ctx;
+};
+
+/** output sink */
+struct ovl_sink {
+	bool (*write)(void *ctx, const void *data, size_t len);	//@return 0 if failed
+	void *ctx;
+	/* optional : write at "ofs" from the start of the output, like pwrite(). Later write() calls
+	 * continue after it. Skipped-over ranges must read back as zeros (sparse file, or filled) */
+	bool (*pwrite)(void *ctx, const void *data, size_t len, u64 ofs);
+};
+
+/** listing formats for ovl_list() and ovl_list_calls(). See README for FMT_BIN. */
+enum outfmt {FMT_TEXT, FMT_JSONL, FMT_BIN};
+
+/** how to choose among usable segments */
+enum segpick {
+	SEGPICK_FIRST,	//first one found in reloc table (original behaviour)
+	SEGPICK_CLOSEST,	//highest segment that still reaches : smallest offset
+};
+
+/** working memory for ovl_unfold(). All of an unfold's buffers are carved out of it,
+ * following a plan computed from the overlay index; nothing is kept between calls, so
+ * the same arena can be passed for file after file and only grows to fit the biggest one.
+ * Zero-initialize before first use, release with ovl_arena_free().
+ * Not for concurrent unfolds : one arena per thread.
+ */
+struct ovl_arena {
+	u8 *base;
+	size_t cap;
+};
+
+/** @param env : same as the exefiles unfolded with this arena */
+void ovl_arena_free(struct ovl_arena *ar, const struct ovl_env *env);
+
+/** what ovl_unfold() writes */
+enum unfold_fmt {
+	UNFOLD_MZ,	//MZ .exe
+	UNFOLD_FLAT,	//raw image with relocations applied at load_seg, plus layout text (see README)
+	UNFOLD_ELF,	//ELF32 with a section per chunk, reloc sections and call target symbols
+};
+
+/** analysis script written by ovl_unfold() next to the unfolded file (see README) */
+enum map_fmt {
+	MAP_NONE,
+	MAP_IDC,	//IDA, IDC script
+	MAP_GHIDRA,	//Ghidra, Python script
+	MAP_R2,	//radare2 commands
+};
+
+/** where ovl_unfold() and ovl_auto_unfold() spend their time, see ovl_stats */
+enum ovl_phase {
+	PHASE_GUESS,	//auto-unfold : find LUTs
+	PHASE_COUNT,	//count int 0x3F calls in each chunk
+	PHASE_LAYOUT,	//place overlays, size working memory
+	PHASE_MAP,	//copy chunks, fixup_relocs(), fixup_seglut()
+	PHASE_INDEX,	//reloc segment index, --sweep instruction bounds
+	PHASE_FIXUP,	//fixup_int3f()
+	PHASE_PACK,	//--packrelocs
+	PHASE_WRITE,	//output file, --map script
+	NUM_PHASES
+};
+
+/** counters and per-phase times. Added to, not reset : zero before use. */
+struct ovl_stats {
+	double t[NUM_PHASES];	//seconds
+	u64 scanned;	//bytes searched for int 0x3F, all phases
+	u32 hits;	//int 0x3F calls counted
+	u32 fixups;	//calls patched
+	u32 covered;	//hits left alone because they overlap reloc items or LUTs
+	u32 foreign;	//calls left alone because they go to overlays of other shards
+	u32 relocs_in;	//reloc items of all chunks
+	u32 relocs_out;	//in the unfolded file
+	u32 seg_reused;	//new reloc items put on a segment already in the table
+	u64 seg_steps;	//binary search steps for those
+	u64 written;	//bytes written to the output sink
+};
+
+/** @return short name of a phase, e.g. "fixup" */
+const char *ovl_phase_name(enum ovl_phase ph);
+
+/** monotonic clock in seconds, for callers timing their own phases */
+double ovl_clock(void);
+
+/** ovl_unfold() knobs */
+struct unfold_opts {
+	enum segpick segpick;
+	unsigned threads;	//> 1 : spread the work over this many threads
+	bool sweep;	//only fix calls on instruction boundaries, found by linear sweep
+	bool packrelocs;	//sort output relocs by address, drop duplicates, rebase on 64 kB-aligned segments
+	enum unfold_fmt ufmt;
+	u16 load_seg;	//UNFOLD_FLAT
+	const struct ovl_sink *layout;	//UNFOLD_FLAT : where to describe the image; can be NULL
+	enum map_fmt mapfmt;
+	u16 map_seg;	//script addresses are for the image loaded at this segment
+	const struct ovl_sink *map;	//where to write the script; NULL : none
+	struct ovl_stats *stats;	//NULL : don't collect
+	bool stream;	//UNFOLD_MZ : write chunk by chunk, without building the whole image in memory (see README)
+	struct ovl_arena *arena;	//NULL : use a temporary one
+	u32 ovl_first;	//UNFOLD_MZ : only unfold overlays ovl_first .. ovl_last with the root; 0 : all. See ovl_shard_plan()
+	u32 ovl_last;
+};
+
+/** set up scanner / decoder tables. Call once before starting any threads. */
+void ovl_init(void);
+
+/** map or read an .exe file, and index its overlays.
+ *
+ * @param env : NULL for defaults (C library allocator, no messages)
+ * @param cow : caller intends to modify exf->buf (unfolding does). Changes are never written back.
+ *
+ * exefile must be released with ovl_close(), even on failure.
+ */
+enum ovl_err ovl_load_file(struct exefile *exf, const struct ovl_env *env, const char *filename, bool cow);
+
+/** same as ovl_load_file(), from a copy of buf[0 .. siz - 1] */
+enum ovl_err ovl_load_mem(struct exefile *exf, const struct ovl_env *env, const void *buf, u32 siz);
+
+void ovl_close(struct exefile *exf);
+
+/** overlay index : exf->ovls[0 .. exf->num_ovls], [0] is the root. Listed by ovl_list(). */
+enum ovl_err ovl_list(const struct exefile *exf, enum outfmt fmt, const struct ovl_sink *out);
+
+/** list int 0x3F calls.
+ * @param sweep : only calls on instruction boundaries in code (see unfold_opts)
+ * @param relocfilter : drop calls that overlap a reloc item of the root
+ * @param ovl_base : with relocfilter, overlay load segment (OVL_BASE) to place overlay reloc items too;
+ *	0 for root relocs only
+ * @param ncalls : (output, can be NULL)
+ */
+enum ovl_err ovl_list_calls(const struct exefile *exf, bool sweep, bool relocfilter, u16 ovl_base, enum outfmt fmt,
+					const struct ovl_sink *out, u32 *ncalls);
+
+/** raw int 0x3F scan of buf[0 .. lim - 1] from *cursor, for callers doing their own listing.
+ * @param hits : room for OVL_SCAN_BATCH offsets
+ * @return # of hits stored, 0 when done
+ */
+#define OVL_SCAN_BATCH 256
+u32 ovl_scan_calls(const u8 *buf, u32 lim, u32 *cursor, u32 *hits);
+
+#define OVL_PAT_MAXLEN 8	//opcode bytes of a call pattern
+#define OVL_MAXPATS 32
+
+/** what ovl_unfold() does with the hits of a call pattern */
+enum pat_fixup {
+	PATFIX_NONE,	//listed only
+	PATFIX_INT3F,	//patched to a far call through the LUTs
+};
+
+/** an overlay call encoding : fixed opcode bytes, then operands */
+struct call_pattern {
+	char name[16];	//letters, digits, '_'
+	u8 bytes[OVL_PAT_MAXLEN];
+	u8 len;
+	/* one letter per operand, in order : 'i' ovl ID byte (OVLLUT index), 'n' overlay # word,
+	 * 'o' offset word, 'b' / 'w' other byte / word */
+	char operands[OVL_PAT_MAXLEN + 1];
+	enum pat_fixup fixup;
+};
+
+/** built-in : MSC "CD 3F <ovl ID> <offs>" */
+extern const struct call_pattern ovl_pat_msc;
+
+/** one-pass scanner for a pattern table. Fill with ovl_patset_build(), release with ovl_patset_free().
+ * Read-only once built : can be shared by any # of threads and exefiles.
+ */
+struct ovl_patset {
+	struct call_pattern pats[OVL_MAXPATS];
+	u8 oplen[OVL_MAXPATS];	//operand bytes of each
+	unsigned npats;
+	u16 nstates;
+	u16 *next;	//automaton : next[(state << 8) | byte]
+	u8 *out;	//per state : # + 1 of the pattern ending there, 0 = none
+	u16 *olink;	//per state : next shorter match ending at the same byte, 0 = none
+};
+
+/** @param env : allocator and diagnostics, NULL for defaults. Same for ovl_patset_free() */
+enum ovl_err ovl_patset_build(struct ovl_patset *ps, const struct ovl_env *env, const struct call_pattern *pats, unsigned npats);
+
+void ovl_patset_free(struct ovl_patset *ps, const struct ovl_env *env);
+
+/** like ovl_list_calls(), for all patterns of a set in one pass, with the pattern of each call.
+ * FMT_BIN records are of their own type (3, see the README), with the pattern # and which operands were found.
+ */
+enum ovl_err ovl_list_patcalls(const struct exefile *exf, const struct ovl_patset *ps, bool sweep, bool relocfilter, u16 ovl_base,
+					enum outfmt fmt, const struct ovl_sink *out, u32 *ncalls);
+
+#define OVL_LUT_MAXENTRIES	0x100	//ovl IDs are bytes
+
+/** LUT parameters for unfolding; positions are file offsets */
+struct lut_params {
+	u32 seglut_pos;
+	u32 olut_pos;
+	u16 lut_entries;	//at most OVL_LUT_MAXENTRIES
+	u16 ovl_base;	//segment where overlays are loaded (relative to image base)
+};
+
+/** convert overlayed .exe to monolithic .exe with flattened overlays, written to "out".
+ * exf must have been loaded with cow = 1.
+ *
+ * @param fixups_done : (output, can be NULL) # of int 0x3F calls that were patched
+ */
+enum ovl_err ovl_unfold(struct exefile *exf, const struct lut_params *lp, const struct unfold_opts *uo,
+					const struct ovl_sink *out, u32 *fixups_done);
+
+/** split overlays in runs that can each be unfolded with the root (address space, relocs),
+ * for ovl_unfold() with uo->ovl_first and ovl_last.
+ *
+ * @param first : (output) exf->num_ovls + 1 entries; shard s is overlays first[s] .. first[s + 1] - 1
+ * @return # of shards; 0 if an overlay doesn't fit even by itself
+ */
+u32 ovl_shard_plan(const struct exefile *exf, u32 *first);
+
+/** find LUTs, then unfold if the guess explains at least min_confidence % of calls.
+ * @param lp : (output, can be NULL) LUT guess
+ */
+enum ovl_err ovl_auto_unfold(struct exefile *exf, const struct unfold_opts *uo, unsigned min_confidence,
+					const struct ovl_sink *out, struct lut_params *lp, u32 *fixups_done);
+
+/** one overlay need of a recorded run, for ovl_simulate() */
+struct sim_event {
+	u16 val;
+	bool is_id;	//val is the ovl ID byte of an int 0x3F call, mapped through OVLLUT; else an overlay #
+};
+
+/** ovl_simulate() knobs */
+struct sim_opts {
+	bool sweep;	//static call graph : only calls on instruction boundaries
+	const struct sim_event *trace;	//recorded run to replay; NULL : static estimate only
+	u32 trace_len;
+};
+
+/** estimate how often the original program reloads overlays : static cross-overlay call graph,
+ * then loads and bytes read under the single overlay area and under LRU caches of a few slots,
+ * for the call graph and for the trace if any. Text report (see README) written to "out".
+ * Only lp->olut_pos and lp->lut_entries are used.
+ * @param ncalls : (output, can be NULL) # of calls in the call graph
+ */
+enum ovl_err ovl_simulate(const struct exefile *exf, const struct lut_params *lp, const struct sim_opts *so,
+					const struct ovl_sink *out, u32 *ncalls);
+
+/** regroup overlays that keep swapping each other out, using the same call profile as ovl_simulate()
+ * (the trace if any, else the static call graph), and write the new overlayed .exe to "out".
+ * Merged overlays never outgrow the biggest original one. See README.
+ * @param num_new : (output, can be NULL) # of overlays in the new exe
+ */
+enum ovl_err ovl_refold(const struct exefile *exf, const struct lut_params *lp, const struct sim_opts *so,
+				const struct ovl_sink *out, u32 *num_new);
+
+/** ovl_bench_scan() results */
+struct scan_bench {
+	u32 codebytes;	//scanned by each pass
+	u32 raw_calls;
+	u32 sweep_calls;
+	double raw_t;	//seconds per pass
+	double sweep_t;
+};
+
+/** time the plain int 0x3F scan vs the linear sweep filter over the code of all chunks */
+enum ovl_err ovl_bench_scan(const struct exefile *exf, struct scan_bench *sb);
+
+/** XXH64 of data[0 .. len - 1] */
+u64 ovl_hash64(const void *data, size_t len, u64 seed);
+
+/** XXH64 of a whole file, without parsing it. Files too small to be an .exe are rejected like ovl_load_file() does.
+ * @param env : NULL for defaults
+ */
+enum ovl_err ovl_hash_file(const struct ovl_env *env, const char *filename, u64 seed, u64 *hash);
+
+/** call fn(ctx, 0 .. njobs - 1), spread over up to nthreads threads. Returns when all are done.
+ * @param env : NULL for defaults
+ */
+void run_parallel(const struct ovl_env *env, unsigned nthreads, u32 njobs, void (*fn)(void *ctx, u32 job), void *ctx);
+
+/** same, and tell fn which thread it runs on : worker is in 0 .. nthreads - 1, and
+ * no two jobs run at the same time with the same worker. For per-thread scratch memory.
+ */
+void run_parallel_w(const struct ovl_env *env, unsigned nthreads, u32 njobs, void (*fn)(void *ctx, u32 job, unsigned worker), void *ctx);
+
+/** @return # of online CPUs, at least 1 */
+unsigned num_cpus(void);
+
+#endif
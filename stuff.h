@@ -4,10 +4,13 @@
 /** these are not exports, just internal structs */
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 
 //************* hax macros
 #define read_u16_LE(u8p)    ((u16)((u8 *)(u8p))[0] + ((u16)((u8 *)(u8p))[1] << 8))
@@ -36,20 +39,29 @@ struct header {				/*      EXE file header		 	 */
 	u16	overlayNum;		/* Overlay number                */
 };
 
-struct exefile {
-	u32 siz;
-	u8 *buf;	//whole contents
-	struct header hdr;
-};
-
 /** overlay descriptor */
 struct ovl_desc {
 	struct header hdr;
+	u32 chunk_ofs;	//position in orig .exe of MZ header
+	u32 chunk_siz;	//whole chunk incl. header and padding, clipped to end of file
 	u32 relocs_ofs;	//position in orig .exe
 	u32 img_ofs;	//position in orig .exe
 	u32 img_siz;	//in bytes (just image, no relocs or header)
 };
 
+struct ovl_env;
+
+struct exefile {
+	u32 siz;
+	u8 *buf;	//whole contents
+	struct header hdr;
+	bool mapped;	//buf is a file mapping, not malloc'd
+	struct ovl_desc *ovls;	//overlay index built by index_ovls(); [0] is the root
+	u32 num_ovls;	//excluding root
+	u32 chain_end;	//file offset where the MZ chunk chain ended
+	const struct ovl_env *env;	//allocator and diagnostics
+};
+
 /** relocation table entry */
 struct reloc_entry {
 	u16 ofs;
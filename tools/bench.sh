@@ -0,0 +1,102 @@
+#!/bin/sh
+# Times overlazy's l, c, d and u commands on files made by genovl.
+#
+# usage: tools/bench.sh [SIZE_MB ...]
+#	default sizes : 1 16 64 256
+# env : OVERLAZY (default ./overlazy), GENOVL (default ./genovl),
+#	REPS (runs per command, best one is kept; default 3), TMPDIR,
+#	OPTS (extra overlazy options for c and u, e.g. "--sweep --threads=4")
+#
+# Output : one line per file and command, with wall time, MB/s and (for c, u) calls/s.
+# Overlays are ~60 kB each; past 0xFE overlays the extra ones are not referenced by any LUT entry.
+# u runs with --sweep (the random operands hold "CD 3F" that aren't calls) and --shard, since
+# from a few MB on the overlays don't fit in one unfolded exe; its calls are summed over shards.
+# u counts as FAILED if any call was left unfixed or didn't match the LUTs.
+
+OVERLAZY=${OVERLAZY:-./overlazy}
+GENOVL=${GENOVL:-./genovl}
+REPS=${REPS:-3}
+OPTS=${OPTS:-}
+SIZES=${*:-"1 16 64 256"}
+
+for b in "$OVERLAZY" "$GENOVL"; do
+	if [ ! -x "$b" ]; then
+		echo "$b not found; build with"
+		echo "	gcc -O2 main.c ovlazy.c -o overlazy -pthread"
+		echo "	gcc -O2 tools/genovl.c -o genovl"
+		exit 1
+	fi
+done
+OVERLAZY=$(cd "$(dirname "$OVERLAZY")" && pwd)/$(basename "$OVERLAZY")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ovlbench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+now_ns() {
+	date +%s%N
+}
+
+# run command REPS times in $WORK, keep best time (ns) in $BEST, output of last run in $WORK/out
+timeit() {
+	BEST=
+	r=0
+	while [ $r -lt "$REPS" ]; do
+		t0=$(now_ns)
+		(cd "$WORK" && "$@") > "$WORK/out" 2>&1
+		rc=$?
+		t1=$(now_ns)
+		rm -f "$WORK"/bench.exe_* "$WORK"/test.ex_*
+		dt=$((t1 - t0))
+		if [ -z "$BEST" ] || [ $dt -lt "$BEST" ]; then BEST=$dt; fi
+		r=$((r + 1))
+	done
+	return $rc
+}
+
+# report <cmd> <bytes> <calls or -> <status>
+report() {
+	awk -v c="$1" -v b="$2" -v n="$3" -v ns="$BEST" -v st="$4" 'BEGIN {
+		s = ns / 1e9;
+		line = sprintf("%-4s %10.1f ms %10.1f MB/s", c, s * 1e3, b / s / 1e6);
+		if (n != "-") line = line sprintf(" %12.0f calls/s (%d calls)", n / s, n);
+		if (st != "ok") line = line "  FAILED";
+		print line;
+	}'
+}
+
+printf "%-4s %13s %15s %15s\n" cmd time throughput calls
+for mb in $SIZES; do
+	ovlsize=0xF000
+	novl=$(( (mb * 1048576 - 0x24000) / 0xF800 ))
+	[ $novl -lt 1 ] && novl=1
+	entries=$((novl + 4))
+	[ $entries -gt 254 ] && entries=254
+
+	F="$WORK/bench.exe"
+	PARAMS=$("$GENOVL" "$F" --ovls=$novl --ovlsize=$ovlsize --entries=$entries --relocs=2000 --ovlrelocs=200 --noise=50 2>/dev/null) || {
+		echo "genovl failed for $mb MB"
+		continue
+	}
+	bytes=$(wc -c < "$F")
+	echo "== $mb MB ($bytes bytes, $novl overlays) : u $PARAMS"
+
+	for cmd in l c d u; do
+		case $cmd in
+		u) set -- "$OVERLAZY" bench.exe u $PARAMS --sweep --shard $OPTS ;;
+		c) set -- "$OVERLAZY" bench.exe c $OPTS ;;
+		*) set -- "$OVERLAZY" bench.exe $cmd ;;
+		esac
+		st=ok
+		timeit "$@" || st=fail
+		case $cmd in
+		c) n=$(grep -c '^[0-9A-F]*	[0-9A-F]*	[0-9A-F]*$' "$WORK/out") ;;
+		u) n=$(sed -n 's/^Fixed 0x\([0-9A-Fa-f]*\) int3f calls.*/\1/p' "$WORK/out" |
+				while read -r x; do echo $((0x$x)); done | awk '{ t += $1 } END { if (NR) print t }')
+			if [ -z "$n" ]; then n=-; st=fail; fi
+			grep -q -e '^ovl ID > lut_entries' -e '^Mismatch in # of int3F' -e 'not enough addressing' "$WORK/out" && st=fail ;;
+		*) n=- ;;
+		esac
+		report $cmd "$bytes" "$n" $st
+	done
+	rm -f "$F"
+done
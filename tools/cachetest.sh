@@ -0,0 +1,52 @@
+#!/bin/sh
+# Checks that --cache entries survive later runs writing to the same --out,
+# for each --cache-link mode : two different files are unfolded to one output,
+# then the first one again, which must be a cache hit giving its own exe back.
+#
+# usage: tools/cachetest.sh
+# env : OVERLAZY (default ./overlazy), GENOVL (default ./genovl), TMPDIR
+#
+# Prints one line per link mode; exits non-zero if any failed.
+
+OVERLAZY=${OVERLAZY:-./overlazy}
+GENOVL=${GENOVL:-./genovl}
+
+for b in "$OVERLAZY" "$GENOVL"; do
+	if [ ! -x "$b" ]; then
+		echo "$b not found; build with"
+		echo "	gcc -O2 main.c ovlazy.c -o overlazy -pthread"
+		echo "	gcc -O2 tools/genovl.c -o genovl"
+		exit 1
+	fi
+done
+OVERLAZY=$(cd "$(dirname "$OVERLAZY")" && pwd)/$(basename "$OVERLAZY")
+GENOVL=$(cd "$(dirname "$GENOVL")" && pwd)/$(basename "$GENOVL")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/ovlcache.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT INT TERM
+cd "$WORK" || exit 1
+
+P1=$("$GENOVL" one.exe --seed=1 2>/dev/null) || exit 1
+P2=$("$GENOVL" two.exe --seed=2 --ovls=20 2>/dev/null) || exit 1
+"$OVERLAZY" one.exe u $P1 --sweep --out=one.ref > /dev/null
+"$OVERLAZY" two.exe u $P2 --sweep --out=two.ref > /dev/null
+if cmp -s one.ref two.ref; then
+	echo "test files unfold to the same exe"
+	exit 1
+fi
+
+fail=0
+for link in copy hard reflink; do
+	rm -rf cc out.ex_
+	"$OVERLAZY" one.exe u $P1 --sweep --cache=cc --cache-link=$link --out=out.ex_ > /dev/null
+	"$OVERLAZY" two.exe u $P2 --sweep --cache=cc --cache-link=$link --out=out.ex_ > /dev/null
+	"$OVERLAZY" one.exe u $P1 --sweep --cache=cc --cache-link=$link --out=out.ex_ --stats | grep -q 'cache hit' ||
+		{ echo "$link : no cache hit"; fail=1; continue; }
+	if cmp -s out.ex_ one.ref; then
+		echo "$link : ok"
+	else
+		echo "$link : cached exe was overwritten  FAILED"
+		fail=1
+	fi
+done
+exit $fail
@@ -0,0 +1,557 @@
+/* genovl
+ *
+ * Generates a synthetic overlayed .exe, laid out like the output of MS LINK
+ * for MSC 5.1 programs : a root chunk followed by one MZ chunk per overlay.
+ * Meant for testing and benchmarking overlazy on Linux, without a DOS toolchain.
+ *
+ * The files are NOT runnable; only the parts that overlazy looks at are realistic :
+ * - code regions are a stream of valid 8086 instructions, so linear sweep stays in sync.
+ *   Operands are random, so they contain some "CD 3F" that are not calls.
+ * - "int 0x3F" calls (CD 3F id offs16) are planted on instruction boundaries.
+ * - relocs point at the segment word of far calls (9A ofs seg) in the code.
+ * - root DGROUP starts at SS, holds random data, the segment / overlay # LUTs
+ *   and optionally some fake calls. The stack is above it, SS:SP at the top of DGROUP.
+ *
+ * On success, prints the 'u' command arguments on stdout :
+ * <SEGLUT_POS> <OVLLUT_POS> <LUT_ENTRIES> <OVL_BASE>
+ *
+ * Licensed under GPLv3
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "../stuff.h"
+
+#define MAX_CHUNK	(0xFFFFUL * 512)	//numPages is a u16
+#define MAX_ROOTCODE	(0xFFFFUL * 16)	//SS must fit in a u16
+#define INT3F_LEN	5
+#define STACK_SIZ	0x800	//above the DGROUP data, like LINK's STACK segment
+#define MAX_DATA	(0x10000UL - STACK_SIZ - 16)	//SP must fit in a u16
+
+struct gen_opts {
+	u32 novl;	//# of overlays
+	u32 codesiz;	//root code, bytes
+	u32 datasiz;	//root DGROUP, bytes
+	u32 ovlsiz;	//nominal overlay size, bytes; each is up to 1/8 bigger
+	u32 density;	//int 0x3F calls per 1000 instructions
+	u32 relocs;	//root relocs
+	u32 ovlrelocs;	//relocs per overlay
+	u32 entries;	//LUT entries, 0 = novl + 4
+	u32 lutpos;	//offset of seg LUT in DGROUP, -1 = random
+	u32 noise;	//fake calls in DGROUP
+	u16 ovlbase;
+	u32 seed;
+};
+
+/******** PRNG (xorshift32), so files are reproducible for a given seed */
+static u32 rng_state;
+
+static u32 rnd(void) {
+	u32 x = rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rng_state = x;
+	return x;
+}
+
+/** @return random number in [0, n - 1]; n != 0 */
+static u32 rnd_below(u32 n) {
+	return rnd() % n;
+}
+
+static void write_u16_LE(u8 *buf, u16 val) {
+	buf[0] = val & 0xFF;
+	buf[1] = val >> 8;
+	return;
+}
+
+static void fill_random(u8 *buf, u32 siz) {
+	u32 i;
+	for (i = 0; i < siz; i++) buf[i] = rnd();
+	return;
+}
+
+/******** code generation */
+
+/** parameters for one code region */
+struct codegen {
+	u8 *img;
+	u32 pos;
+	u32 end;
+	u32 density;	//int 0x3F calls per 1000 insns
+
+	const u16 *ovl_siz;	//(parags) size of each overlay, for call targets
+	u32 ncall_ids;	//LUT ids 0 .. ncall_ids - 1 map to overlays 1 .. ncall_ids
+
+	const u16 *rootsegs;	//far call targets
+	u32 nrootsegs;
+
+	u8 *relocs;	//reloc table being built
+	u32 nrel;
+	u32 maxrel;
+	u16 relseg;	//segment for reloc entries; increases with pos in the root
+	u32 relseg_ofs;	//image offset of relseg
+	const u32 *segstarts;	//root code segment boundaries, to update relseg. NULL for overlays
+	u32 nsegs;
+	u32 cur_seg;
+
+	u32 ncalls;	//# of calls planted
+};
+
+static void emit_modrm(struct codegen *cg) {
+	u8 modrm = rnd();
+	u8 mod = modrm >> 6;
+
+	cg->img[cg->pos++] = modrm;
+	if (mod == 1) {
+		cg->img[cg->pos++] = rnd();
+	} else if ((mod == 2) || ((mod == 0) && ((modrm & 7) == 6))) {
+		write_u16_LE(&cg->img[cg->pos], rnd());
+		cg->pos += 2;
+	}
+	return;
+}
+
+static void emit_farcall(struct codegen *cg) {
+	u8 *re = &cg->relocs[4 * cg->nrel];
+
+	cg->img[cg->pos] = 0x9A;
+	write_u16_LE(&cg->img[cg->pos + 1], rnd());
+	write_u16_LE(&cg->img[cg->pos + 3], cg->rootsegs[rnd_below(cg->nrootsegs)]);
+	write_u16_LE(&re[0], (u16) (cg->pos + 3 - cg->relseg_ofs));
+	write_u16_LE(&re[2], cg->relseg);
+	cg->nrel++;
+	cg->pos += 5;
+	return;
+}
+
+static void emit_int3f(struct codegen *cg) {
+	u32 id = rnd_below(cg->ncall_ids);
+	u32 maxofs = cg->ovl_siz[id + 1] * 16UL;
+
+	cg->img[cg->pos] = 0xCD;
+	cg->img[cg->pos + 1] = 0x3F;
+	cg->img[cg->pos + 2] = id;
+	write_u16_LE(&cg->img[cg->pos + 3], (u16) (rnd_below(maxofs / 2) * 2));
+	cg->pos += INT3F_LEN;
+	cg->ncalls++;
+	return;
+}
+
+/** fill img[pos .. end - 1] with a stream of instructions */
+static void gen_code(struct codegen *cg) {
+	while (cg->pos < cg->end) {
+		u32 left = cg->end - cg->pos;
+		u32 r;
+
+		if (cg->segstarts) {
+			while ((cg->cur_seg + 1 < cg->nsegs) && (cg->pos >= cg->segstarts[cg->cur_seg + 1])) {
+				cg->cur_seg++;
+				cg->relseg_ofs = cg->segstarts[cg->cur_seg];
+				cg->relseg = cg->relseg_ofs >> 4;
+			}
+		} else if ((cg->pos - cg->relseg_ofs) >= 0xF000) {
+			//big overlay : keep reloc offsets within 64k
+			u32 newofs = cg->pos & ~15UL;
+			cg->relseg += (newofs - cg->relseg_ofs) >> 4;
+			cg->relseg_ofs = newofs;
+		}
+		if (left < 8) {
+			memset(&cg->img[cg->pos], 0x90, left);	//NOP
+			cg->pos = cg->end;
+			break;
+		}
+
+		//far calls : spread the remaining relocs over the remaining space (~3 bytes / insn)
+		if ((cg->nrel < cg->maxrel) && (rnd_below(left) < (3 * (cg->maxrel - cg->nrel)))) {
+			emit_farcall(cg);
+			continue;
+		}
+		if (cg->ncall_ids && (rnd_below(1000) < cg->density)) {
+			emit_int3f(cg);
+			continue;
+		}
+
+		r = rnd_below(16);
+		switch (r) {
+		case 0:
+		case 1:
+		case 2:
+			cg->img[cg->pos++] = 0x50 + rnd_below(16);	//PUSH / POP r16
+			break;
+		case 3:
+			cg->img[cg->pos++] = 0x40 + rnd_below(16);	//INC / DEC r16
+			break;
+		case 4:
+			cg->img[cg->pos++] = (rnd() & 1) ? 0xC3 : 0xCB;	//RET / RETF
+			break;
+		case 5:
+		case 6:
+			cg->img[cg->pos++] = 0xB8 + rnd_below(8);	//MOV r16, imm16
+			write_u16_LE(&cg->img[cg->pos], rnd());
+			cg->pos += 2;
+			break;
+		case 7:
+		case 8:
+		case 9: {
+			static const u8 alu_ops[] = {0x8B, 0x89, 0x03, 0x2B, 0x3B, 0x8A, 0x88, 0x33};
+			cg->img[cg->pos++] = alu_ops[rnd_below(sizeof(alu_ops))];	//op r, r/m
+			emit_modrm(cg);
+			break;
+			}
+		case 10:
+			cg->img[cg->pos++] = 0x83;	//ALU r/m16, imm8
+			emit_modrm(cg);
+			cg->img[cg->pos++] = rnd();
+			break;
+		case 11:
+			cg->img[cg->pos++] = 0xC7;	//MOV r/m16, imm16
+			emit_modrm(cg);
+			write_u16_LE(&cg->img[cg->pos], rnd());
+			cg->pos += 2;
+			break;
+		case 12:
+			cg->img[cg->pos++] = 0x70 + rnd_below(16);	//Jcc rel8
+			cg->img[cg->pos++] = rnd();
+			break;
+		case 13:
+			cg->img[cg->pos++] = 0xE8;	//CALL rel16
+			write_u16_LE(&cg->img[cg->pos], rnd());
+			cg->pos += 2;
+			break;
+		case 14:
+			cg->img[cg->pos++] = 0x26 + (rnd_below(4) << 3);	//segment override + MOV
+			cg->img[cg->pos++] = 0x8B;
+			emit_modrm(cg);
+			break;
+		default:
+			cg->img[cg->pos++] = 0x90;
+			break;
+		}
+	}
+	return;
+}
+
+/******** file output */
+
+/** write one MZ chunk.
+ * @return 0 if failed
+ */
+static bool write_chunk(FILE *outf, u16 ovlnum, const u8 *img, u32 imgsiz, const u8 *relocs, u32 nrel,
+					u16 ss, u16 sp, u32 *hdrsiz_out) {
+	struct header hdr = {0};
+	u32 hdrsiz = (sizeof(struct header) + (nrel * 4) + 15) & ~15UL;
+	u32 total = hdrsiz + imgsiz;
+	u32 npages = (total + 511) / 512;
+	u8 *hbuf;
+	u32 pad;
+	bool ok = 1;
+
+	hdr.sigLo = 0x4D;
+	hdr.sigHi = 0x5A;
+	hdr.lastPageSize = total % 512;
+	hdr.numPages = npages;
+	hdr.numReloc = nrel;
+	hdr.numParaHeader = hdrsiz / 16;
+	hdr.minAlloc = ovlnum ? 0 : 0x100;
+	hdr.maxAlloc = 0xFFFF;
+	hdr.initSS = ss;
+	hdr.initSP = sp;
+	hdr.relocTabOffset = sizeof(struct header);
+	hdr.overlayNum = ovlnum;
+
+	hbuf = calloc(hdrsiz, 1);
+	if (!hbuf) return 0;
+	memcpy(hbuf, &hdr, sizeof(hdr));
+	memcpy(&hbuf[sizeof(hdr)], relocs, nrel * 4);
+
+	if (fwrite(hbuf, 1, hdrsiz, outf) != hdrsiz) ok = 0;
+	if (fwrite(img, 1, imgsiz, outf) != imgsiz) ok = 0;
+	pad = (npages * 512) - total;
+	while (ok && pad--) {
+		if (fputc(0, outf) == EOF) ok = 0;
+	}
+	free(hbuf);
+	if (hdrsiz_out) *hdrsiz_out = hdrsiz;
+	return ok;
+}
+
+/** size to use for an image so that (hdrsiz + imgsiz) isn't a multiple of 512 :
+ * overlazy (like DOS) would read lastPageSize == 0 as a short page.
+ */
+static u32 fix_imgsiz(u32 imgsiz, u32 nrel) {
+	u32 hdrsiz = (sizeof(struct header) + (nrel * 4) + 15) & ~15UL;
+	if (((hdrsiz + imgsiz) % 512) == 0) imgsiz += 1;
+	return imgsiz;
+}
+
+static bool generate(FILE *outf, const struct gen_opts *go) {
+	u32 entries = go->entries ? go->entries : go->novl + 4;
+	u32 ncall_ids = (go->novl < entries) ? go->novl : entries;
+	u32 rootsiz, imgsiz;
+	u32 sp = ((go->datasiz + 15) & ~15UL) + STACK_SIZ;	//top of DGROUP : every chunk's SS:SP
+	u32 lutpos, olutpos;
+	u32 maxsiz;
+	u32 nsegs;
+	u32 *segstarts = NULL;
+	u16 *rootsegs = NULL;
+	u16 *ovl_siz = NULL;
+	u8 *img = NULL;
+	u8 *relocs = NULL;
+	u32 hdrsiz;
+	u32 i;
+	u16 ss = go->codesiz >> 4;
+	u32 totalcalls = 0;
+	bool ok = 0;
+
+	rootsiz = (ss * 16UL) + go->datasiz;
+	if (3 * entries > go->datasiz) {
+		fprintf(stderr, "DGROUP too small for LUTs\n");
+		return 0;
+	}
+	lutpos = go->lutpos;
+	if (lutpos == (u32) -1) {
+		lutpos = rnd_below(go->datasiz - (3 * entries) + 1) & ~1UL;
+	} else if (lutpos + (3 * entries) > go->datasiz) {
+		fprintf(stderr, "LUTs don't fit in DGROUP at that position\n");
+		return 0;
+	}
+	lutpos += ss * 16UL;
+	olutpos = lutpos + (2 * entries);	//like MS LINK : ovl # LUT right after seg LUT
+
+	//overlay sizes, needed for call targets before anything is generated
+	ovl_siz = malloc((go->novl + 1) * sizeof(*ovl_siz));
+	maxsiz = rootsiz + 1;
+	if (!ovl_siz) goto cleanup;
+	ovl_siz[0] = 0;
+	for (i = 1; i <= go->novl; i++) {
+		u32 siz = go->ovlsiz + rnd_below((go->ovlsiz / 8) + 1);
+		siz = (siz + 15) & ~15UL;
+		if (siz > 0xFFFF0) siz = 0xFFFF0;
+		ovl_siz[i] = siz >> 4;
+		if (siz + 1 > maxsiz) maxsiz = siz + 1;
+	}
+
+	//root code segments : 2 .. 16 kB each
+	nsegs = 0;
+	segstarts = malloc(((ss / 0x80) + 2) * sizeof(*segstarts));
+	rootsegs = malloc(((ss / 0x80) + 2) * sizeof(*rootsegs));
+	if (!segstarts || !rootsegs) goto cleanup;
+	for (i = 0; (i < ss * 16UL) || !nsegs; ) {
+		segstarts[nsegs] = i;
+		rootsegs[nsegs] = i >> 4;
+		nsegs++;
+		i += (0x800 + rnd_below(0x3800)) & ~15UL;
+	}
+
+	img = malloc(maxsiz);
+	relocs = malloc(4 * ((go->relocs > go->ovlrelocs) ? go->relocs : go->ovlrelocs));
+	if (!img || (!relocs && (go->relocs || go->ovlrelocs))) goto cleanup;
+
+	//root
+	{
+		struct codegen cg = {0};
+
+		cg.img = img;
+		cg.end = ss * 16UL;
+		cg.density = go->density;
+		cg.ovl_siz = ovl_siz;
+		cg.ncall_ids = ncall_ids;
+		cg.rootsegs = rootsegs;
+		cg.nrootsegs = nsegs;
+		cg.relocs = relocs;
+		cg.maxrel = go->relocs;
+		cg.segstarts = segstarts;
+		cg.nsegs = nsegs;
+		gen_code(&cg);
+		totalcalls += cg.ncalls;
+
+		fill_random(&img[cg.end], go->datasiz);
+		for (i = 0; (go->datasiz >= INT3F_LEN) && (i < go->noise); i++) {
+			u32 p = (ss * 16UL) + rnd_below(go->datasiz - INT3F_LEN + 1);
+			if ((p + INT3F_LEN > lutpos) && (p < olutpos + entries)) continue;
+			img[p] = 0xCD;
+			img[p + 1] = 0x3F;
+			img[p + 2] = rnd_below(entries);
+		}
+		for (i = 0; i < entries; i++) {
+			if (i < ncall_ids) {
+				write_u16_LE(&img[lutpos + (2 * i)], go->ovlbase);
+				img[olutpos + i] = i + 1;
+			} else {
+				write_u16_LE(&img[lutpos + (2 * i)], rootsegs[rnd_below(nsegs)]);
+				img[olutpos + i] = 0;
+			}
+		}
+		imgsiz = fix_imgsiz(rootsiz, cg.nrel);
+		if (imgsiz > rootsiz) img[rootsiz] = 0;
+		if (!write_chunk(outf, 0, img, imgsiz, relocs, cg.nrel, ss, sp, &hdrsiz)) goto cleanup;
+	}
+
+	//overlays
+	for (i = 1; i <= go->novl; i++) {
+		struct codegen cg = {0};
+		u32 siz = ovl_siz[i] * 16UL;
+
+		cg.img = img;
+		cg.end = siz;
+		cg.density = go->density;
+		cg.ovl_siz = ovl_siz;
+		cg.ncall_ids = ncall_ids;
+		cg.rootsegs = rootsegs;
+		cg.nrootsegs = nsegs;
+		cg.relocs = relocs;
+		cg.maxrel = go->ovlrelocs;
+		cg.relseg = go->ovlbase;
+		gen_code(&cg);
+		totalcalls += cg.ncalls;
+
+		imgsiz = fix_imgsiz(siz, cg.nrel);
+		if (imgsiz > siz) img[siz] = 0;
+		if (!write_chunk(outf, i, img, imgsiz, relocs, cg.nrel, ss, sp, NULL)) goto cleanup;
+	}
+
+	printf("%lX %lX %lX %X\n", (unsigned long) (hdrsiz + lutpos), (unsigned long) (hdrsiz + olutpos),
+			(unsigned long) entries, (unsigned) go->ovlbase);
+	fprintf(stderr, "%lu int 0x3F calls planted\n", (unsigned long) totalcalls);
+	ok = 1;
+
+cleanup:
+	if (!ok) fprintf(stderr, "malloc or write choke\n");
+	free(relocs);
+	free(img);
+	free(rootsegs);
+	free(segstarts);
+	free(ovl_siz);
+	return ok;
+}
+
+/******** CLI */
+
+static void print_usage(const char *argv0) {
+	printf(	"**** %s\n"
+		"**** synthetic overlayed DOS exe generator, for overlazy tests\n"
+		"Usage:\t%s <outfile> [options]\n"
+		"Prints the 'u' arguments for the generated file : SEGLUT_POS OVLLUT_POS LUT_ENTRIES OVL_BASE\n"
+		"Options (sizes in bytes, decimal or 0x hex) :\n"
+		"\t--ovls=N : # of overlays (default 16)\n"
+		"\t--code=SIZ : root code size (default 0x20000, max 0xFFFF0)\n"
+		"\t--data=SIZ : root DGROUP data size, the stack goes above it (default 0x4000, max 0xF7F0)\n"
+		"\t--ovlsize=SIZ : overlay size; each one gets 0-12%% extra (default 0x2000, max 0xFFFF0)\n"
+		"\t--density=N : int 0x3F calls per 1000 instructions (default 5)\n"
+		"\t--relocs=N : # of relocs in root (default 100)\n"
+		"\t--ovlrelocs=N : # of relocs per overlay (default 25)\n"
+		"\t--entries=N : # of LUT entries, at most 0xFE (default: # of overlays + 4)\n"
+		"\t--lutpos=OFS : seg LUT offset within DGROUP (default: random)\n"
+		"\t--noise=N : # of fake int 0x3F calls in DGROUP (default 0)\n"
+		"\t--ovlbase=SEG : overlay load segment (default 0x100)\n"
+		"\t--seed=N : PRNG seed (default 1)\n",
+		argv0, argv0);
+	return;
+}
+
+/** parse one "--name=value" option
+ * @return 0 if unknown / bad value
+ */
+static bool parse_option(struct gen_opts *go, const char *opt) {
+	static const struct {
+		const char *name;
+		size_t offset;
+	} u32_opts[] = {
+		{"--ovls=", offsetof(struct gen_opts, novl)},
+		{"--code=", offsetof(struct gen_opts, codesiz)},
+		{"--data=", offsetof(struct gen_opts, datasiz)},
+		{"--ovlsize=", offsetof(struct gen_opts, ovlsiz)},
+		{"--density=", offsetof(struct gen_opts, density)},
+		{"--relocs=", offsetof(struct gen_opts, relocs)},
+		{"--ovlrelocs=", offsetof(struct gen_opts, ovlrelocs)},
+		{"--entries=", offsetof(struct gen_opts, entries)},
+		{"--lutpos=", offsetof(struct gen_opts, lutpos)},
+		{"--noise=", offsetof(struct gen_opts, noise)},
+		{"--seed=", offsetof(struct gen_opts, seed)},
+	};
+	unsigned i;
+	char *endp;
+
+	for (i = 0; i < sizeof(u32_opts) / sizeof(u32_opts[0]); i++) {
+		size_t len = strlen(u32_opts[i].name);
+		unsigned long val;
+
+		if (strncmp(opt, u32_opts[i].name, len)) continue;
+		val = strtoul(&opt[len], &endp, 0);
+		if ((endp == &opt[len]) || *endp) return 0;
+		*(u32 *) ((u8 *) go + u32_opts[i].offset) = val;
+		return 1;
+	}
+	if (!strncmp(opt, "--ovlbase=", 10)) {
+		unsigned long val = strtoul(&opt[10], &endp, 0);
+		if ((endp == &opt[10]) || *endp || (val > 0xFFFF)) return 0;
+		go->ovlbase = val;
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct gen_opts go = {
+		.novl = 16,
+		.codesiz = 0x20000,
+		.datasiz = 0x4000,
+		.ovlsiz = 0x2000,
+		.density = 5,
+		.relocs = 100,
+		.ovlrelocs = 25,
+		.entries = 0,
+		.lutpos = (u32) -1,
+		.noise = 0,
+		.ovlbase = 0x100,
+		.seed = 1,
+	};
+	FILE *outf;
+	int i;
+	bool ok;
+
+	if (argc < 2) {
+		print_usage(argv[0]);
+		return 0;
+	}
+	for (i = 2; i < argc; i++) {
+		if (!parse_option(&go, argv[i])) {
+			printf("bad option %s\n", argv[i]);
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if ((go.codesiz < 0x100) || (go.codesiz > MAX_ROOTCODE) ||
+		(go.ovlsiz < 0x100) || (go.ovlsiz > 0xFFFF0) ||
+		!go.novl || (go.novl > 0xFFFE) ||
+		(go.entries > 0xFE) || (!go.entries && (go.novl + 4 > 0xFE))) {
+		printf("bad size / count\n");
+		return -1;
+	}
+	if ((go.relocs > 0xFFFF) || (go.ovlrelocs > 0xFFFF)) {
+		printf("too many relocs\n");
+		return -1;
+	}
+	if ((go.datasiz > MAX_DATA) || (((go.codesiz & ~15UL) + go.datasiz) >= MAX_CHUNK)) {
+		printf("root too big\n");
+		return -1;
+	}
+	rng_state = go.seed ? go.seed : 1;
+
+	outf = fopen(argv[1], "wb");
+	if (!outf) {
+		printf("can't open %s\n", argv[1]);
+		return -1;
+	}
+	ok = generate(outf, &go);
+	if (fclose(outf)) ok = 0;
+	return ok ? 0 : -1;
+}